@@ -76,7 +76,7 @@ android {
 
                     cppFlags("-std=c++17", "-fexceptions", "-frtti")
 
-                    targets("lora")
+                    targets("lora", "lora_train")
                 }
             }
         }
@@ -2,3 +2,4 @@
 -keep class com.dark.lora.LoraJNI { *; }
 -keep class com.dark.lora.LoraJNI$LogCallback { *; }
 -keep class com.dark.lora.LoraJNI$StreamCallback { *; }
+-keep class com.dark.lora.LoraTrainJNI { *; }
@@ -0,0 +1,297 @@
+// lora-bench — reproducible inference benchmark over the engine (see lora_engine.h)
+//
+//   lora-bench -m model.gguf [-p 32,128,512] [-n 32,128] [-t 4,8] [-b 512] [-ub 256]
+//              [-fa 0,1] [-r 5] [-o results.json]
+//
+// Runs every combination of the listed values with greedy sampling and EOS ignored, so
+// each run produces exactly the requested number of tokens. Each repetition uses a fresh
+// session (no KV reuse). Results are JSON with percentiles for TTFT, per-token latency
+// and prefill/decode throughput — compare files across builds to catch regressions.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "lora_engine.h"
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [options]\n"
+            "\n"
+            "Lists are comma separated; every combination is run.\n"
+            "\n"
+            "  -m, --model         model GGUF\n"
+            "  -p, --n-prompt      prompt lengths in tokens (default 32,128,512)\n"
+            "  -n, --n-gen         generated tokens (default 32,128)\n"
+            "  -t, --threads       thread counts (default: cores - 2)\n"
+            "  -b, --batch-size    n_batch values (default 512)\n"
+            "  -ub, --ubatch-size  n_ubatch values (default 256)\n"
+            "  -fa, --flash-attn   flash attention 0/1 (default 0,1)\n"
+            "  -c, --ctx           context size (default: largest prompt + gen, rounded up)\n"
+            "  -r, --repetitions   measured runs per combination (default 5)\n"
+            "  -w, --warmup        unmeasured runs per combination (default 1)\n"
+            "  -ngl                layers offloaded to the NPU (default 0)\n"
+            "  -o, --output        write JSON here instead of stdout\n",
+            argv0);
+}
+
+static bool parse_list(const char * arg, std::vector<int> & out) {
+    out.clear();
+    const char * p = arg;
+    while (*p) {
+        char * end = nullptr;
+        long v = strtol(p, &end, 10);
+        if (end == p) return false;
+        out.push_back((int) v);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return false;
+    }
+    return !out.empty();
+}
+
+// Summary of a sample: mean, min/max and nearest-rank percentiles
+struct summary {
+    size_t n = 0;
+    double mean = 0, min = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+};
+
+static summary summarize(std::vector<double> v) {
+    summary s;
+    if (v.empty()) return s;
+    std::sort(v.begin(), v.end());
+    auto pct = [&v](double q) {
+        size_t rank = (size_t) (q * (double) v.size() + 0.999999);
+        return v[std::min(v.size(), std::max<size_t>(rank, 1)) - 1];
+    };
+    double sum = 0;
+    for (double x : v) sum += x;
+    s.n    = v.size();
+    s.mean = sum / (double) v.size();
+    s.min  = v.front();
+    s.p50  = pct(0.50);
+    s.p90  = pct(0.90);
+    s.p99  = pct(0.99);
+    s.max  = v.back();
+    return s;
+}
+
+static std::string summary_json(const summary & s) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"n\":%zu,\"mean\":%.3f,\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+             s.n, s.mean, s.min, s.p50, s.p90, s.p99, s.max);
+    return buf;
+}
+
+static std::string json_escape(const std::string & in) {
+    std::string out;
+    for (char c : in) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if ((unsigned char) c < 0x20) out += ' ';
+        else out += c;
+    }
+    return out;
+}
+
+// Build a prompt of exactly n_tokens (as the engine tokenizes it), or as close as the
+// tokenizer allows. Deterministic, so runs on different builds see the same input.
+static std::string make_prompt(int n_tokens) {
+    static const char * words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "while", "seven",
+        "engineers", "measure", "latency", "across", "different", "phones", "and", "record", "every", "result",
+    };
+    const int n_words = (int) (sizeof(words) / sizeof(words[0]));
+    auto build = [&](int count) {
+        std::string text;
+        for (int i = 0; i < count; i++) {
+            if (i) text += ' ';
+            text += words[(i * 7 + i / n_words) % n_words];
+        }
+        return text;
+    };
+
+    // Token count grows monotonically with the word count — binary search the word count
+    int lo = 1, hi = std::max(2, n_tokens * 2);
+    while (engine_count_tokens(build(hi)) < n_tokens) hi *= 2;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (engine_count_tokens(build(mid)) < n_tokens) lo = mid + 1;
+        else hi = mid;
+    }
+    return build(lo);
+}
+
+int main(int argc, char ** argv) {
+    std::string model_path;
+    std::string output_path;
+    std::vector<int> n_prompts  = { 32, 128, 512 };
+    std::vector<int> n_gens     = { 32, 128 };
+    std::vector<int> threads    = { std::max(2, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2) };
+    std::vector<int> batches    = { 512 };
+    std::vector<int> ubatches   = { 256 };
+    std::vector<int> flash      = { 0, 1 };
+    int n_ctx   = 0;
+    int reps    = 5;
+    int warmup  = 1;
+    int n_gpu   = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        bool ok = has_value;
+        if ((!strcmp(arg, "-m") || !strcmp(arg, "--model")) && has_value) {
+            model_path = argv[++i];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && has_value) {
+            output_path = argv[++i];
+        } else if ((!strcmp(arg, "-p") || !strcmp(arg, "--n-prompt")) && has_value) {
+            ok = parse_list(argv[++i], n_prompts);
+        } else if ((!strcmp(arg, "-n") || !strcmp(arg, "--n-gen")) && has_value) {
+            ok = parse_list(argv[++i], n_gens);
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && has_value) {
+            ok = parse_list(argv[++i], threads);
+        } else if ((!strcmp(arg, "-b") || !strcmp(arg, "--batch-size")) && has_value) {
+            ok = parse_list(argv[++i], batches);
+        } else if ((!strcmp(arg, "-ub") || !strcmp(arg, "--ubatch-size")) && has_value) {
+            ok = parse_list(argv[++i], ubatches);
+        } else if ((!strcmp(arg, "-fa") || !strcmp(arg, "--flash-attn")) && has_value) {
+            ok = parse_list(argv[++i], flash);
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--ctx")) && has_value) {
+            n_ctx = atoi(argv[++i]);
+        } else if ((!strcmp(arg, "-r") || !strcmp(arg, "--repetitions")) && has_value) {
+            reps = std::max(1, atoi(argv[++i]));
+        } else if ((!strcmp(arg, "-w") || !strcmp(arg, "--warmup")) && has_value) {
+            warmup = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(arg, "-ngl") && has_value) {
+            n_gpu = atoi(argv[++i]);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (model_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (n_ctx <= 0) {
+        int need = *std::max_element(n_prompts.begin(), n_prompts.end()) +
+                   *std::max_element(n_gens.begin(), n_gens.end()) + 16;
+        n_ctx = (need + 255) / 256 * 256;
+    }
+
+    if (!engine_init_backend("")) return 1;
+    std::string loaded = engine_load_model(model_path, threads[0], n_ctx, n_gpu);
+    if (loaded.compare(0, 6, "ERROR:") == 0) {
+        fprintf(stderr, "%s\n", loaded.c_str());
+        return 1;
+    }
+
+    // Prompts are built once per length so every configuration sees identical input
+    std::vector<std::string> prompts;
+    for (int n : n_prompts) prompts.push_back(make_prompt(n));
+
+    std::string results;
+    bool failed = false;
+    for (int n_threads : threads)
+    for (int n_batch : batches)
+    for (int n_ubatch : ubatches)
+    for (int fa : flash) {
+        if (n_ubatch > n_batch) continue;
+
+        engine_context_params cparams;
+        cparams.n_threads  = n_threads;
+        cparams.n_ctx      = n_ctx;
+        cparams.n_batch    = n_batch;
+        cparams.n_ubatch   = n_ubatch;
+        cparams.flash_attn = fa;
+        std::string status = engine_set_context_params(cparams);
+        if (status.compare(0, 6, "ERROR:") == 0) {
+            fprintf(stderr, "%s (t=%d b=%d ub=%d fa=%d)\n", status.c_str(), n_threads, n_batch, n_ubatch, fa);
+            failed = true;
+            continue;
+        }
+
+        for (size_t ip = 0; ip < n_prompts.size(); ip++)
+        for (int n_gen : n_gens) {
+            std::vector<double> ttft, token_ms, prefill_tps, decode_tps;
+            int n_prompt_actual = 0;
+            std::string error;
+
+            for (int rep = 0; rep < warmup + reps && error.empty(); rep++) {
+                int32_t session = engine_create_session();
+                if (session < 0) {
+                    error = "ERROR: No free session";
+                    break;
+                }
+                engine_gen_stats stats;
+                bool ok = engine_generate_session(session, prompts[ip], n_gen, 0.0f,
+                                                  nullptr, nullptr, &error, &stats, true);
+                engine_destroy_session(session);
+                if (!ok || rep < warmup) continue;
+
+                n_prompt_actual = stats.n_prompt;
+                ttft.push_back(stats.ttft_ms);
+                token_ms.insert(token_ms.end(), stats.token_ms.begin(), stats.token_ms.end());
+                if (stats.prefill_ms > 0) {
+                    prefill_tps.push_back((stats.n_prompt - stats.n_reused) * 1000.0 / stats.prefill_ms);
+                }
+                if (stats.decode_ms > 0 && stats.n_generated > 1) {
+                    decode_tps.push_back((stats.n_generated - 1) * 1000.0 / stats.decode_ms);
+                }
+            }
+
+            char head[256];
+            snprintf(head, sizeof(head),
+                     "{\"n_prompt\":%d,\"n_prompt_actual\":%d,\"n_gen\":%d,\"n_threads\":%d,"
+                     "\"n_batch\":%d,\"n_ubatch\":%d,\"flash_attn\":%d",
+                     n_prompts[ip], n_prompt_actual, n_gen, n_threads, n_batch, n_ubatch, fa);
+
+            std::string row = head;
+            if (!error.empty()) {
+                fprintf(stderr, "%s\n", error.c_str());
+                row += ",\"error\":\"" + json_escape(error) + "\"}";
+                failed = true;
+            } else {
+                row += ",\"ttft_ms\":"       + summary_json(summarize(ttft));
+                row += ",\"token_ms\":"      + summary_json(summarize(token_ms));
+                row += ",\"prefill_tok_s\":" + summary_json(summarize(prefill_tps));
+                row += ",\"decode_tok_s\":"  + summary_json(summarize(decode_tps));
+                row += "}";
+            }
+            if (!results.empty()) results += ",\n    ";
+            results += row;
+        }
+    }
+
+    engine_cleanup();
+
+    char meta[256];
+    snprintf(meta, sizeof(meta),
+             "  \"n_ctx\": %d,\n  \"n_gpu_layers\": %d,\n"
+             "  \"repetitions\": %d,\n  \"warmup\": %d,\n  \"n_cpus\": %d,\n",
+             n_ctx, n_gpu, reps, warmup, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    std::string json = "{\n  \"model\": \"" + json_escape(model_path) + "\",\n" + meta +
+                       "  \"results\": [\n    " + results + "\n  ]\n}\n";
+
+    if (output_path.empty()) {
+        fputs(json.c_str(), stdout);
+    } else {
+        FILE * f = fopen(output_path.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "ERROR: Failed to write %s\n", output_path.c_str());
+            return 1;
+        }
+        fputs(json.c_str(), f);
+        fclose(f);
+        fprintf(stderr, "Results written to %s\n", output_path.c_str());
+    }
+    return failed ? 1 : 0;
+}
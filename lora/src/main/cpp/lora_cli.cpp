@@ -0,0 +1,310 @@
+// lora-cli — host driver for the native core (see lora_engine.h / lora_train_engine.h)
+//
+//   lora-cli generate -m model.gguf [-a adapter.gguf] -p "prompt" [-n 128] [--temp 0.7]
+//   lora-cli train    -m model.gguf -d data.txt|data.jsonl -o adapter.gguf [--rank 8] [--epochs 1]
+//
+// Runs the same code paths as the app, so hot paths can be profiled off-device.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "lora_engine.h"
+#include "lora_train_engine.h"
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr,
+            "usage: %s generate -m MODEL.gguf (-p PROMPT | -f PROMPT.txt) [options]\n"
+            "       %s train    -m MODEL.gguf -d DATA.txt -o ADAPTER.gguf [options]\n"
+            "\n"
+            "common:\n"
+            "  -m, --model      model GGUF\n"
+            "  -t, --threads    threads (default: cores - 2)\n"
+            "  -c, --ctx        context size (default: generate 2048, train 512)\n"
+            "\n"
+            "generate:\n"
+            "  -p, --prompt     prompt text\n"
+            "  -f, --file       read the prompt from a file\n"
+            "  -a, --adapter    LoRA adapter GGUF\n"
+            "  -n, --n-predict  max tokens to generate (default 128)\n"
+            "      --temp       temperature, 0 = greedy (default 0.7)\n"
+            "      --draft      draft model GGUF for speculative decoding\n"
+            "      --n-draft    draft tokens per step (default 4)\n"
+            "      --lookup     prompt lookup decoding\n"
+            "      --chat       wrap the prompt in the model's chat template\n"
+            "\n"
+            "train:\n"
+            "  -d, --data       training text file, or .jsonl with \"text\" or chat \"messages\" per line\n"
+            "      --tokens     token file written while loading the data (default: DATA.tokens)\n"
+            "      --pack       pack whole documents (JSONL lines) into n_ctx windows\n"
+            "      --steps      windows per epoch, sampled with replacement (default: one pass)\n"
+            "      --ubatch     micro-batch tokens, gradients accumulated per window (default: n_ctx)\n"
+            "      --qlora      keep the base mapped in its quantized GGUF types\n"
+            "      --f16-kv     F16 instead of F32 K/V cache\n"
+            "      --governor   adapt the thread count to temperature and throughput\n"
+            "      --thermal-root thermal zones directory (default /sys/class/thermal)\n"
+            "      --max-temp   governor temperature limit in C (default 75)\n"
+            "  -o, --output     adapter output GGUF\n"
+            "  -a, --adapter    continue training an existing adapter\n"
+            "      --rank       LoRA rank (default 8)\n"
+            "      --alpha      LoRA alpha (default 16)\n"
+            "      --skip       leading layers without LoRA (default 0)\n"
+            "      --targets    only these modules, e.g. attn_q,attn_v (or globs like 'blk.1?.attn_*')\n"
+            "      --layer-ranks rank of layer 0,1,... with --targets, 0 = none (default: --skip, then --rank)\n"
+            "      --lr         learning rate (default 1e-4)\n"
+            "      --epochs     epochs (default 1)\n"
+            "      --checkpoint checkpoint file, rewritten every --ckpt-every steps and per epoch\n"
+            "      --ckpt-every optimizer steps between checkpoints (default 50)\n"
+            "      --resume     continue from a checkpoint (same data and -c)\n",
+            argv0, argv0);
+}
+
+static bool read_file(const std::string & path, std::string & out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+static bool is_error(const std::string & result) {
+    return result.compare(0, 6, "ERROR:") == 0;
+}
+
+static std::vector<std::string> split_list(const std::string & list) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        if (end > pos) out.push_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return out;
+}
+
+static void print_text(const std::string & text, void * /* user_data */) {
+    fputs(text.c_str(), stdout);
+    fflush(stdout);
+}
+
+struct cli_params {
+    std::string model_path;
+    std::string prompt;
+    std::string adapter_path;
+    std::string draft_path;
+    std::string data_path;
+    std::string output_path;
+    std::string tokens_path;
+    int         n_threads   = 0;
+    int         n_ctx       = 0;
+    int         n_predict   = 128;
+    int         n_draft     = 4;
+    float       temperature = 0.7f;
+    bool        lookup      = false;
+    bool        chat        = false;
+    bool        pack        = false;
+    int         steps       = 0;
+    int         n_ubatch    = 0;
+    bool        qlora       = false;
+    bool        f16_kv      = false;
+    bool        governor    = false;
+    std::string thermal_root;
+    float       max_temp_c  = 0.0f;
+    int         rank        = 8;
+    float       alpha       = 16.0f;
+    int         n_skip      = 0;
+    std::string targets;
+    std::string layer_ranks;
+    float       lr          = 1e-4f;
+    int         epochs      = 1;
+    std::string checkpoint_path;
+    int         ckpt_every  = 50;
+    std::string resume_path;
+};
+
+static int run_generate(const cli_params & params) {
+    if (!engine_init_backend("")) return 1;
+
+    std::string result = engine_load_model(params.model_path, params.n_threads, params.n_ctx, 0);
+    fprintf(stderr, "%s\n", result.c_str());
+    if (is_error(result)) return 1;
+
+    if (!params.adapter_path.empty()) {
+        result = engine_load_lora_adapter(params.adapter_path);
+        if (is_error(result)) { fprintf(stderr, "%s\n", result.c_str()); return 1; }
+    }
+    if (!params.draft_path.empty()) {
+        result = engine_load_draft_model(params.draft_path, params.n_draft);
+        if (is_error(result)) { fprintf(stderr, "%s\n", result.c_str()); return 1; }
+    }
+    if (params.lookup) {
+        engine_set_lookup_decoding(true, params.n_draft);
+    }
+
+    std::string prompt = params.prompt;
+    if (params.chat) {
+        std::string formatted = engine_apply_chat_template({ "user" }, { prompt }, true);
+        if (!formatted.empty()) prompt = formatted;
+    }
+
+    std::string error;
+    bool ok = engine_generate_session(ENGINE_DEFAULT_SESSION, prompt, params.n_predict, params.temperature,
+                                      print_text, nullptr, &error);
+    fputc('\n', stdout);
+    if (!ok) fprintf(stderr, "%s\n", error.c_str());
+
+    engine_cleanup();
+    return ok ? 0 : 1;
+}
+
+static int run_train(const cli_params & params) {
+    if (!train_init_backend("")) return 1;
+
+    auto step = [](const std::string & result) {
+        fprintf(stderr, "%s\n", result.c_str());
+        return !is_error(result);
+    };
+
+    train_set_micro_batch(params.n_ubatch);
+    train_set_qlora(params.qlora, params.f16_kv);
+    bool ok = step(train_load_model(params.model_path, params.n_threads, params.n_ctx));
+    if (ok && params.resume_path.empty()) {
+        if (!params.adapter_path.empty()) {
+            ok = step(train_load_lora_adapter(params.adapter_path));
+        } else if (!params.targets.empty()) {
+            // The initial adapter goes to the output path; the trained one replaces it
+            std::vector<std::string> targets = split_list(params.targets);
+            std::vector<int> layer_ranks;
+            for (const std::string & r : split_list(params.layer_ranks)) layer_ranks.push_back(atoi(r.c_str()));
+            if (layer_ranks.empty()) layer_ranks.assign((size_t) std::max(0, params.n_skip), 0);
+            ok = step(train_create_targeted_lora_adapter(targets, layer_ranks, params.rank, params.alpha,
+                                                         params.output_path));
+        } else {
+            ok = step(train_create_lora_adapter(params.rank, params.alpha, params.n_skip));
+        }
+    }
+    train_set_packing(params.pack);
+    if (params.governor) train_set_thread_governor(true, params.thermal_root, params.max_temp_c);
+    train_set_steps_per_epoch(params.steps);
+    train_set_checkpoint(params.checkpoint_path, params.ckpt_every);
+    ok = ok && step(train_set_training_file(params.data_path, params.tokens_path));
+    if (ok && !params.resume_path.empty()) {
+        ok = step(train_resume_training(params.resume_path));
+    }
+    const int first_epoch = std::max(0, train_get_resume_epoch());
+    ok = ok && step(train_init_training(params.lr, params.epochs));
+    for (int epoch = first_epoch; ok && epoch < params.epochs; epoch++) {
+        ok = step(train_epoch(epoch));
+    }
+    ok = ok && step(train_save_lora_adapter(params.output_path));
+
+    train_cleanup();
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const std::string command = argv[1];
+
+    cli_params params;
+    std::string prompt_file;
+    for (int i = 2; i < argc; i++) {
+        const char * arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ((!strcmp(arg, "-m") || !strcmp(arg, "--model")) && has_value) {
+            params.model_path = argv[++i];
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && has_value) {
+            params.n_threads = atoi(argv[++i]);
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--ctx")) && has_value) {
+            params.n_ctx = atoi(argv[++i]);
+        } else if ((!strcmp(arg, "-p") || !strcmp(arg, "--prompt")) && has_value) {
+            params.prompt = argv[++i];
+        } else if ((!strcmp(arg, "-f") || !strcmp(arg, "--file")) && has_value) {
+            prompt_file = argv[++i];
+        } else if ((!strcmp(arg, "-a") || !strcmp(arg, "--adapter")) && has_value) {
+            params.adapter_path = argv[++i];
+        } else if ((!strcmp(arg, "-n") || !strcmp(arg, "--n-predict")) && has_value) {
+            params.n_predict = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--temp") && has_value) {
+            params.temperature = strtof(argv[++i], nullptr);
+        } else if (!strcmp(arg, "--draft") && has_value) {
+            params.draft_path = argv[++i];
+        } else if (!strcmp(arg, "--n-draft") && has_value) {
+            params.n_draft = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--lookup")) {
+            params.lookup = true;
+        } else if (!strcmp(arg, "--chat")) {
+            params.chat = true;
+        } else if ((!strcmp(arg, "-d") || !strcmp(arg, "--data")) && has_value) {
+            params.data_path = argv[++i];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && has_value) {
+            params.output_path = argv[++i];
+        } else if (!strcmp(arg, "--steps") && has_value) {
+            params.steps = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--ubatch") && has_value) {
+            params.n_ubatch = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--pack")) {
+            params.pack = true;
+        } else if (!strcmp(arg, "--checkpoint") && has_value) {
+            params.checkpoint_path = argv[++i];
+        } else if (!strcmp(arg, "--ckpt-every") && has_value) {
+            params.ckpt_every = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--resume") && has_value) {
+            params.resume_path = argv[++i];
+        } else if (!strcmp(arg, "--qlora")) {
+            params.qlora = true;
+        } else if (!strcmp(arg, "--targets") && has_value) {
+            params.targets = argv[++i];
+        } else if (!strcmp(arg, "--layer-ranks") && has_value) {
+            params.layer_ranks = argv[++i];
+        } else if (!strcmp(arg, "--f16-kv")) {
+            params.f16_kv = true;
+        } else if (!strcmp(arg, "--governor")) {
+            params.governor = true;
+        } else if (!strcmp(arg, "--thermal-root") && has_value) {
+            params.thermal_root = argv[++i];
+        } else if (!strcmp(arg, "--max-temp") && has_value) {
+            params.max_temp_c = strtof(argv[++i], nullptr);
+        } else if (!strcmp(arg, "--tokens") && has_value) {
+            params.tokens_path = argv[++i];
+        } else if (!strcmp(arg, "--rank") && has_value) {
+            params.rank = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--alpha") && has_value) {
+            params.alpha = strtof(argv[++i], nullptr);
+        } else if (!strcmp(arg, "--skip") && has_value) {
+            params.n_skip = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--lr") && has_value) {
+            params.lr = strtof(argv[++i], nullptr);
+        } else if (!strcmp(arg, "--epochs") && has_value) {
+            params.epochs = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!prompt_file.empty() && !read_file(prompt_file, params.prompt)) {
+        fprintf(stderr, "ERROR: Failed to read %s\n", prompt_file.c_str());
+        return 1;
+    }
+
+    if (command == "generate" && !params.model_path.empty() && !params.prompt.empty()) {
+        return run_generate(params);
+    }
+    if (command == "train" && !params.model_path.empty() && !params.data_path.empty() &&
+        !params.output_path.empty()) {
+        return run_train(params);
+    }
+    print_usage(argv[0]);
+    return 1;
+}
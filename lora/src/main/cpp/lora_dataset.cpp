@@ -0,0 +1,927 @@
+#include "lora_dataset.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ggml.h"
+#include "common.h"
+#include "lora_log.h"
+
+#define DATASET_CHUNK_BYTES (1 << 20)   // Text per tokenizer work item
+#define HASH_SEED 0xcbf29ce484222325ULL   // FNV-1a offset basis
+
+// ============================================
+// Dataset: Memory map
+// ============================================
+bool dataset_mmap_open(const std::string & path, dataset_mmap * map, std::string * error) {
+    *map = dataset_mmap();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = "failed to open " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        *error = "failed to stat " + path;
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;   // Empty file: valid, nothing mapped
+    }
+
+    void * addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        *error = "failed to map " + path;
+        return false;
+    }
+    madvise(addr, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    map->data = (const uint8_t *) addr;
+    map->size = (size_t) st.st_size;
+    return true;
+}
+
+void dataset_mmap_close(dataset_mmap * map) {
+    if (map->data) munmap((void *) map->data, map->size);
+    *map = dataset_mmap();
+}
+
+// ============================================
+// Dataset: Minimal JSON reading (JSONL records)
+// ============================================
+static const char * json_skip_ws(const char * p, const char * end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+static void utf8_append(std::string & out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char) cp;
+    } else if (cp < 0x800) {
+        out += (char) (0xC0 | (cp >> 6));
+        out += (char) (0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char) (0xE0 | (cp >> 12));
+        out += (char) (0x80 | ((cp >> 6) & 0x3F));
+        out += (char) (0x80 | (cp & 0x3F));
+    } else {
+        out += (char) (0xF0 | (cp >> 18));
+        out += (char) (0x80 | ((cp >> 12) & 0x3F));
+        out += (char) (0x80 | ((cp >> 6) & 0x3F));
+        out += (char) (0x80 | (cp & 0x3F));
+    }
+}
+
+static bool json_hex4(const char * p, const char * end, uint32_t * out) {
+    if (end - p < 4) return false;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= (uint32_t) (c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (uint32_t) (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (uint32_t) (c - 'A' + 10);
+        else return false;
+    }
+    *out = v;
+    return true;
+}
+
+// Parses the string starting at p (on the opening quote); returns the position after it, or nullptr
+static const char * json_parse_string(const char * p, const char * end, std::string * out) {
+    if (p >= end || *p != '"') return nullptr;
+    p++;
+    if (out) out->clear();
+    while (p < end) {
+        char c = *p++;
+        if (c == '"') return p;
+        if (c != '\\') {
+            if (out) *out += c;
+            continue;
+        }
+        if (p >= end) return nullptr;
+        char e = *p++;
+        uint32_t cp = 0;
+        switch (e) {
+            case '"':  cp = '"';  break;
+            case '\\': cp = '\\'; break;
+            case '/':  cp = '/';  break;
+            case 'b':  cp = '\b'; break;
+            case 'f':  cp = '\f'; break;
+            case 'n':  cp = '\n'; break;
+            case 'r':  cp = '\r'; break;
+            case 't':  cp = '\t'; break;
+            case 'u':
+                if (!json_hex4(p, end, &cp)) return nullptr;
+                p += 4;
+                // Surrogate pair
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    uint32_t lo = 0;
+                    if (json_hex4(p + 2, end, &lo) && lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                break;
+            default:
+                return nullptr;
+        }
+        if (out) utf8_append(*out, cp);
+    }
+    return nullptr;
+}
+
+// Skips any JSON value; returns the position after it, or nullptr
+static const char * json_skip_value(const char * p, const char * end) {
+    p = json_skip_ws(p, end);
+    if (p >= end) return nullptr;
+    if (*p == '"') return json_parse_string(p, end, nullptr);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                p = json_parse_string(p, end, nullptr);
+                if (!p) return nullptr;
+                continue;
+            }
+            if (*p == '{' || *p == '[') depth++;
+            else if (*p == '}' || *p == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            p++;
+        }
+        return nullptr;
+    }
+    // Number / true / false / null
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') p++;
+    return p;
+}
+
+// Finds a top-level string field of the object starting at p; false if absent or not a string
+static bool json_string_field(const char * p, const char * end, const char * key, std::string * out) {
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != '{') return false;
+    p++;
+    std::string name;
+    while (true) {
+        p = json_skip_ws(p, end);
+        if (p >= end || *p == '}') return false;
+        p = json_parse_string(p, end, &name);
+        if (!p) return false;
+        p = json_skip_ws(p, end);
+        if (p >= end || *p != ':') return false;
+        p = json_skip_ws(p + 1, end);
+        if (name == key) {
+            return p < end && *p == '"' && json_parse_string(p, end, out) != nullptr;
+        }
+        p = json_skip_value(p, end);
+        if (!p) return false;
+        p = json_skip_ws(p, end);
+        if (p < end && *p == ',') p++;
+    }
+}
+
+// ============================================
+// Dataset: Chat records
+// ============================================
+// Finds a top-level field of the object starting at p; returns the start of its value, or nullptr
+static const char * json_field(const char * p, const char * end, const char * key) {
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != '{') return nullptr;
+    p++;
+    std::string name;
+    while (true) {
+        p = json_skip_ws(p, end);
+        if (p >= end || *p == '}') return nullptr;
+        p = json_parse_string(p, end, &name);
+        if (!p) return nullptr;
+        p = json_skip_ws(p, end);
+        if (p >= end || *p != ':') return nullptr;
+        p = json_skip_ws(p + 1, end);
+        if (name == key) return p;
+        p = json_skip_value(p, end);
+        if (!p) return nullptr;
+        p = json_skip_ws(p, end);
+        if (p < end && *p == ',') p++;
+    }
+}
+
+// Parses a "messages" array of {"role", "content"} objects
+static bool json_messages(const char * p, const char * end,
+                          std::vector<std::string> * roles, std::vector<std::string> * contents) {
+    roles->clear();
+    contents->clear();
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != '[') return false;
+    p++;
+    std::string role, content;
+    while (true) {
+        p = json_skip_ws(p, end);
+        if (p >= end) return false;
+        if (*p == ']') return !roles->empty();
+        const char * next = json_skip_value(p, end);
+        if (!next) return false;
+        if (!json_string_field(p, next, "role", &role) || !json_string_field(p, next, "content", &content)) {
+            return false;
+        }
+        roles->push_back(role);
+        contents->push_back(content);
+        p = json_skip_ws(next, end);
+        if (p < end && *p == ',') p++;
+    }
+}
+
+// Formats the first n messages with the chat template
+static bool chat_format(const char * tmpl, const std::vector<llama_chat_message> & msgs, size_t n,
+                        bool add_ass, std::string * out) {
+    int32_t needed = llama_chat_apply_template(tmpl, msgs.data(), n, add_ass, nullptr, 0);
+    if (needed < 0) return false;
+    std::vector<char> buf((size_t) needed + 1);
+    llama_chat_apply_template(tmpl, msgs.data(), n, add_ass, buf.data(), (int32_t) buf.size());
+    out->assign(buf.data(), (size_t) needed);
+    return true;
+}
+
+// Formats a conversation and tokenizes it segment by segment, marking the assistant replies
+// (content + end of turn, not the assistant header) in the mask. Templates that don't
+// render each turn as a prefix of the next can't be split; the whole conversation is then
+// marked (*whole = true). Returns false if the template fails.
+static bool tokenize_chat(const llama_vocab * vocab, const char * tmpl,
+                          const std::vector<std::string> & roles, const std::vector<std::string> & contents,
+                          std::vector<llama_token> * tokens, std::vector<uint8_t> * mask, bool * whole) {
+    const size_t n = roles.size();
+    std::vector<llama_chat_message> msgs(n);
+    for (size_t i = 0; i < n; i++) {
+        msgs[i].role    = roles[i].c_str();
+        msgs[i].content = contents[i].c_str();
+    }
+
+    std::string full;
+    if (!chat_format(tmpl, msgs, n, false, &full)) return false;
+
+    // Segment boundaries: [begin, end) character ranges and whether they are assistant output
+    struct segment { size_t begin; size_t end; bool assistant; };
+    std::vector<segment> segments;
+    std::string before, after;
+    size_t pos = 0;
+    *whole = false;
+    for (size_t i = 0; i < n && !*whole; i++) {
+        if (roles[i] != "assistant") continue;
+        if (!chat_format(tmpl, msgs, i, true, &before) || !chat_format(tmpl, msgs, i + 1, false, &after) ||
+            before.size() < pos || before.size() > after.size() ||
+            full.compare(0, after.size(), after) != 0 || after.compare(0, before.size(), before) != 0) {
+            *whole = true;
+            break;
+        }
+        if (before.size() > pos) segments.push_back({ pos, before.size(), false });
+        segments.push_back({ before.size(), after.size(), true });
+        pos = after.size();
+    }
+    if (*whole) {
+        segments.assign(1, { 0, full.size(), true });
+    } else if (pos < full.size()) {
+        segments.push_back({ pos, full.size(), false });
+    }
+
+    // Templates that spell out BOS already get no second one
+    const llama_token bos = llama_vocab_bos(vocab);
+    const char * bos_text = bos != LLAMA_TOKEN_NULL ? llama_vocab_get_text(vocab, bos) : "";
+    const bool add_bos = !*bos_text || full.compare(0, strlen(bos_text), bos_text) != 0;
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        const segment & seg = segments[i];
+        std::vector<llama_token> piece = common_tokenize(vocab, full.substr(seg.begin, seg.end - seg.begin),
+                                                         i == 0 && add_bos, true);
+        tokens->insert(tokens->end(), piece.begin(), piece.end());
+        mask->insert(mask->end(), piece.size(), seg.assistant ? 1 : 0);
+    }
+    return true;
+}
+
+// ============================================
+// Dataset: Parallel tokenization
+// ============================================
+struct tokenize_item {
+    const char * begin = nullptr;
+    const char * end   = nullptr;
+    bool         add_bos = false;   // Plain text: only the first chunk starts a document
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t>     mask;         // JSONL: 1 = assistant output, per token
+    std::vector<uint64_t>    doc_starts;   // Documents starting in this chunk (index into tokens)
+    int64_t      n_chat    = 0;     // Chat records ("messages")
+    int64_t      n_whole   = 0;     // ... whose template couldn't be split into turns
+    int64_t      n_skipped = 0;     // JSONL lines with neither "text" nor usable "messages"
+};
+
+static void tokenize_chunk(const llama_vocab * vocab, const char * tmpl, bool jsonl, tokenize_item * item) {
+    if (!jsonl) {
+        item->tokens = common_tokenize(vocab, std::string(item->begin, item->end), item->add_bos);
+        if (item->add_bos) item->doc_starts.push_back(0);
+        return;
+    }
+    std::string text;
+    std::vector<std::string> roles, contents;
+    const char * p = item->begin;
+    while (p < item->end) {
+        const char * eol = (const char *) memchr(p, '\n', (size_t) (item->end - p));
+        if (!eol) eol = item->end;
+        const char * q = json_skip_ws(p, eol);
+        if (q < eol) {
+            const size_t start = item->tokens.size();
+            const char * messages = tmpl ? json_field(q, eol, "messages") : nullptr;
+            bool whole = false;
+            if (messages && json_messages(messages, eol, &roles, &contents) &&
+                tokenize_chat(vocab, tmpl, roles, contents, &item->tokens, &item->mask, &whole)) {
+                item->doc_starts.push_back(start);
+                item->n_chat++;
+                if (whole) item->n_whole++;
+            } else if (json_string_field(q, eol, "text", &text) && !text.empty()) {
+                std::vector<llama_token> doc = common_tokenize(vocab, text, true);
+                item->doc_starts.push_back(start);
+                item->tokens.insert(item->tokens.end(), doc.begin(), doc.end());
+                item->mask.insert(item->mask.end(), doc.size(), 1);
+            } else {
+                item->tokens.resize(start);
+                item->mask.resize(start);
+                item->n_skipped++;
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+// End of the chunk starting at begin: DATASET_CHUNK_BYTES later, moved forward to the next
+// line break (JSONL: records stay whole) or, for text without one nearby, to a UTF-8 boundary
+static const char * chunk_end(const char * begin, const char * end, bool jsonl) {
+    if (end - begin <= DATASET_CHUNK_BYTES) return end;
+    const char * p = begin + DATASET_CHUNK_BYTES;
+    const char * limit = jsonl ? end : std::min(end, p + DATASET_CHUNK_BYTES / 4);
+    const char * nl = (const char *) memchr(p, '\n', (size_t) (limit - p));
+    if (nl) return nl + 1;
+    if (jsonl) return end;
+    while (p < end && ((unsigned char) *p & 0xC0) == 0x80) p++;
+    return p;
+}
+
+// Tokenizes src in rounds of up to n_threads chunks and hands the chunks to sink in order.
+// *n_chat is set to the number of chat records.
+static bool tokenize_source(
+        const llama_vocab * vocab,
+        const char * tmpl,
+        const dataset_mmap & src,
+        bool jsonl,
+        int n_threads,
+        const std::function<bool(const tokenize_item &)> & sink,
+        int64_t * n_chat) {
+    const char * p   = (const char *) src.data;
+    const char * end = p ? p + src.size : nullptr;
+    int64_t n_skipped = 0, n_whole = 0;
+    *n_chat = 0;
+
+    while (p < end) {
+        std::vector<tokenize_item> items;
+        while (p < end && (int) items.size() < n_threads) {
+            tokenize_item item;
+            item.begin   = p;
+            item.end     = chunk_end(p, end, jsonl);
+            item.add_bos = !jsonl && p == (const char *) src.data;
+            items.push_back(std::move(item));
+            p = items.back().end;
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < items.size(); i++) {
+            workers.emplace_back(tokenize_chunk, vocab, tmpl, jsonl, &items[i]);
+        }
+        tokenize_chunk(vocab, tmpl, jsonl, &items[0]);
+        for (auto & th : workers) th.join();
+
+        for (const auto & item : items) {
+            n_skipped += item.n_skipped;
+            n_whole   += item.n_whole;
+            *n_chat   += item.n_chat;
+            if (!sink(item)) return false;
+        }
+    }
+
+    if (n_skipped > 0) {
+        ui_log("Dataset: skipped %lld JSONL lines without \"text\" or usable \"messages\"", (long long) n_skipped);
+    }
+    if (n_whole > 0) {
+        ui_log("Dataset: %lld conversations trained on every token (template turns aren't prefixes)",
+               (long long) n_whole);
+    }
+    return true;
+}
+
+// Writes the cache file: header, tokens, document starts and (chat data) the loss mask.
+// Written to a temporary file and renamed, so a killed process never leaves a truncated
+// cache behind.
+static bool tokenize_to_cache(
+        const llama_vocab * vocab,
+        const char * tmpl,
+        const dataset_mmap & src,
+        bool jsonl,
+        const dataset_cache_header & base,
+        const std::string & dst_path,
+        int n_threads,
+        std::string * error) {
+    const std::string tmp_path = dst_path + ".tmp";
+    FILE * out = fopen(tmp_path.c_str(), "wb");
+    if (!out) {
+        *error = "failed to create " + tmp_path;
+        return false;
+    }
+
+    dataset_cache_header header = base;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;   // Placeholder, counts patched below
+
+    // Tokens stream to disk; document starts and the mask (1 byte per token) stay in memory
+    std::vector<uint64_t> doc_starts;
+    std::vector<uint8_t>  mask;
+    int64_t n_tokens = 0;
+    int64_t n_chat   = 0;
+    ok = ok && tokenize_source(vocab, tmpl, src, jsonl, n_threads, [&](const tokenize_item & item) {
+        for (uint64_t start : item.doc_starts) doc_starts.push_back((uint64_t) n_tokens + start);
+        mask.insert(mask.end(), item.mask.begin(), item.mask.end());
+        if (item.tokens.empty()) return true;
+        if (fwrite(item.tokens.data(), sizeof(llama_token), item.tokens.size(), out) != item.tokens.size()) {
+            return false;
+        }
+        n_tokens += (int64_t) item.tokens.size();
+        return true;
+    }, &n_chat);
+    if (doc_starts.empty() && n_tokens > 0) doc_starts.push_back(0);
+
+    // Document starts follow the tokens, 8-byte aligned; the mask (chat data only) follows them
+    static const char zeros[8] = {};
+    const uint64_t tokens_end = sizeof(header) + (uint64_t) n_tokens * sizeof(llama_token);
+    header.n_tokens    = (uint64_t) n_tokens;
+    header.n_docs      = doc_starts.size();
+    header.docs_offset = (tokens_end + 7) / 8 * 8;
+    header.mask_offset = n_chat > 0 ? header.docs_offset + header.n_docs * sizeof(uint64_t) : 0;
+    if (ok && header.docs_offset > tokens_end) {
+        ok = fwrite(zeros, 1, (size_t) (header.docs_offset - tokens_end), out) == header.docs_offset - tokens_end;
+    }
+    if (ok && !doc_starts.empty()) {
+        ok = fwrite(doc_starts.data(), sizeof(uint64_t), doc_starts.size(), out) == doc_starts.size();
+    }
+    if (ok && header.mask_offset != 0) {
+        ok = mask.size() == (size_t) n_tokens && fwrite(mask.data(), 1, mask.size(), out) == mask.size();
+    }
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    if (fclose(out) != 0) ok = false;
+    if (ok && rename(tmp_path.c_str(), dst_path.c_str()) != 0) ok = false;
+    if (!ok) {
+        remove(tmp_path.c_str());
+        *error = "failed to write " + dst_path;
+        return false;
+    }
+    return true;
+}
+
+// ============================================
+// Dataset: Token cache
+// ============================================
+// 64-bit FNV-1a over 8-byte words (bytes for the tail) — fast enough to hash a corpus on
+// every load, and only used to detect a changed source, not for security
+static uint64_t hash_bytes(uint64_t h, const uint8_t * data, size_t size) {
+    const uint64_t prime = 0x100000001b3ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * prime;
+    }
+    for (; i < size; i++) h = (h ^ data[i]) * prime;
+    return h;
+}
+
+uint64_t dataset_vocab_hash(const llama_vocab * vocab, const char * chat_template) {
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t type    = (int32_t) llama_vocab_type(vocab);
+    uint64_t h = HASH_SEED;
+    h = hash_bytes(h, (const uint8_t *) &n_vocab, sizeof(n_vocab));
+    h = hash_bytes(h, (const uint8_t *) &type, sizeof(type));
+    for (int32_t id = 0; id < n_vocab; id++) {
+        const char * text = llama_vocab_get_text(vocab, id);
+        h = hash_bytes(h, (const uint8_t *) text, strlen(text) + 1);
+    }
+    if (chat_template) {
+        h = hash_bytes(h, (const uint8_t *) chat_template, strlen(chat_template));
+    }
+    return h;
+}
+
+// Maps a cache file and checks it against the expected header; *reason says why it can't be used
+static bool cache_open(const std::string & path, const dataset_cache_header & expect,
+                       dataset_tokens * out, std::string * reason) {
+    if (access(path.c_str(), R_OK) != 0) {
+        *reason = "no token cache";
+        return false;
+    }
+    dataset_mmap map;
+    if (!dataset_mmap_open(path, &map, reason)) return false;
+
+    dataset_cache_header header;
+    if (map.size < sizeof(header)) {
+        dataset_mmap_close(&map);
+        *reason = "token cache truncated";
+        return false;
+    }
+    memcpy(&header, map.data, sizeof(header));
+
+    const uint64_t docs_end = header.docs_offset + header.n_docs * sizeof(uint64_t);
+    const char * mismatch = nullptr;
+    if (memcmp(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic)) != 0) mismatch = "not a token cache";
+    else if (header.version != DATASET_CACHE_VERSION)   mismatch = "token cache version changed";
+    else if (header.header_size != sizeof(header))      mismatch = "token cache header size changed";
+    else if (header.vocab_hash != expect.vocab_hash)    mismatch = "vocabulary or chat template changed";
+    else if (header.source_hash != expect.source_hash ||
+             header.source_size != expect.source_size)  mismatch = "source changed";
+    else if (header.jsonl != expect.jsonl)              mismatch = "source format changed";
+    else if (header.docs_offset < sizeof(header) + header.n_tokens * sizeof(llama_token) ||
+             header.docs_offset % 8 != 0 || map.size < docs_end ||
+             (header.mask_offset != 0 &&
+              (header.mask_offset < docs_end || map.size < header.mask_offset + header.n_tokens))) {
+        mismatch = "token cache truncated";
+    }
+    if (mismatch) {
+        dataset_mmap_close(&map);
+        *reason = mismatch;
+        return false;
+    }
+
+    out->map        = map;
+    out->tokens     = (const llama_token *) (map.data + sizeof(header));
+    out->n_tokens   = (int64_t) header.n_tokens;
+    out->doc_starts = (const uint64_t *) (map.data + header.docs_offset);
+    out->n_docs     = (int64_t) header.n_docs;
+    out->loss_mask  = header.mask_offset ? map.data + header.mask_offset : nullptr;
+    return true;
+}
+
+static bool ends_with(const std::string & s, const char * suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Source bytes -> mapped cache, tokenizing only when the cache is missing or stale
+static bool load_source(
+        const llama_vocab * vocab,
+        const char * tmpl,
+        const dataset_mmap & src,
+        bool jsonl,
+        const std::string & src_name,
+        const std::string & cache_path,
+        int n_threads,
+        dataset_tokens * out,
+        bool * from_cache,
+        std::string * error) {
+    dataset_cache_header expect;
+    memcpy(expect.magic, DATASET_CACHE_MAGIC, sizeof(expect.magic));
+    expect.version     = DATASET_CACHE_VERSION;
+    expect.header_size = sizeof(expect);
+    expect.jsonl       = jsonl ? 1 : 0;
+    expect.vocab_hash  = dataset_vocab_hash(vocab, tmpl);
+    expect.source_hash = hash_bytes(HASH_SEED, src.data, src.size);
+    expect.source_size = src.size;
+
+    std::string reason;
+    if (cache_open(cache_path, expect, out, &reason)) {
+        *from_cache = true;
+        return true;
+    }
+    ui_log("Dataset: %s, tokenizing %s", reason.c_str(), src_name.c_str());
+
+    if (!tokenize_to_cache(vocab, tmpl, src, jsonl, expect, cache_path, std::max(1, n_threads), error)) {
+        return false;
+    }
+    if (!cache_open(cache_path, expect, out, &reason)) {
+        *error = cache_path + ": " + reason;
+        return false;
+    }
+    return true;
+}
+
+bool dataset_load_file(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & src_path,
+        const std::string & cache_path,
+        int n_threads,
+        dataset_tokens * out,
+        bool * from_cache,
+        std::string * error) {
+    *out = dataset_tokens();
+    *from_cache = false;
+
+    dataset_mmap src;
+    if (!dataset_mmap_open(src_path, &src, error)) return false;
+    bool ok = load_source(vocab, chat_template, src, ends_with(src_path, ".jsonl"), src_path, cache_path,
+                          n_threads, out, from_cache, error);
+    dataset_mmap_close(&src);
+    return ok;
+}
+
+bool dataset_load_text(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & text,
+        bool jsonl,
+        const std::string & cache_dir,
+        int n_threads,
+        dataset_tokens * out,
+        bool * from_cache,
+        std::string * error) {
+    *out = dataset_tokens();
+    *from_cache = false;
+
+    dataset_mmap src;
+    src.data = (const uint8_t *) text.data();
+    src.size = text.size();
+
+    // Named after the content, so every distinct corpus gets its own cache file
+    char name[48];
+    snprintf(name, sizeof(name), "/%016llx.tokens",
+             (unsigned long long) (hash_bytes(HASH_SEED, src.data, src.size) ^ dataset_vocab_hash(vocab, chat_template)));
+    return load_source(vocab, chat_template, src, jsonl, jsonl ? "training records" : "training text",
+                       cache_dir + name, n_threads, out, from_cache, error);
+}
+
+bool dataset_tokenize_text(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & text,
+        bool jsonl,
+        int n_threads,
+        dataset_token_store * store,
+        std::string * error) {
+    *store = dataset_token_store();
+
+    dataset_mmap src;
+    src.data = (const uint8_t *) text.data();
+    src.size = text.size();
+
+    int64_t n_chat = 0;
+    tokenize_source(vocab, chat_template, src, jsonl, std::max(1, n_threads), [&](const tokenize_item & item) {
+        for (uint64_t start : item.doc_starts) store->doc_starts.push_back(store->tokens.size() + start);
+        store->tokens.insert(store->tokens.end(), item.tokens.begin(), item.tokens.end());
+        store->loss_mask.insert(store->loss_mask.end(), item.mask.begin(), item.mask.end());
+        return true;
+    }, &n_chat);
+    if (n_chat == 0) std::vector<uint8_t>().swap(store->loss_mask);
+    if (store->tokens.empty()) {
+        *error = "no tokens in training data";
+        return false;
+    }
+    return true;
+}
+
+dataset_tokens dataset_store_view(const dataset_token_store & store) {
+    dataset_tokens view;
+    view.tokens     = store.tokens.data();
+    view.n_tokens   = (int64_t) store.tokens.size();
+    view.doc_starts = store.doc_starts.empty() ? nullptr : store.doc_starts.data();
+    view.n_docs     = (int64_t) store.doc_starts.size();
+    view.loss_mask  = store.loss_mask.empty() ? nullptr : store.loss_mask.data();
+    return view;
+}
+
+void dataset_tokens_close(dataset_tokens * tokens) {
+    dataset_mmap_close(&tokens->map);
+    *tokens = dataset_tokens();
+}
+
+// ============================================
+// Dataset: Eval split
+// ============================================
+int64_t dataset_split_eval(const uint64_t * doc_starts, size_t n_docs, int64_t n_tokens, int64_t n_ctx) {
+    const int64_t target = std::max(n_tokens / 20, (int64_t) 1);
+
+    // Several documents: hold out whole documents from the end, keeping at least one for training
+    if (doc_starts && n_docs >= 2) {
+        size_t first_eval = n_docs;
+        auto eval_tokens = [&]() {
+            return first_eval < n_docs ? n_tokens - (int64_t) doc_starts[first_eval] : 0;
+        };
+        while (first_eval > 1 && eval_tokens() < target) first_eval--;
+        return (int64_t) doc_starts[first_eval];
+    }
+
+    // One document: hold out its tail, only if both sides still fill a window
+    const int64_t eval = std::max(target, n_ctx + 1);
+    return n_tokens - eval >= n_ctx + 1 ? n_tokens - eval : n_tokens;
+}
+
+// ============================================
+// Dataset: Window plans
+// ============================================
+static void plan_add_window(dataset_plan * plan, std::initializer_list<dataset_piece> pieces) {
+    plan->window_begin.push_back((int64_t) plan->pieces.size());
+    plan->pieces.insert(plan->pieces.end(), pieces);
+}
+
+// Number of the piece's labels the loss mask marks: input i predicts token i + 1, the
+// document's last input predicts EOS, which counts with the token before it (end of turn)
+static int64_t piece_targets(const uint8_t * loss_mask, const dataset_piece & piece) {
+    if (!loss_mask) return piece.end - piece.begin;
+    const int64_t last = std::min(piece.end + 1, piece.doc_end);
+    int64_t n = 0;
+    for (int64_t i = piece.begin + 1; i < last; i++) n += loss_mask[i] ? 1 : 0;
+    if (piece.end == piece.doc_end && loss_mask[piece.doc_end - 1]) n++;
+    return n;
+}
+
+void dataset_plan_windows(int64_t begin, int64_t end, int64_t n_ctx, int64_t stride,
+                          const uint8_t * loss_mask, dataset_plan * plan, int64_t * n_dropped) {
+    if (end - begin < 2 || n_ctx < 1 || stride < 1) return;
+
+    auto add = [&](const dataset_piece & piece) {
+        if (piece_targets(loss_mask, piece) > 0) plan_add_window(plan, { piece });
+        else if (n_dropped) (*n_dropped)++;
+    };
+
+    // Shorter than one window: the region once, EOS after it
+    if (end - begin < n_ctx + 1) {
+        add({ begin, end, end });
+        return;
+    }
+    for (int64_t start = begin; start + n_ctx + 1 <= end; start += stride) {
+        add({ start, start + n_ctx, end });
+    }
+}
+
+// Max-segment tree over the bins' free space: finds the first bin with room in O(log n)
+struct first_fit_tree {
+    int64_t              size = 1;
+    std::vector<int64_t> free_max;
+
+    first_fit_tree(int64_t n_bins, int64_t capacity) {
+        while (size < n_bins) size *= 2;
+        free_max.assign((size_t) (2 * size), 0);
+        for (int64_t i = 0; i < n_bins; i++) free_max[(size_t) (size + i)] = capacity;
+        for (int64_t i = size - 1; i > 0; i--) free_max[(size_t) i] = std::max(free_max[(size_t) (2 * i)], free_max[(size_t) (2 * i + 1)]);
+    }
+
+    // Leftmost bin with at least len free, or -1
+    int64_t find(int64_t len) const {
+        if (free_max[1] < len) return -1;
+        int64_t i = 1;
+        while (i < size) i = free_max[(size_t) (2 * i)] >= len ? 2 * i : 2 * i + 1;
+        return i - size;
+    }
+
+    void take(int64_t bin, int64_t len) {
+        int64_t i = size + bin;
+        free_max[(size_t) i] -= len;
+        for (i /= 2; i > 0; i /= 2) free_max[(size_t) i] = std::max(free_max[(size_t) (2 * i)], free_max[(size_t) (2 * i + 1)]);
+    }
+};
+
+void dataset_plan_packed(
+        const uint64_t * doc_starts,
+        size_t n_docs,
+        int64_t begin,
+        int64_t end,
+        int64_t n_ctx,
+        const uint8_t * loss_mask,
+        dataset_plan * plan,
+        dataset_pack_stats * stats) {
+    if (end <= begin || n_ctx < 1) return;
+
+    // Documents clipped to [begin, end); no boundaries = one document
+    std::vector<std::pair<int64_t, int64_t>> docs;
+    int64_t prev = begin;
+    for (size_t d = 0; doc_starts && d < n_docs; d++) {
+        const int64_t start = (int64_t) doc_starts[d];
+        if (start <= prev) continue;
+        if (start >= end) break;
+        docs.emplace_back(prev, start);
+        prev = start;
+    }
+    docs.emplace_back(prev, end);
+
+    // Documents longer than n_ctx give full windows of their own; the tails (and every
+    // shorter document) are the items to pack. Pieces without a marked label (only
+    // prompt tokens) would train nothing and are dropped.
+    std::vector<dataset_piece> items;
+    for (const auto & doc : docs) {
+        int64_t p = doc.first;
+        for (; doc.second - p >= n_ctx; p += n_ctx) {
+            const dataset_piece piece = { p, p + n_ctx, doc.second };
+            if (piece_targets(loss_mask, piece) > 0) plan_add_window(plan, { piece });
+            else stats->n_dropped++;
+        }
+        if (p < doc.second) {
+            const dataset_piece piece = { p, doc.second, doc.second };
+            if (piece_targets(loss_mask, piece) > 0) items.push_back(piece);
+            else stats->n_dropped++;
+        }
+        if (doc.second - doc.first > n_ctx) stats->n_split_docs++;
+    }
+    stats->n_docs += (int64_t) docs.size();
+
+    std::stable_sort(items.begin(), items.end(), [](const dataset_piece & a, const dataset_piece & b) {
+        return a.end - a.begin > b.end - b.begin;
+    });
+
+    // First-fit decreasing: every item goes to the first bin it fits in
+    std::vector<std::vector<dataset_piece>> bins;
+    if (!items.empty()) {
+        first_fit_tree tree((int64_t) items.size(), n_ctx);
+        for (const auto & item : items) {
+            const int64_t bin = tree.find(item.end - item.begin);
+            if (bin >= (int64_t) bins.size()) bins.resize((size_t) bin + 1);
+            bins[(size_t) bin].push_back(item);
+            tree.take(bin, item.end - item.begin);
+        }
+    }
+    for (const auto & bin : bins) {
+        plan->window_begin.push_back((int64_t) plan->pieces.size());
+        int64_t used = 0;
+        for (const auto & piece : bin) {
+            plan->pieces.push_back(piece);
+            used += piece.end - piece.begin;
+        }
+        stats->n_pad += n_ctx - used;
+    }
+}
+
+// ============================================
+// Dataset: Materialize an epoch
+// ============================================
+// Each piece predicts its document's next token; the document's last token predicts EOS.
+// The rest of the window is EOS filler.
+// Returns the number of marked labels written.
+static int64_t write_window(const dataset_tokens & src, llama_token eos, int64_t n_ctx,
+                            const dataset_plan & plan, int64_t window, llama_token * d, llama_token * l) {
+    const llama_token * tokens = src.tokens;
+    const int64_t first = plan.window_begin[(size_t) window];
+    const int64_t last  = window + 1 < plan.n_windows() ? plan.window_begin[(size_t) window + 1]
+                                                         : (int64_t) plan.pieces.size();
+    int64_t used = 0;
+    int64_t n_targets = 0;
+    for (int64_t ip = first; ip < last; ip++) {
+        const dataset_piece & piece = plan.pieces[(size_t) ip];
+        const int64_t len = piece.end - piece.begin;
+        n_targets += piece_targets(src.loss_mask, piece);
+        memcpy(d + used, tokens + piece.begin, (size_t) len * sizeof(llama_token));
+        if (piece.end < piece.doc_end) {
+            memcpy(l + used, tokens + piece.begin + 1, (size_t) len * sizeof(llama_token));
+        } else {
+            if (len > 1) memcpy(l + used, tokens + piece.begin + 1, (size_t) (len - 1) * sizeof(llama_token));
+            l[used + len - 1] = eos;
+        }
+        used += len;
+    }
+    for (int64_t j = used; j < n_ctx; j++) {
+        d[j] = eos;
+        l[j] = eos;
+    }
+    return n_targets;
+}
+
+ggml_opt_dataset_t dataset_materialize(
+        const dataset_tokens & tokens,
+        llama_token eos,
+        int64_t n_ctx,
+        const dataset_plan & train,
+        const std::vector<int64_t> & train_windows,
+        const dataset_plan & eval,
+        int64_t * n_train_targets) {
+    const int64_t ndata = (int64_t) train_windows.size() + eval.n_windows();
+    if (ndata == 0) return nullptr;
+
+    ggml_opt_dataset_t dataset = ggml_opt_dataset_init(
+        GGML_TYPE_I32, GGML_TYPE_I32, n_ctx, n_ctx, ndata, /*ndata_shard =*/ 1);
+
+    llama_token * data   = (llama_token *) ggml_opt_dataset_data(dataset)->data;
+    llama_token * labels = (llama_token *) ggml_opt_dataset_labels(dataset)->data;
+
+    int64_t idata = 0;
+    int64_t n_targets = 0;
+    for (int64_t window : train_windows) {
+        n_targets += write_window(tokens, eos, n_ctx, train, window, data + idata * n_ctx, labels + idata * n_ctx);
+        idata++;
+    }
+    for (int64_t window = 0; window < eval.n_windows(); window++) {
+        write_window(tokens, eos, n_ctx, eval, window, data + idata * n_ctx, labels + idata * n_ctx);
+        idata++;
+    }
+    if (n_train_targets) *n_train_targets = n_targets;
+    return dataset;
+}
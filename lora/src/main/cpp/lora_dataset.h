@@ -0,0 +1,182 @@
+#pragma once
+
+// Training corpus loading — tokenizes a text / JSONL file from disk into a binary token
+// file and builds ggml-opt windows straight from its memory map, so the corpus never has
+// to exist as one big string or token vector.
+// Platform neutral (no JNI / Android deps), like lora_merge.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+#include "ggml-opt.h"
+
+// Read-only memory map of a whole file
+struct dataset_mmap {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+};
+
+bool dataset_mmap_open(const std::string & path, dataset_mmap * map, std::string * error);
+void dataset_mmap_close(dataset_mmap * map);
+
+// Token cache file, version 2 (native byte order):
+//   dataset_cache_header | int32 tokens[n_tokens] | pad to 8 | uint64 doc_starts[n_docs]
+//   [| uint8 loss_mask[n_tokens]]
+// doc_starts holds the token index where each document begins; loss_mask (chat data only)
+// is 1 for tokens the model should learn to produce. It only decides which windows are kept
+// (those without such a label are dropped): the loss still covers every label of a kept window,
+// since llama_opt_epoch has no ignore label. The cache is only used while vocab_hash
+// and source_hash/source_size still match; anything else re-tokenizes.
+#define DATASET_CACHE_MAGIC   "LORATOK"
+#define DATASET_CACHE_VERSION 2
+
+struct dataset_cache_header {
+    char     magic[8]    = {};
+    uint32_t version     = 0;
+    uint32_t header_size = 0;     // sizeof(dataset_cache_header)
+    uint64_t vocab_hash  = 0;     // dataset_vocab_hash (vocab + chat template)
+    uint64_t source_hash = 0;     // Hash of the source file bytes
+    uint64_t source_size = 0;
+    uint64_t n_tokens    = 0;
+    uint64_t n_docs      = 0;
+    uint64_t docs_offset = 0;     // Byte offset of doc_starts
+    uint32_t jsonl       = 0;     // Source was parsed as JSONL
+    uint32_t reserved    = 0;
+    uint64_t mask_offset = 0;     // Byte offset of loss_mask, 0 = every token is a target
+};
+
+// Tokens mapped from a cache file (zero-copy: pointers into the map), or a view of a
+// dataset_token_store (map unused)
+struct dataset_tokens {
+    dataset_mmap        map;
+    const llama_token * tokens     = nullptr;
+    int64_t             n_tokens   = 0;
+    const uint64_t    * doc_starts = nullptr;
+    int64_t             n_docs     = 0;
+    const uint8_t     * loss_mask  = nullptr;   // nullptr = every token is a target
+};
+
+// Tokenized corpus held in memory (no token cache)
+struct dataset_token_store {
+    std::vector<llama_token> tokens;
+    std::vector<uint64_t>    doc_starts;
+    std::vector<uint8_t>     loss_mask;   // Empty = every token is a target
+};
+
+// Hash of the vocabulary and chat template (nullptr = none): a cache is only valid for both
+uint64_t dataset_vocab_hash(const llama_vocab * vocab, const char * chat_template);
+
+// Maps cache_path if it is a valid cache of src_path for this vocab (*from_cache = true).
+// Otherwise tokenizes src_path into it first:
+//   *.jsonl: every line is a document, either
+//     {"text": "..."}                       tokenized with BOS, every token a target, or
+//     {"messages": [{"role", "content"}]}   formatted with chat_template; only the assistant
+//                                           replies are marked (loss_mask)
+//   Anything else: one plain-text document, split at line breaks into chunks.
+// Chunks are tokenized on n_threads workers; only one round of chunks is in memory at a time.
+// Returns false and sets *error on failure.
+bool dataset_load_file(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & src_path,
+        const std::string & cache_path,
+        int n_threads,
+        dataset_tokens * out,
+        bool * from_cache,
+        std::string * error);
+// Same for an in-memory corpus (plain text, or JSONL records), cached as
+// cache_dir/<content hash>.tokens
+bool dataset_load_text(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & text,
+        bool jsonl,
+        const std::string & cache_dir,
+        int n_threads,
+        dataset_tokens * out,
+        bool * from_cache,
+        std::string * error);
+// Same tokenization without a cache file, into memory
+bool dataset_tokenize_text(
+        const llama_vocab * vocab,
+        const char * chat_template,
+        const std::string & text,
+        bool jsonl,
+        int n_threads,
+        dataset_token_store * store,
+        std::string * error);
+dataset_tokens dataset_store_view(const dataset_token_store & store);
+void dataset_tokens_close(dataset_tokens * tokens);
+
+// Eval split: the token index where held-out data starts (n_tokens = no eval).
+// Several documents: whole documents from the end, ~5% of the tokens, at least one kept
+// for training. One document: its tail, only when both sides still fill an n_ctx window.
+// Train and eval windows are planned on either side, so no eval text is ever trained on.
+int64_t dataset_split_eval(const uint64_t * doc_starts, size_t n_docs, int64_t n_tokens, int64_t n_ctx);
+
+// One stretch of a document inside a training window: inputs tokens[begin, end), each
+// labelled with the next token — EOS for the token at doc_end - 1
+struct dataset_piece {
+    int64_t begin;
+    int64_t end;
+    int64_t doc_end;
+};
+
+// Training windows as token ranges. They are written into a ggml-opt dataset per epoch
+// (dataset_materialize), so only the windows an epoch uses are ever in memory.
+struct dataset_plan {
+    std::vector<dataset_piece> pieces;
+    std::vector<int64_t>       window_begin;   // Window i = pieces[window_begin[i], window_begin[i + 1])
+
+    int64_t n_windows() const { return (int64_t) window_begin.size(); }
+    // Document tokens in the windows; the rest of n_windows() * n_ctx is EOS filler
+    int64_t n_tokens() const {
+        int64_t n = 0;
+        for (const auto & piece : pieces) n += piece.end - piece.begin;
+        return n;
+    }
+    void    clear() { pieces.clear(); window_begin.clear(); }
+};
+
+// Packing statistics — n_pad is the EOS filler after the last document of a window
+struct dataset_pack_stats {
+    int64_t n_docs       = 0;
+    int64_t n_split_docs = 0;   // Documents longer than n_ctx, cut into n_ctx pieces
+    int64_t n_pad        = 0;
+    int64_t n_dropped    = 0;   // Pieces without a marked label (prompt only)
+};
+
+// Sliding n_ctx windows every stride tokens over tokens [begin, end) (one stream).
+// A region shorter than n_ctx + 1 becomes a single window of itself followed by EOS.
+// With a loss_mask, windows whose labels are all prompt tokens are dropped (*n_dropped).
+void dataset_plan_windows(int64_t begin, int64_t end, int64_t n_ctx, int64_t stride,
+                          const uint8_t * loss_mask, dataset_plan * plan, int64_t * n_dropped);
+
+// Packs the documents inside [begin, end) into non-overlapping n_ctx windows with first-fit
+// decreasing. Documents longer than n_ctx are cut into n_ctx pieces and their tail is packed
+// like a short document. Every document keeps its own BOS and ends predicting EOS.
+// doc_starts = nullptr treats the range as one document.
+void dataset_plan_packed(
+        const uint64_t * doc_starts,
+        size_t n_docs,
+        int64_t begin,
+        int64_t end,
+        int64_t n_ctx,
+        const uint8_t * loss_mask,
+        dataset_plan * plan,
+        dataset_pack_stats * stats);
+
+// ggml-opt dataset for one epoch: the listed train windows (in order, repeats allowed)
+// followed by every eval window. Returns nullptr when there is nothing to write.
+// *n_train_targets (optional) = labels the loss mask marks in the train windows (all without one).
+ggml_opt_dataset_t dataset_materialize(
+        const dataset_tokens & tokens,
+        llama_token eos,
+        int64_t n_ctx,
+        const dataset_plan & train,
+        const std::vector<int64_t> & train_windows,
+        const dataset_plan & eval,
+        int64_t * n_train_targets);
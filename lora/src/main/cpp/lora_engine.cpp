@@ -0,0 +1,2213 @@
+#include "lora_engine.h"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+#include "llama.h"
+#include "common.h"
+#include "ggml-backend.h"
+#include "lora_log.h"
+
+// Global inference state
+
+static llama_model                * g_model   = nullptr;
+static llama_context              * g_context = nullptr;
+static bool                         g_backend_initialized = false;
+static engine_context_params        g_ctx_params;          // Shape of g_context (engine_set_context_params)
+static int                          g_n_gpu_layers  = 0;   // Of the loaded model
+
+// Speculative decoding — an optional small draft model sharing the target's vocab.
+// Its context mirrors the target's sequence IDs, so every session has a draft sequence.
+static llama_model                * g_draft_model   = nullptr;
+static llama_context              * g_draft_context = nullptr;
+static llama_batch                  g_draft_batch   = {};
+static int                          g_n_draft       = 0;   // Tokens proposed per decode step
+
+// Prompt lookup decoding — draft-free speculation that proposes continuations of
+// n-grams already seen in the prompt or the generated text (copy/edit workloads).
+#define LOOKUP_NGRAM_MIN 2
+#define LOOKUP_NGRAM_MAX 4
+static int                          g_n_lookup      = 0;   // Tokens proposed per decode step (0 = off)
+
+// Guards g_model/g_context, the adapter pool and the session table.
+// Held by the scheduler for each decode step and by every engine call that touches them.
+static std::mutex                   g_ctx_mutex;
+
+// LoRA adapter set — pool adapter IDs with their scales, in attach order
+struct adapter_ref {
+    int32_t id;
+    float   scale;
+    bool operator==(const adapter_ref & o) const { return id == o.id && scale == o.scale; }
+};
+typedef std::vector<adapter_ref> adapter_set;
+
+// Inference sessions — each conversation owns one llama sequence inside the
+// shared context. Session 0 is the default one used by generateStreaming.
+// The KV cache is unified, so all sessions compete for the same n_ctx cells and
+// the least recently used idle session is evicted when a new prompt doesn't fit.
+
+#define DEFAULT_SESSION_ID ENGINE_DEFAULT_SESSION
+#define MAX_SESSIONS       8   // n_seq_max of the context
+
+struct infer_session {
+    llama_seq_id              seq_id      = 0;
+    std::vector<llama_token>  tokens;          // Tokens held in KV for seq_id, in position order
+    size_t                    n_reserved  = 0; // Cells promised to the running request (prompt + max_gen)
+    bool                      busy        = false; // A request is running on this session
+    uint64_t                  last_used   = 0; // LRU tick
+    std::vector<llama_token>  draft_tokens;    // Tokens held in the draft context's KV for seq_id
+    adapter_set               adapters;        // Adapter set the KV entries were computed with
+    bool                      routed      = false; // Session has its own adapter set (setSessionAdapters)
+    adapter_set               route;           // That set — otherwise the default set applies
+};
+
+static std::map<int32_t, infer_session> g_sessions = { { DEFAULT_SESSION_ID, infer_session() } };
+static int32_t                          g_next_session_id = DEFAULT_SESSION_ID + 1;
+static uint64_t                         g_session_tick    = 0;
+
+// Helper: Look up a session by handle (nullptr if unknown)
+static infer_session * find_session(int32_t session_id) {
+    auto it = g_sessions.find(session_id);
+    return it != g_sessions.end() ? &it->second : nullptr;
+}
+
+// Helper: Create a session on the lowest free sequence ID (-1 if all are in use)
+static int32_t create_session() {
+    llama_seq_id seq = -1;
+    for (llama_seq_id candidate = 0; candidate < MAX_SESSIONS && seq < 0; candidate++) {
+        bool taken = false;
+        for (const auto & it : g_sessions) {
+            if (it.second.seq_id == candidate) { taken = true; break; }
+        }
+        if (!taken) seq = candidate;
+    }
+    if (seq < 0) return -1;
+
+    int32_t session_id = g_next_session_id++;
+    infer_session & sess = g_sessions[session_id];
+    sess.seq_id    = seq;
+    sess.last_used = ++g_session_tick;
+    return session_id;
+}
+
+// Helper: Drop one session's KV entries and forget its cached tokens
+static void evict_session(infer_session & sess) {
+    if (g_context) {
+        llama_memory_seq_rm(llama_get_memory(g_context), sess.seq_id, -1, -1);
+    }
+    if (g_draft_context) {
+        llama_memory_seq_rm(llama_get_memory(g_draft_context), sess.seq_id, -1, -1);
+    }
+    sess.tokens.clear();
+    sess.draft_tokens.clear();
+}
+
+// Helper: Drop all KV state and forget every session's cached tokens
+static void reset_kv_cache() {
+    if (g_context) {
+        llama_memory_clear(llama_get_memory(g_context), true);
+    }
+    if (g_draft_context) {
+        llama_memory_clear(llama_get_memory(g_draft_context), true);
+    }
+    for (auto & it : g_sessions) {
+        it.second.tokens.clear();
+        it.second.draft_tokens.clear();
+    }
+}
+
+// Helper: Evict the least recently used idle session holding KV cells.
+// Returns false if there was nothing to evict.
+static bool evict_lru_session(const infer_session * keep) {
+    infer_session * lru = nullptr;
+    for (auto & it : g_sessions) {
+        infer_session & s = it.second;
+        if (&s == keep || s.busy || s.tokens.empty()) continue;
+        if (!lru || s.last_used < lru->last_used) lru = &s;
+    }
+    if (!lru) return false;
+    ui_log("KV cache full — evicting session seq %d (%zu tokens)", lru->seq_id, lru->tokens.size());
+    evict_session(*lru);
+    return true;
+}
+
+// Helper: Evict idle sessions until every session's footprint fits in n_ctx.
+// Running sessions count with their reservation. Returns false if that isn't enough.
+static bool make_room(const infer_session & keep) {
+    const size_t n_ctx = llama_n_ctx(g_context);
+    for (;;) {
+        size_t n_used = 0;
+        for (const auto & it : g_sessions) {
+            n_used += std::max(it.second.tokens.size(), it.second.n_reserved);
+        }
+        if (n_used <= n_ctx) return true;
+        if (!evict_lru_session(&keep)) return false;
+    }
+}
+
+// Helper: Length of the common prefix between the cached and new token sequences
+static size_t common_prefix_len(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) i++;
+    return i;
+}
+
+// LoRA adapter pool — adapters stay resident up to a memory budget, so switching
+// between them only changes which ones are attached to the context (no file load).
+// Least recently used adapters that aren't active are freed when over budget.
+
+struct pooled_adapter {
+    llama_adapter_lora * adapter   = nullptr;
+    std::string          path;
+    std::string          ident;           // file_ident() of the GGUF (prompt cache key)
+    size_t               bytes     = 0;   // GGUF file size — tensor data dominates
+    uint64_t             last_used = 0;
+    int                  n_pinned  = 0;   // Queued/running requests using it
+};
+
+static std::map<int32_t, pooled_adapter> g_adapter_pool;
+static int32_t                           g_next_adapter_id = 1;
+static size_t                            g_adapter_budget  = (size_t) 512 * 1024 * 1024;
+static uint64_t                          g_adapter_tick    = 0;
+static adapter_set                       g_active_adapters;   // Attached to g_context (scheduler)
+static adapter_set                       g_default_adapters;  // Used by requests on unrouted sessions
+
+// Helper: Identify a file by path, size and mtime (changes when the file is replaced)
+static std::string file_ident(const std::string & path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return path;
+    return path + ":" + std::to_string((long long) st.st_size) + ":" + std::to_string((long long) st.st_mtime);
+}
+
+// Helper: Whether an adapter set references a pool entry
+static bool adapter_set_has(const adapter_set & set, int32_t id) {
+    for (const auto & ref : set) {
+        if (ref.id == id) return true;
+    }
+    return false;
+}
+
+// Helper: Whether a pooled adapter is referenced by a request, a session route or the default set
+static bool adapter_in_use(int32_t id) {
+    auto it = g_adapter_pool.find(id);
+    if (it != g_adapter_pool.end() && it->second.n_pinned > 0) return true;
+    if (adapter_set_has(g_default_adapters, id)) return true;
+    for (const auto & s : g_sessions) {
+        if (s.second.routed && adapter_set_has(s.second.route, id)) return true;
+    }
+    return false;
+}
+
+// Helper: Pin (+1) or unpin (-1) a request's adapters so the pool keeps them resident
+static void pin_adapters(const adapter_set & set, int delta) {
+    for (const auto & ref : set) {
+        auto it = g_adapter_pool.find(ref.id);
+        if (it != g_adapter_pool.end()) it->second.n_pinned += delta;
+    }
+}
+
+// Helper: Stable text form of an adapter set (prompt cache key, logging)
+static std::string adapter_set_ident(const adapter_set & set) {
+    std::string ident;
+    for (const auto & ref : set) {
+        auto it = g_adapter_pool.find(ref.id);
+        if (it == g_adapter_pool.end()) continue;
+        char scale[32];
+        snprintf(scale, sizeof(scale), "@%.4f;", (double) ref.scale);
+        ident += it->second.ident + scale;
+    }
+    return ident;
+}
+
+// Helper: Free one pool entry (detached from the context first if needed)
+static void pool_free(int32_t id) {
+    auto it = g_adapter_pool.find(id);
+    if (it == g_adapter_pool.end()) return;
+    if (adapter_set_has(g_active_adapters, id)) {
+        llama_clear_adapter_lora(g_context);
+        g_active_adapters.clear();
+    }
+    llama_adapter_lora_free(it->second.adapter);
+    g_adapter_pool.erase(it);
+}
+
+// Helper: Free every pool entry (model change / cleanup)
+static void pool_free_all() {
+    if (g_context && !g_active_adapters.empty()) {
+        llama_clear_adapter_lora(g_context);
+    }
+    g_active_adapters.clear();
+    g_default_adapters.clear();
+    for (auto & it : g_sessions) {
+        it.second.adapters.clear();
+        it.second.routed = false;
+        it.second.route.clear();
+    }
+    for (auto & it : g_adapter_pool) {
+        llama_adapter_lora_free(it.second.adapter);
+    }
+    g_adapter_pool.clear();
+}
+
+// Helper: Evict least recently used inactive adapters until the pool fits its budget
+static void pool_enforce_budget() {
+    for (;;) {
+        size_t total = 0;
+        for (const auto & it : g_adapter_pool) total += it.second.bytes;
+        if (total <= g_adapter_budget) return;
+
+        int32_t lru = -1;
+        for (const auto & it : g_adapter_pool) {
+            if (adapter_in_use(it.first)) continue;
+            if (lru < 0 || it.second.last_used < g_adapter_pool[lru].last_used) lru = it.first;
+        }
+        if (lru < 0) {
+            ui_log("Adapter pool over budget (%.1f / %.1f MB) with only in-use adapters resident",
+                   total / 1024.0 / 1024.0, g_adapter_budget / 1024.0 / 1024.0);
+            return;
+        }
+        ui_log("Adapter pool: evicting %d (%s)", lru, g_adapter_pool[lru].path.c_str());
+        pool_free(lru);
+    }
+}
+
+// Helper: Load an adapter into the pool, or return the resident copy of the same file.
+// Returns the pool ID, or -1 on failure.
+static int32_t pool_load(const std::string & path) {
+    std::string ident = file_ident(path);
+    for (auto & it : g_adapter_pool) {
+        if (it.second.ident == ident) {
+            it.second.last_used = ++g_adapter_tick;
+            return it.first;
+        }
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+    llama_adapter_lora * adapter = llama_adapter_lora_init(g_model, path.c_str());
+    if (!adapter) return -1;
+
+    struct stat st;
+    int32_t id = g_next_adapter_id++;
+    pooled_adapter & entry = g_adapter_pool[id];
+    entry.adapter   = adapter;
+    entry.path      = path;
+    entry.ident     = ident;
+    entry.bytes     = stat(path.c_str(), &st) == 0 ? (size_t) st.st_size : 0;
+    entry.last_used = ++g_adapter_tick;
+
+    double load_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    ui_log("Adapter pool: loaded %d from %s (%.1f MB) in %.2fs", id, path.c_str(),
+           entry.bytes / 1024.0 / 1024.0, load_s);
+
+    pool_enforce_budget();
+    return id;
+}
+
+// Helper: Attach exactly this adapter set to the context. A no-op if it's already attached.
+// Only the scheduler switches sets; sessions track which set their KV was computed with.
+static bool apply_adapter_set(const adapter_set & set) {
+    if (set == g_active_adapters) return true;
+
+    llama_clear_adapter_lora(g_context);
+    g_active_adapters.clear();
+    for (const auto & ref : set) {
+        auto it = g_adapter_pool.find(ref.id);
+        if (it == g_adapter_pool.end() || llama_set_adapter_lora(g_context, it->second.adapter, ref.scale) != 0) {
+            llama_clear_adapter_lora(g_context);
+            return false;
+        }
+        it->second.last_used = ++g_adapter_tick;
+    }
+    g_active_adapters = set;
+    return true;
+}
+
+// Prompt state cache — sequence state snapshots on disk, so a long system prompt is
+// prefilled once and restored after loadModel or an app restart.
+// A snapshot is taken where a prompt's system-prompt prefix (as formatted by
+// engine_apply_chat_template) ends, and written to disk off the scheduler thread.
+// Files are named <state key>-<token hash>-<n tokens>.kvc, where the state key
+// covers model + adapter. A request restores the cached prompt sharing the longest
+// prefix with its own, then drops the diverging tail. Oldest files (mtime) are
+// removed once the directory exceeds the size cap.
+
+#define CACHE_MIN_TOKENS 64   // Smaller prefixes are cheaper to prefill than to load
+
+struct cache_entry {
+    std::string               path;
+    uint64_t                  key    = 0;   // Model + adapter the state belongs to
+    std::vector<llama_token>  tokens;       // Prompt the state was saved for
+    size_t                    bytes  = 0;
+    time_t                    mtime  = 0;   // LRU stamp, touched on restore
+};
+
+static std::string              g_cache_dir;             // Empty = cache disabled
+static size_t                   g_cache_max_bytes = 0;
+static std::vector<cache_entry> g_cache_entries;
+static std::string              g_model_ident;           // path:size:mtime of the loaded model
+static std::string              g_cache_prefix_text;     // Formatted system messages of the last chat template
+
+// Helper: FNV-1a over a byte range
+static uint64_t fnv1a(const void * data, size_t size, uint64_t h = 1469598103934665603ULL) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Helper: Key of the current model + adapter — states are only valid for the weights that produced them
+static uint64_t cache_state_key() {
+    std::string ident = g_model_ident + "|" + adapter_set_ident(g_active_adapters);
+    return fnv1a(ident.data(), ident.size());
+}
+
+// Helper: Read the token list from a sequence state file header.
+// The count is checked against the file size first, so a corrupt file can't demand a huge buffer.
+static bool cache_read_tokens(const std::string & path, std::vector<llama_token> & tokens) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    uint32_t header[3];  // magic, version, n_token_count
+    bool ok = fread(header, sizeof(header), 1, f) == 1 &&
+              header[0] == LLAMA_STATE_SEQ_MAGIC && header[1] == LLAMA_STATE_SEQ_VERSION &&
+              (uint64_t) header[2] <= ((uint64_t) st.st_size - sizeof(header)) / sizeof(llama_token);
+    if (ok) {
+        tokens.resize(header[2]);
+        ok = fread(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// Helper: Rebuild the entry list from the cache directory
+static void cache_scan() {
+    g_cache_entries.clear();
+    DIR * dir = opendir(g_cache_dir.c_str());
+    if (!dir) return;
+    while (struct dirent * de = readdir(dir)) {
+        std::string name = de->d_name;
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".kvc") != 0) continue;
+
+        cache_entry entry;
+        entry.path = g_cache_dir + "/" + name;
+        entry.key  = strtoull(name.c_str(), nullptr, 16);
+        struct stat st;
+        if (stat(entry.path.c_str(), &st) != 0) continue;
+        entry.bytes = (size_t) st.st_size;
+        entry.mtime = st.st_mtime;
+        if (!cache_read_tokens(entry.path, entry.tokens)) {
+            unlink(entry.path.c_str());
+            continue;
+        }
+        g_cache_entries.push_back(std::move(entry));
+    }
+    closedir(dir);
+}
+
+// Helper: Delete least recently used files until the cache fits its size cap
+static void cache_enforce_cap() {
+    size_t total = 0;
+    for (const auto & e : g_cache_entries) total += e.bytes;
+    while (total > g_cache_max_bytes && !g_cache_entries.empty()) {
+        auto lru = std::min_element(g_cache_entries.begin(), g_cache_entries.end(),
+            [](const cache_entry & a, const cache_entry & b) { return a.mtime < b.mtime; });
+        ui_log("Prompt cache: evicting %s (%zu tokens, %.1f MB)", lru->path.c_str(),
+               lru->tokens.size(), lru->bytes / 1024.0 / 1024.0);
+        unlink(lru->path.c_str());
+        total -= lru->bytes;
+        g_cache_entries.erase(lru);
+    }
+}
+
+static void cache_collect();
+
+// Helper: Restore the cached state sharing the longest prefix with prompt into seq,
+// if it beats the n_reuse prompt tokens already in memory.
+// Returns the number of prompt tokens seq holds afterwards (0 if a restore failed).
+static size_t cache_restore(llama_seq_id seq, const std::vector<llama_token> & prompt, size_t n_reuse) {
+    if (g_cache_dir.empty()) return n_reuse;
+    cache_collect();
+
+    const uint64_t key = cache_state_key();
+    cache_entry * best = nullptr;
+    size_t best_len = n_reuse + CACHE_MIN_TOKENS;
+    for (auto & e : g_cache_entries) {
+        if (e.key != key) continue;
+        size_t n = common_prefix_len(e.tokens, prompt);
+        if (n >= best_len) { best = &e; best_len = n; }
+    }
+    if (!best) return n_reuse;
+
+    auto t_start = std::chrono::steady_clock::now();
+    llama_memory_t mem = llama_get_memory(g_context);
+    llama_memory_seq_rm(mem, seq, -1, -1);
+
+    std::vector<llama_token> tokens(best->tokens.size());
+    size_t n_loaded = 0;
+    size_t ret = llama_state_seq_load_file(g_context, best->path.c_str(), seq,
+                                           tokens.data(), tokens.size(), &n_loaded);
+    tokens.resize(n_loaded);
+    if (ret == 0 || tokens != best->tokens) {
+        ui_log("Prompt cache: failed to restore %s", best->path.c_str());
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        return 0;
+    }
+
+    // Keep the shared prefix; at least one prompt token must still be decoded for logits
+    size_t n_keep = std::min(best_len, prompt.size() - 1);
+    if (!llama_memory_seq_rm(mem, seq, (llama_pos) n_keep, -1)) {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        return 0;
+    }
+
+    best->mtime = time(nullptr);
+    utime(best->path.c_str(), nullptr);
+
+    double load_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    ui_log("Prompt cache: restored %zu tokens (seq %d) in %.2fs", n_keep, seq, load_s);
+    return n_keep;
+}
+
+// Background writer — the scheduler only copies a sequence state to memory under
+// g_ctx_mutex; the file write and rename run here, so no session waits on storage.
+// Written files come back through g_cache_done and join g_cache_entries on the
+// scheduler's next cache lookup. The writer never takes g_ctx_mutex.
+
+#define CACHE_MAX_PENDING 2   // Snapshots held in memory at once; further ones are skipped
+
+struct cache_write {
+    cache_entry           entry;   // bytes / mtime are filled in once written
+    std::vector<uint8_t>  state;   // llama_state_seq_get_data output
+};
+
+static std::thread              g_cache_thread;
+static std::mutex               g_cache_mutex;     // Guards the writer state below
+static std::condition_variable  g_cache_cv;
+static std::deque<cache_write>  g_cache_queue;
+static std::vector<std::string> g_cache_pending;   // Paths queued or being written
+static std::vector<cache_entry> g_cache_done;      // Written, not yet in g_cache_entries
+static bool                     g_cache_stop = false;
+
+// Helper: Write a snapshot in llama_state_seq_save_file's format (header, tokens, state)
+static bool cache_write_file(cache_write & job) {
+    cache_entry & e = job.entry;
+    std::string tmp = e.path + ".tmp";
+    auto t_start = std::chrono::steady_clock::now();
+
+    FILE * f = fopen(tmp.c_str(), "wb");
+    bool ok = f != nullptr;
+    if (ok) {
+        uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) e.tokens.size() };
+        ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+             fwrite(e.tokens.data(), sizeof(llama_token), e.tokens.size(), f) == e.tokens.size() &&
+             fwrite(job.state.data(), 1, job.state.size(), f) == job.state.size();
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok || rename(tmp.c_str(), e.path.c_str()) != 0) {
+        ui_log("Prompt cache: failed to write %s", e.path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    e.bytes = sizeof(uint32_t) * 3 + e.tokens.size() * sizeof(llama_token) + job.state.size();
+    e.mtime = time(nullptr);
+    double save_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    ui_log("Prompt cache: saved %zu tokens (%.1f MB) in %.2fs", e.tokens.size(), e.bytes / 1024.0 / 1024.0, save_s);
+    return true;
+}
+
+static void cache_writer() {
+    std::unique_lock<std::mutex> lock(g_cache_mutex);
+    while (true) {
+        g_cache_cv.wait(lock, [] { return g_cache_stop || !g_cache_queue.empty(); });
+        if (g_cache_queue.empty()) break;   // Stopping, queue drained
+
+        cache_write job = std::move(g_cache_queue.front());
+        g_cache_queue.pop_front();
+        lock.unlock();
+        bool ok = cache_write_file(job);
+        job.state.clear();
+        lock.lock();
+
+        g_cache_pending.erase(std::find(g_cache_pending.begin(), g_cache_pending.end(), job.entry.path));
+        if (ok) g_cache_done.push_back(std::move(job.entry));
+    }
+}
+
+// Helper: Finish queued writes and stop the writer (before the cache dir changes or on cleanup)
+static void cache_writer_shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(g_cache_mutex);
+        g_cache_stop = true;
+    }
+    g_cache_cv.notify_all();
+    if (g_cache_thread.joinable()) g_cache_thread.join();
+
+    std::lock_guard<std::mutex> lock(g_cache_mutex);
+    g_cache_stop = false;
+    g_cache_done.clear();
+}
+
+// Helper: Adopt files the writer has finished since the last lookup
+static void cache_collect() {
+    std::vector<cache_entry> done;
+    {
+        std::lock_guard<std::mutex> lock(g_cache_mutex);
+        done.swap(g_cache_done);
+    }
+    if (done.empty()) return;
+    for (auto & e : done) g_cache_entries.push_back(std::move(e));
+    cache_enforce_cap();
+}
+
+// Helper: Snapshot a freshly prefilled prompt prefix (seq holds exactly these tokens)
+// and hand it to the writer. Only the memory copy happens on the caller's thread.
+static void cache_save(llama_seq_id seq, const std::vector<llama_token> & prompt) {
+    if (g_cache_dir.empty() || prompt.size() < CACHE_MIN_TOKENS) return;
+    cache_collect();
+
+    const uint64_t key = cache_state_key();
+    for (const auto & e : g_cache_entries) {
+        if (e.key == key && e.tokens == prompt) return;
+    }
+
+    char name[96];
+    snprintf(name, sizeof(name), "%016llx-%016llx-%zu.kvc", (unsigned long long) key,
+             (unsigned long long) fnv1a(prompt.data(), prompt.size() * sizeof(llama_token)), prompt.size());
+    std::string path = g_cache_dir + "/" + name;
+    {
+        std::lock_guard<std::mutex> lock(g_cache_mutex);
+        if (g_cache_pending.size() >= CACHE_MAX_PENDING ||
+            std::find(g_cache_pending.begin(), g_cache_pending.end(), path) != g_cache_pending.end()) {
+            return;
+        }
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+    cache_write job;
+    job.state.resize(llama_state_seq_get_size(g_context, seq));
+    if (job.state.empty() ||
+        llama_state_seq_get_data(g_context, job.state.data(), job.state.size(), seq) != job.state.size()) {
+        ui_log("Prompt cache: failed to snapshot seq %d", seq);
+        return;
+    }
+    job.entry.path   = path;
+    job.entry.key    = key;
+    job.entry.tokens = prompt;
+
+    double copy_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    ui_log("Prompt cache: snapshot %zu tokens (%.1f MB) in %.1f ms", prompt.size(),
+           job.state.size() / 1024.0 / 1024.0, copy_ms);
+
+    {
+        std::lock_guard<std::mutex> lock(g_cache_mutex);
+        if (!g_cache_thread.joinable()) g_cache_thread = std::thread(cache_writer);
+        g_cache_pending.push_back(path);
+        g_cache_queue.push_back(std::move(job));
+    }
+    g_cache_cv.notify_one();
+}
+
+// Stop strings for text-based detection (catches multi-token BPE sequences)
+static const char * k_stop_strs[] = {
+    "<|im_end|>", "<|im_start|>",           // ChatML
+    "<|eot_id|>", "<|start_header_id|>",    // Llama 3
+    "<end_of_turn>", "<start_of_turn>",      // Gemma
+    "<|end|>", "<|user|>", "<|assistant|>",  // Phi
+    nullptr
+};
+
+// Scheduler — a native thread that owns g_context and drives every generation.
+// Each iteration merges one decode token per running request with chunked
+// prefill of newly admitted prompts into a single llama_batch, so concurrent
+// requests share weight reads instead of serializing on the context.
+
+// Generation request — built on the caller's thread, driven by the scheduler
+struct infer_request {
+    // Input
+    infer_session *           sess    = nullptr;
+    std::vector<llama_token>  prompt;
+    int                       max_gen = 128;
+    bool                      fresh   = false;  // Drop the session's KV before admission
+    bool                      ignore_eos = false; // Generate exactly max_gen tokens (benchmarks)
+    bool                      timed   = false;  // Record per-token timestamps
+    llama_sampler *           smpl    = nullptr;
+    adapter_set               adapters;         // Adapter set this request runs under
+
+    // Scheduler state (scheduler thread only)
+    bool                      decoding      = false; // Prompt fully prefilled
+    size_t                    n_reuse       = 0;     // Prompt tokens reused from the session's KV
+    size_t                    n_cache_prefix = 0;    // Prompt cache snapshot point (system prompt), 0 = none
+    int32_t                   n_chunk       = 0;     // Prompt tokens in the current batch
+    int32_t                   i_batch       = -1;    // Logits row in the current batch
+    llama_token               next_token    = 0;     // Sampled, decoded in the next batch
+    int                       n_sampled     = 0;
+    int                       n_generated   = 0;     // Tokens decoded after the prompt
+    std::vector<llama_token>  draft;                 // Speculative tokens verified in the current batch
+    int                       n_drafted     = 0;
+    int                       n_accepted    = 0;
+    // Lookup decoding: n-gram hash -> position right after its latest occurrence, per n-gram size
+    std::unordered_map<uint64_t, int32_t> ngram_index[LOOKUP_NGRAM_MAX - LOOKUP_NGRAM_MIN + 1];
+    size_t                    n_indexed     = 0;     // History positions already indexed
+    std::string               accumulated;           // Full generated text for stop detection
+    int                       n_streamed_chars = 0;  // Characters already handed to the caller
+    bool                      finished      = false;
+    bool                      scheduled     = false; // Its adapter group runs this step
+    bool                      paused        = false; // Skipped while another group ran
+    double                    wait_ms       = 0.0;   // Queued + paused while other groups ran
+    std::chrono::steady_clock::time_point t_submit, t_last_step, t_prefill_start, t_gen_start, t_end;
+    std::vector<std::chrono::steady_clock::time_point> t_tokens; // Sample time per token (timed only)
+
+    // Output (guarded by mutex, consumed by the caller)
+    std::mutex                mutex;
+    std::condition_variable   cv;
+    std::string               pending;   // Text ready to stream
+    std::string               error;
+    bool                      done    = false;
+};
+
+static std::thread                  g_sched_thread;
+static std::mutex                   g_sched_mutex;   // Guards g_pending and g_sched_stop
+static std::condition_variable      g_sched_cv;
+static std::deque<infer_request *>  g_pending;       // Submitted, waiting for their session
+static std::vector<infer_request *> g_active;        // Admitted (g_ctx_mutex)
+static bool                         g_sched_stop = false;
+static llama_batch                  g_sched_batch    = {};
+static int32_t                      g_sched_batch_cap = 0;
+static engine_thread_fn             g_sched_hook     = nullptr; // Front-end thread setup (JVM attach)
+
+// Aggregate throughput over one busy period (scheduler thread only)
+static std::chrono::steady_clock::time_point g_busy_start;
+static int64_t                      g_busy_tokens   = 0;
+static int                          g_busy_peak     = 0;
+
+// Adapter grouping — each step runs the requests of one adapter set. The attached set
+// keeps running while it has work, unless another group has waited longer than the slice.
+#define SCHED_GROUP_SLICE_MS 250
+
+// Scheduler counters for getSchedulerStats (g_ctx_mutex)
+static int64_t                      g_stat_requests  = 0;
+static int64_t                      g_stat_steps     = 0;
+static int64_t                      g_stat_switches  = 0;   // Adapter set changes on the context
+static double                       g_stat_wait_ms   = 0.0; // Sum over finished requests
+static double                       g_stat_wait_max  = 0.0;
+
+// Helper: Hand text to the caller thread
+static void request_push_text(infer_request & req, const std::string & text) {
+    std::lock_guard<std::mutex> lock(req.mutex);
+    req.pending += text;
+    req.cv.notify_all();
+}
+
+// Helper: Stop a request — flush held-back text, release its session and KV reservation.
+// The caller is only woken in scheduler_retire(), after the request left g_active.
+static void request_finish(infer_request & req, const char * error) {
+    if (error) {
+        req.error = error;
+    } else if ((int) req.accumulated.size() > req.n_streamed_chars) {
+        std::string remaining = req.accumulated.substr(req.n_streamed_chars);
+        int safe_len = utf8_complete_len(remaining.c_str(), (int) remaining.size());
+        if (safe_len > 0) {
+            request_push_text(req, remaining.substr(0, safe_len));
+        }
+        req.n_streamed_chars = (int) req.accumulated.size();
+    }
+    req.sess->busy       = false;
+    req.sess->n_reserved = 0;
+    req.sess->last_used  = ++g_session_tick;
+    req.t_end            = std::chrono::steady_clock::now();
+    req.finished         = true;
+
+    g_stat_requests++;
+    g_stat_wait_ms += req.wait_ms;
+    g_stat_wait_max = std::max(g_stat_wait_max, req.wait_ms);
+}
+
+// Helper: Wake the caller of a finished request. Must be the last access to req.
+static void request_signal_done(infer_request & req) {
+    std::lock_guard<std::mutex> lock(req.mutex);
+    req.done = true;
+    req.cv.notify_all();
+}
+
+// Helper: Process a sampled token — EOG / stop string / max_gen checks and
+// streaming of the new text delta. Returns false when the request is complete.
+static bool request_accept_token(infer_request & req, llama_token token) {
+    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+    req.n_sampled++;
+    if (req.timed) {
+        req.t_tokens.push_back(std::chrono::steady_clock::now());
+    }
+
+    // Check EOG (single-token stop — catches proper special tokens)
+    if (!req.ignore_eos && llama_vocab_is_eog(vocab, token)) {
+        ui_log("EOG at token %d (seq %d)", req.n_sampled, req.sess->seq_id);
+        return false;
+    }
+
+    // Convert token to text (special=false: don't render control tokens)
+    char piece[256];
+    int n = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+    if (n > 0) {
+        req.accumulated.append(piece, n);
+    }
+
+    // Text-based stop sequence detection (catches multi-token BPE sequences)
+    int max_stop_len = 0;
+    for (int s = 0; k_stop_strs[s]; s++) {
+        size_t stop_len = strlen(k_stop_strs[s]);
+        if ((int) stop_len > max_stop_len) max_stop_len = (int) stop_len;
+        if (!req.ignore_eos && req.accumulated.size() >= stop_len &&
+            req.accumulated.compare(req.accumulated.size() - stop_len, stop_len, k_stop_strs[s]) == 0) {
+            req.accumulated.resize(req.accumulated.size() - stop_len);
+            ui_log("Stop string '%s' at token %d (seq %d)", k_stop_strs[s], req.n_sampled, req.sess->seq_id);
+            return false;
+        }
+    }
+
+    // Stream new characters (only the delta), holding back a possible stop-string prefix
+    int safe_end = (int) req.accumulated.size() - max_stop_len;
+    if (safe_end > req.n_streamed_chars) {
+        // Ensure we don't split a multi-byte UTF-8 character
+        int chunk_len = safe_end - req.n_streamed_chars;
+        int safe_len = utf8_complete_len(req.accumulated.c_str() + req.n_streamed_chars, chunk_len);
+        if (safe_len > 0) {
+            request_push_text(req, req.accumulated.substr(req.n_streamed_chars, safe_len));
+            req.n_streamed_chars += safe_len;
+        }
+    }
+
+    if (req.n_sampled >= req.max_gen) {
+        return false;
+    }
+
+    req.next_token = token;
+    return true;
+}
+
+// Helper: Most tokens any draft source may propose per step
+static int spec_max_draft() {
+    return std::max(g_draft_context ? g_n_draft : 0, g_n_lookup);
+}
+
+// Helper: Admit a request onto its session — reuse the session's KV prefix,
+// drop the diverging tail and reserve cells for the rest of the turn.
+static void request_admit(infer_request & req) {
+    infer_session & sess = *req.sess;
+    sess.busy      = true;
+    sess.last_used = ++g_session_tick;
+
+    // KV entries computed under another adapter set can't be reused
+    if (req.fresh || sess.adapters != req.adapters) {
+        evict_session(sess);
+    }
+    sess.adapters = req.adapters;
+
+    // Reuse the KV cache for the longest common prefix with the previous turn.
+    // At least one token must be decoded so the last prompt position has logits.
+    size_t n_reuse = common_prefix_len(sess.tokens, req.prompt);
+    if (n_reuse >= req.prompt.size()) {
+        n_reuse = req.prompt.size() - 1;
+    }
+    llama_memory_t mem = llama_get_memory(g_context);
+    if (!llama_memory_seq_rm(mem, sess.seq_id, (llama_pos) n_reuse, -1)) {
+        // Memory type can't drop a partial tail (e.g. recurrent state) — start over
+        n_reuse = 0;
+        llama_memory_seq_rm(mem, sess.seq_id, -1, -1);
+    }
+    sess.tokens.resize(n_reuse);
+
+    // Free cells held by idle sessions if this turn wouldn't fit
+    sess.n_reserved = req.prompt.size() + (size_t) req.max_gen + (size_t) spec_max_draft();
+    if (!make_room(sess)) {
+        ui_log("KV cache can't hold prompt + %d generated tokens (seq %d), generation may stop early",
+               req.max_gen, sess.seq_id);
+    }
+
+    // A longer prefix may be cached on disk (e.g. the system prompt after a restart)
+    n_reuse = cache_restore(sess.seq_id, req.prompt, n_reuse);
+    sess.tokens.assign(req.prompt.begin(), req.prompt.begin() + (long) n_reuse);
+    req.n_reuse = n_reuse;
+    if (req.n_cache_prefix <= n_reuse) req.n_cache_prefix = 0;   // Already resident or restored
+
+    req.t_prefill_start = std::chrono::steady_clock::now();
+    req.t_last_step     = req.t_prefill_start;
+    req.wait_ms        += std::chrono::duration<double, std::milli>(req.t_prefill_start - req.t_submit).count();
+}
+
+// Helper: Append one token to a batch
+static void batch_add(llama_batch & batch, llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+    const int32_t i = batch.n_tokens++;
+    batch.token[i]     = token;
+    batch.pos[i]       = pos;
+    batch.n_seq_id[i]  = 1;
+    batch.seq_id[i][0] = seq;
+    batch.logits[i]    = logits;
+}
+
+// Helper: Greedy pick from a draft logits row
+static llama_token draft_argmax(int32_t idx) {
+    const float * logits = llama_get_logits_ith(g_draft_context, idx);
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(g_draft_model));
+    llama_token best = 0;
+    for (llama_token t = 1; t < n_vocab; t++) {
+        if (logits[t] > logits[best]) best = t;
+    }
+    return best;
+}
+
+// Helper: Drop the draft KV of every session except keep (draft context full)
+static void draft_evict_others(const infer_session & keep) {
+    llama_memory_t mem = llama_get_memory(g_draft_context);
+    for (auto & it : g_sessions) {
+        infer_session & s = it.second;
+        if (&s == &keep || s.draft_tokens.empty()) continue;
+        llama_memory_seq_rm(mem, s.seq_id, -1, -1);
+        s.draft_tokens.clear();
+    }
+}
+
+// Helper: Decode the draft batch, freeing other sessions' draft cells once if it doesn't fit
+static bool draft_decode(const infer_session & sess) {
+    int32_t ret = llama_decode(g_draft_context, g_draft_batch);
+    if (ret == 1) {
+        draft_evict_others(sess);
+        ret = llama_decode(g_draft_context, g_draft_batch);
+    }
+    return ret == 0;
+}
+
+// Helper: Bring the session's draft sequence up to date with its history
+// (target tokens + the token about to be decoded) and greedily draft up to n_max tokens.
+static void draft_model_propose(infer_request & req, int n_max, std::vector<llama_token> & out) {
+    infer_session & sess = *req.sess;
+    const size_t n_hist = sess.tokens.size() + 1;
+    if (n_hist + (size_t) n_max > llama_n_ctx(g_draft_context)) return;
+
+    auto hist_at = [&](size_t i) { return i < sess.tokens.size() ? sess.tokens[i] : req.next_token; };
+
+    // Keep the draft KV prefix that still matches; the last token is always re-decoded for logits
+    size_t n_keep = 0;
+    while (n_keep < sess.draft_tokens.size() && n_keep + 1 < n_hist &&
+           sess.draft_tokens[n_keep] == hist_at(n_keep)) {
+        n_keep++;
+    }
+    llama_memory_t mem = llama_get_memory(g_draft_context);
+    if (!llama_memory_seq_rm(mem, sess.seq_id, (llama_pos) n_keep, -1)) {
+        n_keep = 0;
+        llama_memory_seq_rm(mem, sess.seq_id, -1, -1);
+    }
+    sess.draft_tokens.resize(n_keep);
+
+    // Catch up in n_batch chunks (the whole prompt on the first step of a turn)
+    const size_t n_batch = llama_n_batch(g_draft_context);
+    while (sess.draft_tokens.size() < n_hist) {
+        const size_t start = sess.draft_tokens.size();
+        const size_t end   = std::min(n_hist, start + n_batch);
+        g_draft_batch.n_tokens = 0;
+        for (size_t p = start; p < end; p++) {
+            batch_add(g_draft_batch, hist_at(p), (llama_pos) p, sess.seq_id, p + 1 == n_hist);
+        }
+        if (!draft_decode(sess)) return;
+        for (size_t p = start; p < end; p++) {
+            sess.draft_tokens.push_back(hist_at(p));
+        }
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(g_draft_model);
+    int32_t idx = g_draft_batch.n_tokens - 1;
+    for (int i = 0; i < n_max; i++) {
+        llama_token token = draft_argmax(idx);
+        if (llama_vocab_is_eog(vocab, token)) break;
+        out.push_back(token);
+        if (i + 1 == n_max) break;
+
+        g_draft_batch.n_tokens = 0;
+        batch_add(g_draft_batch, token, (llama_pos) sess.draft_tokens.size(), sess.seq_id, true);
+        if (!draft_decode(sess)) break;
+        sess.draft_tokens.push_back(token);
+        idx = 0;
+    }
+}
+
+// Helper: Hash of the n tokens ending at history position end (inclusive)
+template <typename F>
+static uint64_t ngram_hash(F && hist_at, size_t end, int n) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = end + 1 - (size_t) n; i <= end; i++) {
+        h = (h ^ (uint64_t)(uint32_t) hist_at(i)) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Helper: Propose a continuation of the longest n-gram at the end of the history
+// (session tokens + the token about to be decoded) that occurred earlier in it.
+static void lookup_propose(infer_request & req, int n_max, std::vector<llama_token> & out) {
+    const infer_session & sess = *req.sess;
+    const size_t n_hist = sess.tokens.size() + 1;
+    auto hist_at = [&](size_t i) { return i < sess.tokens.size() ? sess.tokens[i] : req.next_token; };
+
+    // Index every n-gram that has a continuation — all except those ending at the last position
+    for (; req.n_indexed + 1 < n_hist; req.n_indexed++) {
+        for (int n = LOOKUP_NGRAM_MIN; n <= LOOKUP_NGRAM_MAX; n++) {
+            if (req.n_indexed + 1 < (size_t) n) break;
+            req.ngram_index[n - LOOKUP_NGRAM_MIN][ngram_hash(hist_at, req.n_indexed, n)] = (int32_t) req.n_indexed + 1;
+        }
+    }
+
+    for (int n = LOOKUP_NGRAM_MAX; n >= LOOKUP_NGRAM_MIN; n--) {
+        if (n_hist < (size_t) n + 1) continue;
+        const auto & index = req.ngram_index[n - LOOKUP_NGRAM_MIN];
+        auto it = index.find(ngram_hash(hist_at, n_hist - 1, n));
+        if (it == index.end()) continue;
+
+        // Reject hash collisions
+        const size_t cont = (size_t) it->second;
+        bool match = true;
+        for (int k = 1; k <= n && match; k++) {
+            match = hist_at(cont - (size_t) k) == hist_at(n_hist - (size_t) k);
+        }
+        if (!match) continue;
+
+        for (size_t p = cont; p < n_hist && (int) out.size() < n_max; p++) {
+            out.push_back(hist_at(p));
+        }
+        return;
+    }
+}
+
+// Helper: Propose speculative tokens to verify after req.next_token (none = plain decode).
+// Lookup is tried first since it's free; the draft model covers what it can't find.
+static void propose_draft(infer_request & req, int n_max) {
+    req.draft.clear();
+    if (n_max <= 0) return;
+    if (g_n_lookup > 0) {
+        lookup_propose(req, std::min(n_max, g_n_lookup), req.draft);
+    }
+    if (req.draft.empty() && g_draft_context) {
+        draft_model_propose(req, std::min(n_max, g_n_draft), req.draft);
+    }
+}
+
+// Helper: Remove finished requests from g_active and wake their callers
+static void scheduler_retire() {
+    std::vector<infer_request *> finished;
+    for (auto it = g_active.begin(); it != g_active.end();) {
+        if ((*it)->finished) {
+            finished.push_back(*it);
+            it = g_active.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (infer_request * req : finished) {
+        request_signal_done(*req);
+    }
+}
+
+// Helper: Fail every queued and running request (model/adapter change, shutdown).
+// Caller holds g_ctx_mutex.
+static void abort_requests(const char * error) {
+    for (infer_request * req : g_active) {
+        evict_session(*req->sess);
+        request_finish(*req, error);
+    }
+    scheduler_retire();
+
+    std::lock_guard<std::mutex> lock(g_sched_mutex);
+    for (infer_request * req : g_pending) {
+        req->error = error;
+        request_signal_done(*req);
+    }
+    g_pending.clear();
+}
+
+// Helper: Pick the adapter group to run this step. Stays on the attached set while it has
+// runnable requests, unless another group has waited longer than SCHED_GROUP_SLICE_MS —
+// then the longest-waiting group runs. Returns false if nothing is runnable.
+// Caller holds g_sched_mutex.
+static bool scheduler_pick_group(std::chrono::steady_clock::time_point now, adapter_set & group) {
+    bool current_ready = false;
+    const infer_request * oldest = nullptr;
+    std::chrono::steady_clock::time_point oldest_t;
+
+    auto consider = [&](const infer_request * req, std::chrono::steady_clock::time_point since) {
+        if (req->adapters == g_active_adapters) {
+            current_ready = true;
+        } else if (!oldest || since < oldest_t) {
+            oldest   = req;
+            oldest_t = since;
+        }
+    };
+    for (const infer_request * req : g_active) {
+        consider(req, req->t_last_step);
+    }
+    for (const infer_request * req : g_pending) {
+        if (!req->sess->busy) consider(req, req->t_submit);
+    }
+
+    if (oldest && (!current_ready || now - oldest_t > std::chrono::milliseconds(SCHED_GROUP_SLICE_MS))) {
+        group = oldest->adapters;
+        return true;
+    }
+    group = g_active_adapters;
+    return current_ready;
+}
+
+// Helper: Fail every queued and running request of one adapter group
+static void abort_group(const adapter_set & group, const char * error) {
+    for (infer_request * req : g_active) {
+        if (req->adapters != group) continue;
+        evict_session(*req->sess);
+        request_finish(*req, error);
+    }
+    scheduler_retire();
+
+    std::lock_guard<std::mutex> lock(g_sched_mutex);
+    for (auto it = g_pending.begin(); it != g_pending.end();) {
+        if ((*it)->adapters != group) { ++it; continue; }
+        (*it)->error = error;
+        request_signal_done(**it);
+        it = g_pending.erase(it);
+    }
+}
+
+// Helper: One scheduler iteration — pick an adapter group, admit, build the merged batch,
+// decode, sample. Returns true while requests are still running.
+static bool scheduler_step() {
+    std::lock_guard<std::mutex> ctx_lock(g_ctx_mutex);
+    if (!g_context) return false;
+
+    const auto now = std::chrono::steady_clock::now();
+    adapter_set group;
+    {
+        std::lock_guard<std::mutex> lock(g_sched_mutex);
+        if (!scheduler_pick_group(now, group)) return !g_active.empty();
+    }
+
+    if (group != g_active_adapters) {
+        if (!apply_adapter_set(group)) {
+            ui_log("Scheduler: failed to attach adapter set [%s]", adapter_set_ident(group).c_str());
+            abort_group(group, "ERROR: Failed to apply LoRA adapters");
+            return true;
+        }
+        g_stat_switches++;
+    }
+
+    // Admit queued requests of this group whose session is idle (one running request per session)
+    {
+        std::lock_guard<std::mutex> lock(g_sched_mutex);
+        for (auto it = g_pending.begin(); it != g_pending.end();) {
+            infer_request * req = *it;
+            if (req->sess->busy || req->adapters != group) { ++it; continue; }
+            request_admit(*req);
+            g_active.push_back(req);
+            it = g_pending.erase(it);
+        }
+    }
+    if (g_active.empty()) return false;
+    g_stat_steps++;
+
+    // Requests of other groups sit this step out; their KV stays in place
+    for (infer_request * req : g_active) {
+        req->scheduled = req->adapters == group;
+        if (!req->scheduled) {
+            req->paused = true;
+            continue;
+        }
+        if (req->paused) {
+            req->wait_ms += std::chrono::duration<double, std::milli>(now - req->t_last_step).count();
+            req->paused   = false;
+        }
+        req->t_last_step = now;
+    }
+
+    const int32_t n_batch = (int32_t) llama_n_batch(g_context);
+    if (g_sched_batch_cap < n_batch) {
+        if (g_sched_batch_cap > 0) llama_batch_free(g_sched_batch);
+        g_sched_batch     = llama_batch_init(n_batch, 0, 1);
+        g_sched_batch_cap = n_batch;
+    }
+    g_sched_batch.n_tokens = 0;
+
+    if (g_busy_tokens == 0 && g_busy_peak == 0) {
+        g_busy_start = std::chrono::steady_clock::now();
+    }
+    g_busy_peak = std::max(g_busy_peak, (int) g_active.size());
+
+    // One decode token per running request, followed by its draft tokens when speculating.
+    // All of them get logits so the whole draft is verified in this one decode.
+    int n_decoding = 0;
+    for (infer_request * req : g_active) {
+        req->i_batch = -1;
+        req->n_chunk = 0;
+        req->draft.clear();
+        if (req->scheduled && req->decoding) n_decoding++;
+    }
+    int32_t spec_budget = n_batch - n_decoding;
+    for (infer_request * req : g_active) {
+        if (!req->scheduled || !req->decoding) continue;
+        infer_session & sess = *req->sess;
+        const llama_pos n_past = (llama_pos) sess.tokens.size();
+
+        int n_max = std::min(spec_max_draft(), req->max_gen - req->n_sampled - 1);
+        n_max = std::min(n_max, (int) llama_n_ctx(g_context) - n_past - 1);
+        n_max = std::min(n_max, (int) spec_budget);
+        propose_draft(*req, n_max);
+        spec_budget -= (int32_t) req->draft.size();
+
+        req->i_batch = g_sched_batch.n_tokens;
+        batch_add(g_sched_batch, req->next_token, n_past, sess.seq_id, true);
+        for (size_t j = 0; j < req->draft.size(); j++) {
+            batch_add(g_sched_batch, req->draft[j], n_past + 1 + (llama_pos) j, sess.seq_id, true);
+        }
+    }
+
+    // Chunked prefill in admission order. While others are decoding, keep the
+    // chunk to one ubatch so their inter-token latency stays bounded.
+    int32_t budget = n_batch - g_sched_batch.n_tokens;
+    if (n_decoding > 0) {
+        budget = std::min(budget, (int32_t) llama_n_ubatch(g_context));
+    }
+    for (infer_request * req : g_active) {
+        if (!req->scheduled || req->decoding || budget <= 0) continue;
+        const size_t n_past = req->sess->tokens.size();
+        int32_t take = std::min<int32_t>(budget, (int32_t)(req->prompt.size() - n_past));
+        if (req->n_cache_prefix > n_past) {
+            // End the chunk at the cache prefix so the sequence can be snapshotted there
+            take = std::min<int32_t>(take, (int32_t)(req->n_cache_prefix - n_past));
+        }
+        for (int32_t i = 0; i < take; i++) {
+            const size_t p = n_past + (size_t) i;
+            batch_add(g_sched_batch, req->prompt[p], (llama_pos) p, req->sess->seq_id, p + 1 == req->prompt.size());
+        }
+        if (n_past + (size_t) take == req->prompt.size()) {
+            req->i_batch = g_sched_batch.n_tokens - 1;
+        }
+        req->n_chunk = take;
+        budget -= take;
+    }
+
+    int32_t ret = llama_decode(g_context, g_sched_batch);
+    if (ret == 1 && evict_lru_session(nullptr)) {
+        // No free KV slot — retry once after evicting an idle session
+        ret = llama_decode(g_context, g_sched_batch);
+    }
+    if (ret != 0) {
+        ui_log("Decode failed (ret=%d, %d tokens, %zu requests)", ret, g_sched_batch.n_tokens, g_active.size());
+        for (infer_request * req : g_active) {
+            if (req->i_batch < 0 && req->n_chunk == 0) continue;
+            evict_session(*req->sess);
+            request_finish(*req, req->decoding ? "Decode failed" : "ERROR: Failed to decode prompt");
+        }
+        scheduler_retire();
+        return !g_active.empty();
+    }
+    g_busy_tokens += g_sched_batch.n_tokens;
+
+    for (infer_request * req : g_active) {
+        if (!req->scheduled) continue;
+        infer_session & sess = *req->sess;
+        if (req->decoding) {
+            sess.tokens.push_back(req->next_token);
+            req->n_generated++;
+
+            // Verify the draft: the target samples at each position, and a draft token is kept
+            // while it matches. The first mismatch (or the bonus after a full match) is the next token.
+            const size_t n_draft = req->draft.size();
+            for (size_t j = 0; j <= n_draft; j++) {
+                llama_token token = llama_sampler_sample(req->smpl, g_context, req->i_batch + (int32_t) j);
+                if (!request_accept_token(*req, token)) {
+                    request_finish(*req, nullptr);
+                    break;
+                }
+                if (j == n_draft || token != req->draft[j]) break;
+                sess.tokens.push_back(token);
+                req->n_generated++;
+                req->n_accepted++;
+            }
+            req->n_drafted += (int) n_draft;
+
+            // Roll back KV cells of rejected draft tokens
+            if (n_draft > 0) {
+                llama_memory_seq_rm(llama_get_memory(g_context), sess.seq_id, (llama_pos) sess.tokens.size(), -1);
+            }
+            continue;
+        }
+
+        if (req->n_chunk > 0) {
+            const size_t n_past = sess.tokens.size();
+            sess.tokens.insert(sess.tokens.end(),
+                               req->prompt.begin() + (long) n_past,
+                               req->prompt.begin() + (long) n_past + req->n_chunk);
+            if (sess.tokens.size() == req->n_cache_prefix) {
+                cache_save(sess.seq_id, sess.tokens);
+                req->n_cache_prefix = 0;
+            }
+            if (sess.tokens.size() == req->prompt.size()) {
+                req->decoding    = true;
+                req->t_gen_start = std::chrono::steady_clock::now();
+                double prefill_s = std::chrono::duration<double>(req->t_gen_start - req->t_prefill_start).count();
+                size_t n_prefilled = req->prompt.size() - req->n_reuse;
+                ui_log("Prefill done: %zu tokens (%zu reused, %zu prefilled) in %.2fs (%.1f tok/s, seq %d)",
+                       req->prompt.size(), req->n_reuse, n_prefilled, prefill_s,
+                       prefill_s > 0 ? n_prefilled / prefill_s : 0.0, sess.seq_id);
+            }
+        }
+
+        // Prompt complete — sample the first generated token
+        if (req->i_batch >= 0) {
+            llama_token token = llama_sampler_sample(req->smpl, g_context, req->i_batch);
+            if (!request_accept_token(*req, token)) {
+                request_finish(*req, nullptr);
+            }
+        }
+    }
+    scheduler_retire();
+
+    if (g_active.empty()) {
+        double busy_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_busy_start).count();
+        ui_log("Scheduler idle: %lld tokens decoded in %.2fs (%.1f tok/s aggregate, peak %d concurrent)",
+               (long long) g_busy_tokens, busy_s, busy_s > 0 ? g_busy_tokens / busy_s : 0.0, g_busy_peak);
+        g_busy_tokens = 0;
+        g_busy_peak   = 0;
+        return false;
+    }
+    return true;
+}
+
+// Scheduler thread main loop
+static void scheduler_loop() {
+    engine_thread_fn hook = g_sched_hook;
+    if (hook) hook(true);
+
+    bool running = false;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(g_sched_mutex);
+            if (!running) {
+                g_sched_cv.wait(lock, [] { return g_sched_stop || !g_pending.empty(); });
+            }
+            if (g_sched_stop) break;
+        }
+        running = scheduler_step();
+    }
+
+    if (hook) hook(false);
+}
+
+// Helper: Queue a request for the scheduler, starting the thread on first use
+static void scheduler_submit(infer_request * req) {
+    std::lock_guard<std::mutex> lock(g_sched_mutex);
+    if (!g_sched_thread.joinable()) {
+        g_sched_stop = false;
+        g_sched_thread = std::thread(scheduler_loop);
+    }
+    req->t_submit = std::chrono::steady_clock::now();
+    g_pending.push_back(req);
+    g_sched_cv.notify_one();
+}
+
+// Helper: Stop and join the scheduler thread. Caller must not hold g_ctx_mutex.
+static void scheduler_shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(g_sched_mutex);
+        g_sched_stop = true;
+        g_sched_cv.notify_one();
+    }
+    if (g_sched_thread.joinable()) {
+        g_sched_thread.join();
+    }
+    if (g_sched_batch_cap > 0) {
+        llama_batch_free(g_sched_batch);
+        g_sched_batch_cap = 0;
+    }
+}
+
+// Helper: Create the sampler chain for a request
+static llama_sampler * make_sampler(float temperature) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    if (temperature <= 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    } else {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+    }
+    return smpl;
+}
+
+// Engine: Init Backend
+
+bool engine_init_backend(const std::string & native_lib_dir) {
+    ui_log("Initializing llama.cpp backend...");
+
+    ui_log_attach_llama();
+
+    if (!native_lib_dir.empty()) {
+        ui_log("Loading backends from: %s", native_lib_dir.c_str());
+
+        // Set ADSP_LIBRARY_PATH so FastRPC can find HTP skel libraries (libggml-htp-vXX.so)
+        // Must be set BEFORE backend initialization
+        setenv("ADSP_LIBRARY_PATH", native_lib_dir.c_str(), 1);
+        ui_log("ADSP_LIBRARY_PATH set to: %s", native_lib_dir.c_str());
+
+        // Enable Hexagon experimental ops (flash attention on HTP)
+        setenv("GGML_HEXAGON_EXPERIMENTAL", "1", 1);
+
+        ggml_backend_load_all_from_path(native_lib_dir.c_str());
+    } else {
+        ggml_backend_load_all();
+    }
+    llama_backend_init();
+
+    g_backend_initialized = true;
+    ui_log("Backend initialized");
+    return true;
+}
+
+// Helper: Free the draft context (the draft model stays loaded)
+static void draft_context_free() {
+    for (auto & it : g_sessions) it.second.draft_tokens.clear();
+    if (g_draft_context) {
+        llama_free(g_draft_context);
+        g_draft_context = nullptr;
+        llama_batch_free(g_draft_batch);
+        g_draft_batch = {};
+    }
+}
+
+// Helper: Unload the draft model and turn speculative decoding off
+static void draft_model_free() {
+    draft_context_free();
+    if (g_draft_model) { llama_model_free(g_draft_model); g_draft_model = nullptr; }
+    g_n_draft = 0;
+}
+
+// Helper: Draft tokens are only comparable if both models share the same vocab
+static bool draft_vocab_compatible() {
+    const llama_vocab * vt = llama_model_get_vocab(g_model);
+    const llama_vocab * vd = llama_model_get_vocab(g_draft_model);
+    return llama_vocab_type(vt) == llama_vocab_type(vd) &&
+           llama_vocab_n_tokens(vt) == llama_vocab_n_tokens(vd) &&
+           llama_vocab_bos(vt) == llama_vocab_bos(vd) &&
+           llama_vocab_eos(vt) == llama_vocab_eos(vd);
+}
+
+// Helper: Create the draft context to match the target context's shape
+static bool draft_context_init() {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx           = llama_n_ctx(g_context);
+    ctx_params.n_batch         = llama_n_batch(g_context);
+    ctx_params.n_ubatch        = llama_n_ubatch(g_context);
+    ctx_params.n_threads       = llama_n_threads(g_context);
+    ctx_params.n_threads_batch = llama_n_threads_batch(g_context);
+    ctx_params.n_seq_max       = MAX_SESSIONS;
+    ctx_params.kv_unified      = true;
+
+    g_draft_context = llama_init_from_model(g_draft_model, ctx_params);
+    if (!g_draft_context) return false;
+    g_draft_batch = llama_batch_init((int32_t) ctx_params.n_batch, 0, 1);
+    return true;
+}
+
+// Helper: Create g_context for the loaded model from g_ctx_params. Caller holds g_ctx_mutex.
+static bool context_create() {
+    int n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads_actual = (g_ctx_params.n_threads > 0) ? g_ctx_params.n_threads :
+        std::max(2, n_cpus - 2);
+    int n_ctx_actual = (g_ctx_params.n_ctx > 0) ? g_ctx_params.n_ctx : 2048;
+    // By default flash attention is forced on only with HTP (reduces graph splits on NPU);
+    // for CPU-only llama.cpp's own choice is kept
+    llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
+    if (g_ctx_params.flash_attn >= 0) {
+        flash_attn = g_ctx_params.flash_attn > 0 ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    } else if (g_n_gpu_layers > 0) {
+        flash_attn = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx        = n_ctx_actual;
+    ctx_params.n_batch      = g_ctx_params.n_batch  > 0 ? g_ctx_params.n_batch  : 512;
+    ctx_params.n_ubatch     = g_ctx_params.n_ubatch > 0 ? g_ctx_params.n_ubatch : 256;
+    ctx_params.n_threads       = n_threads_actual;
+    ctx_params.n_threads_batch = n_threads_actual;
+    // One sequence per session, all sharing the same n_ctx cells
+    ctx_params.n_seq_max       = MAX_SESSIONS;
+    ctx_params.kv_unified      = true;
+    if (flash_attn != LLAMA_FLASH_ATTN_TYPE_AUTO) {
+        ctx_params.flash_attn_type = flash_attn;
+    }
+
+    ui_log("CPU cores: %d, using %d threads", n_cpus, n_threads_actual);
+    ui_log("Context size: %d, n_batch=%u, n_ubatch=%u, flash_attn=%s", n_ctx_actual,
+           ctx_params.n_batch, ctx_params.n_ubatch,
+           flash_attn == LLAMA_FLASH_ATTN_TYPE_AUTO ? "auto" : flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "on" : "off");
+
+    g_context = llama_init_from_model(g_model, ctx_params);
+    return g_context != nullptr;
+}
+
+// Engine: Load Model
+
+std::string engine_load_model(const std::string & model_path, int nThreads, int nCtx, int nGpuLayers) {
+    if (!g_backend_initialized) {
+        return "ERROR: Backend not initialized";
+    }
+
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+
+    // Free previous
+    abort_requests("ERROR: Model reloaded during generation");
+    for (auto & it : g_sessions) it.second.tokens.clear();
+    draft_context_free();
+    pool_free_all();
+    if (g_context) { llama_free(g_context); g_context = nullptr; }
+    if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
+
+    ui_log("Loading model: %s", model_path.c_str());
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = false; // Load into RAM — avoids mmap page-fault stalls on Android
+
+    // Offload layers to NPU (Hexagon HTP) if available
+    int n_gpu = (nGpuLayers >= 0) ? nGpuLayers : 99;
+    model_params.n_gpu_layers = n_gpu;
+    ui_log("use_mmap=false, n_gpu_layers=%d", n_gpu);
+
+    g_model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (!g_model) {
+        return "ERROR: Failed to load model";
+    }
+    g_model_ident  = file_ident(model_path);
+    g_n_gpu_layers = n_gpu;
+
+    g_ctx_params.n_threads = nThreads;
+    g_ctx_params.n_ctx     = nCtx;
+    if (!context_create()) {
+        llama_model_free(g_model);
+        g_model = nullptr;
+        return "ERROR: Failed to create context";
+    }
+
+    char model_desc[256];
+    llama_model_desc(g_model, model_desc, sizeof(model_desc));
+    double model_size_gb = (double) llama_model_size(g_model) / 1024.0 / 1024.0 / 1024.0;
+
+    std::string result = "Model loaded: " + std::string(model_desc);
+    result += " (" + std::to_string(model_size_gb).substr(0, 4) + " GB)";
+    result += "\nThreads: " + std::to_string(llama_n_threads(g_context));
+    result += " | Context: " + std::to_string(llama_n_ctx(g_context));
+
+    ui_log("Model: %s (%.2f GB)", model_desc, model_size_gb);
+
+    // Re-attach a previously loaded draft model to the new context
+    if (g_draft_model) {
+        if (!draft_vocab_compatible()) {
+            ui_log("Draft model vocab doesn't match the new model — speculative decoding disabled");
+            draft_model_free();
+        } else if (!draft_context_init()) {
+            ui_log("Failed to recreate draft context — speculative decoding disabled");
+            draft_model_free();
+        }
+    }
+
+    return result;
+}
+
+// Engine: Recreate the context with a new shape (threads, n_ctx, batch sizes, flash attention)
+// The model and adapter pool stay loaded; every session's KV state is dropped.
+
+std::string engine_set_context_params(const engine_context_params & params) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    abort_requests("ERROR: Context reconfigured during generation");
+    for (auto & it : g_sessions) {
+        it.second.tokens.clear();
+        it.second.adapters.clear();
+    }
+    draft_context_free();
+    llama_free(g_context);
+    g_context = nullptr;
+    g_active_adapters.clear();   // Attachments belonged to the old context
+
+    g_ctx_params = params;
+    if (!context_create()) {
+        return "ERROR: Failed to create context";
+    }
+    if (g_draft_model && !draft_context_init()) {
+        ui_log("Failed to recreate draft context — speculative decoding disabled");
+        draft_model_free();
+    }
+
+    std::string result = "Context: " + std::to_string(llama_n_ctx(g_context));
+    result += " | Threads: " + std::to_string(llama_n_threads(g_context));
+    result += " | Batch: " + std::to_string(llama_n_batch(g_context)) + "/" + std::to_string(llama_n_ubatch(g_context));
+    return result;
+}
+
+// Engine: Check if model is loaded
+
+bool engine_has_model() {
+    return g_model != nullptr && g_context != nullptr;
+}
+
+// Engine: Scheduler thread setup hook (the JNI shim keeps the thread attached to the JVM)
+
+void engine_set_thread_hook(engine_thread_fn hook) {
+    std::lock_guard<std::mutex> lock(g_sched_mutex);
+    g_sched_hook = hook;
+}
+
+// Helper: Convert parallel id/scale arrays to an adapter set. Caller holds g_ctx_mutex.
+// Returns an error message, or nullptr on success.
+static const char * ids_to_adapter_set(
+        const std::vector<int32_t> & ids,
+        const std::vector<float> & scales,
+        adapter_set & set) {
+    if (ids.size() != scales.size()) {
+        return "ERROR: ids and scales must have the same length";
+    }
+
+    set.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (g_adapter_pool.find(ids[i]) == g_adapter_pool.end()) {
+            return "ERROR: Unknown adapter id";
+        }
+        set[i] = { ids[i], scales[i] };
+    }
+    return nullptr;
+}
+
+// Helper: Format an adapter set for results/logs, e.g. " 1@1.00 3@0.50"
+static std::string adapter_set_desc(const adapter_set & set) {
+    if (set.empty()) return " none";
+    std::string desc;
+    for (const auto & ref : set) {
+        char buf[48];
+        snprintf(buf, sizeof(buf), " %d@%.2f", ref.id, (double) ref.scale);
+        desc += buf;
+    }
+    return desc;
+}
+
+// Engine: Load LoRA adapter
+// Loads into the pool (reusing a resident copy) and makes it the only default adapter.
+
+std::string engine_load_lora_adapter(const std::string & lora_path) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    ui_log("Loading LoRA adapter from: %s", lora_path.c_str());
+
+    int32_t id = pool_load(lora_path);
+    if (id < 0) {
+        return "ERROR: Failed to load LoRA adapter";
+    }
+    g_default_adapters = { { id, 1.0f } };
+
+    ui_log("LoRA adapter loaded and applied");
+    return "LoRA loaded from: " + lora_path;
+}
+
+// Engine: Load LoRA adapter into the pool without activating it
+// Returns the pool ID, or -1 on failure.
+
+int32_t engine_load_adapter(const std::string & lora_path) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_model || !g_context) {
+        ui_log("loadAdapter: model not loaded");
+        return -1;
+    }
+    int32_t id = pool_load(lora_path);
+    if (id < 0) {
+        ui_log("loadAdapter: failed to load %s", lora_path.c_str());
+    }
+    return id;
+}
+
+// Engine: Free a pooled adapter
+// It's dropped from the default set and session routes; refused while a request uses it.
+
+void engine_unload_adapter(int32_t adapterId) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    auto it = g_adapter_pool.find(adapterId);
+    if (it == g_adapter_pool.end()) return;
+    if (it->second.n_pinned > 0) {
+        ui_log("unloadAdapter: adapter %d is used by a queued or running request", adapterId);
+        return;
+    }
+
+    auto drop = [adapterId](adapter_set & set) {
+        set.erase(std::remove_if(set.begin(), set.end(),
+            [adapterId](const adapter_ref & ref) { return ref.id == adapterId; }), set.end());
+    };
+    drop(g_default_adapters);
+    for (auto & s : g_sessions) drop(s.second.route);
+
+    pool_free(adapterId);
+    ui_log("Adapter pool: unloaded %d", adapterId);
+}
+
+// Engine: Set the default adapter set — pooled adapters with individual scales (empty = base model)
+// Applies to requests on sessions without their own set. Switching doesn't touch disk
+// or in-flight requests; the scheduler attaches the set when those requests run.
+
+std::string engine_set_active_adapters(const std::vector<int32_t> & ids, const std::vector<float> & scales) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    adapter_set set;
+    const char * err = ids_to_adapter_set(ids, scales, set);
+    if (err) {
+        return err;
+    }
+    g_default_adapters = set;
+
+    std::string result = "Active adapters:" + adapter_set_desc(set);
+    ui_log("%s", result.c_str());
+    return result;
+}
+
+// Engine: Set the adapter pool memory budget
+
+void engine_set_adapter_budget(int64_t maxBytes) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    g_adapter_budget = (maxBytes > 0) ? (size_t) maxBytes : (size_t) 512 * 1024 * 1024;
+    ui_log("Adapter pool budget: %.1f MB", g_adapter_budget / 1024.0 / 1024.0);
+    pool_enforce_budget();
+}
+
+// Engine: Remove LoRA adapter (clears the default set; adapters stay pooled)
+
+void engine_remove_lora_adapter() {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_default_adapters.empty()) {
+        g_default_adapters.clear();
+        ui_log("LoRA adapter removed");
+    }
+}
+
+// Engine: Check if adapter is active
+
+bool engine_has_adapter() {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    return !g_default_adapters.empty();
+}
+
+// Engine: Load draft model for speculative decoding
+// A small model with the same vocab proposes nDraft tokens per step; the target
+// verifies them in one batched decode and keeps the longest matching prefix.
+
+std::string engine_load_draft_model(const std::string & draft_path, int nDraft) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    abort_requests("ERROR: Draft model changed during generation");
+    draft_model_free();
+
+    ui_log("Loading draft model: %s", draft_path.c_str());
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap     = false;
+    model_params.n_gpu_layers = 0;
+
+    g_draft_model = llama_model_load_from_file(draft_path.c_str(), model_params);
+    if (!g_draft_model) {
+        return "ERROR: Failed to load draft model";
+    }
+    if (!draft_vocab_compatible()) {
+        draft_model_free();
+        return "ERROR: Draft model vocab doesn't match the loaded model";
+    }
+    if (!draft_context_init()) {
+        draft_model_free();
+        return "ERROR: Failed to create draft context";
+    }
+
+    g_n_draft = (nDraft > 0) ? nDraft : 4;
+
+    char model_desc[256];
+    llama_model_desc(g_draft_model, model_desc, sizeof(model_desc));
+    ui_log("Draft model: %s, %d tokens per step", model_desc, g_n_draft);
+
+    std::string result = "Draft model loaded: " + std::string(model_desc);
+    result += "\nDraft tokens: " + std::to_string(g_n_draft);
+    return result;
+}
+
+// Engine: Remove draft model (back to plain decoding)
+
+void engine_remove_draft_model() {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (g_draft_model) {
+        abort_requests("ERROR: Draft model removed during generation");
+        draft_model_free();
+        ui_log("Draft model removed");
+    }
+}
+
+// Engine: Enable/disable prompt lookup decoding
+// Proposes up to nDraft tokens per step by continuing n-grams found earlier in the
+// prompt or the generated text. Works with or without a draft model.
+
+void engine_set_lookup_decoding(bool enabled, int nDraft) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    g_n_lookup = enabled ? ((nDraft > 0) ? nDraft : 8) : 0;
+    if (g_n_lookup > 0) {
+        ui_log("Lookup decoding on: %d-%d grams, up to %d tokens per step",
+               LOOKUP_NGRAM_MIN, LOOKUP_NGRAM_MAX, g_n_lookup);
+    } else {
+        ui_log("Lookup decoding off");
+    }
+}
+
+// Engine: Configure the on-disk prompt state cache
+// dir = "" disables it. Existing snapshots in dir are picked up immediately.
+
+void engine_set_prompt_cache(const std::string & dir, int64_t maxBytes) {
+    std::string cache_dir = dir;
+    while (cache_dir.size() > 1 && cache_dir.back() == '/') cache_dir.pop_back();
+
+    cache_writer_shutdown();   // Let pending snapshots land in the old directory
+
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    g_cache_dir       = cache_dir;
+    g_cache_max_bytes = (maxBytes > 0) ? (size_t) maxBytes : (size_t) 256 * 1024 * 1024;
+    g_cache_entries.clear();
+    if (g_cache_dir.empty()) {
+        ui_log("Prompt cache disabled");
+        return;
+    }
+
+    mkdir(g_cache_dir.c_str(), 0700);
+    cache_scan();
+    cache_enforce_cap();
+
+    size_t total = 0;
+    for (const auto & e : g_cache_entries) total += e.bytes;
+    ui_log("Prompt cache: %s, %zu entries (%.1f / %.1f MB)", g_cache_dir.c_str(), g_cache_entries.size(),
+           total / 1024.0 / 1024.0, g_cache_max_bytes / 1024.0 / 1024.0);
+}
+
+// Engine: Count prompt tokens (same tokenization as prepare_request)
+
+int engine_count_tokens(const std::string & text) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    if (!g_context) return -1;
+    return (int) common_tokenize(g_context, text, true, true).size();
+}
+
+// Helper: Format the first n_msg messages with a chat template, "" on failure
+static std::string format_chat(const char * tmpl, const std::vector<llama_chat_message> & messages,
+                               size_t n_msg, bool addAssistant) {
+    // First call to get required size
+    int32_t needed = llama_chat_apply_template(
+        tmpl, messages.data(), n_msg, addAssistant, nullptr, 0);
+
+    if (needed <= 0) {
+        return "";
+    }
+
+    // Allocate and format
+    std::vector<char> buf(needed + 1);
+    llama_chat_apply_template(
+        tmpl, messages.data(), n_msg, addAssistant, buf.data(), (int32_t) buf.size());
+    buf[needed] = '\0';
+
+    return std::string(buf.data());
+}
+
+// Engine: Apply model's chat template to messages
+// Returns "" when the model has no usable template (callers fall back to their own).
+// The formatted leading system messages become the prompt cache's snapshot point.
+
+std::string engine_apply_chat_template(
+        const std::vector<std::string> & roles,
+        const std::vector<std::string> & contents,
+        bool addAssistant) {
+    if (!g_model || roles.size() != contents.size()) {
+        return "";
+    }
+
+    size_t n_msg = roles.size();
+    std::vector<llama_chat_message> messages(n_msg);
+    for (size_t i = 0; i < n_msg; i++) {
+        messages[i].role = roles[i].c_str();
+        messages[i].content = contents[i].c_str();
+    }
+
+    // Get model's chat template
+    const char * tmpl = llama_model_chat_template(g_model, nullptr);
+
+    std::string text = format_chat(tmpl, messages, n_msg, addAssistant);
+    if (text.empty()) {
+        return "";
+    }
+
+    size_t n_system = 0;
+    while (n_system < n_msg && roles[n_system] == "system") n_system++;
+    if (n_system > 0 && n_system < n_msg) {
+        std::string prefix = format_chat(tmpl, messages, n_system, false);
+        if (!prefix.empty() && text.compare(0, prefix.size(), prefix) == 0) {
+            std::lock_guard<std::mutex> lock(g_ctx_mutex);
+            g_cache_prefix_text = std::move(prefix);
+        }
+    }
+
+    return text;
+}
+
+// Helper: Tokenize and validate a prompt for a session. Caller holds g_ctx_mutex.
+// Returns an error message, or nullptr on success.
+static const char * prepare_request(
+        infer_request & req,
+        infer_session & sess,
+        const std::string & prompt,
+        int maxTokens,
+        float temperature) {
+    // Tokenize prompt (parse_special=true so <|im_start|> etc. become single special tokens)
+    req.prompt = common_tokenize(g_context, prompt, true, true);
+    ui_log("Prompt tokens: %zu (seq %d)", req.prompt.size(), sess.seq_id);
+
+    if (req.prompt.empty()) {
+        return "ERROR: Empty prompt after tokenization";
+    }
+    if (req.prompt.size() >= llama_n_ctx(g_context)) {
+        return "ERROR: Prompt too long for context";
+    }
+
+    // Snapshot only the system-prompt prefix — later turns and restarts share it,
+    // while whole conversations rarely repeat
+    req.n_cache_prefix = 0;
+    if (!g_cache_dir.empty() && !g_cache_prefix_text.empty() &&
+        prompt.compare(0, g_cache_prefix_text.size(), g_cache_prefix_text) == 0) {
+        size_t n = common_prefix_len(common_tokenize(g_context, g_cache_prefix_text, true, true), req.prompt);
+        if (n >= CACHE_MIN_TOKENS && n < req.prompt.size()) req.n_cache_prefix = n;
+    }
+
+    req.sess     = &sess;
+    req.max_gen  = (maxTokens > 0) ? maxTokens : 128;
+    req.smpl     = make_sampler(temperature);
+    req.adapters = sess.routed ? sess.route : g_default_adapters;
+    pin_adapters(req.adapters, +1);
+    return nullptr;
+}
+
+// Helper: Block until a submitted request completes. Callers submit it under the same
+// g_ctx_mutex hold as prepare_request, so destroySession and abort_requests always see it
+// (queued or running) and the session can't be freed under the scheduler.
+// Text is delivered on the calling thread — to on_text (streaming) and/or out.
+static void run_request(infer_request & req, engine_text_fn on_text, void * user_data, std::string * out) {
+    for (;;) {
+        std::string chunk;
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(req.mutex);
+            req.cv.wait(lock, [&req] { return req.done || !req.pending.empty(); });
+            chunk.swap(req.pending);
+            done = req.done;
+        }
+        if (!chunk.empty()) {
+            if (on_text) on_text(chunk, user_data);
+            if (out)     out->append(chunk);
+        }
+        if (done) break;
+    }
+
+    llama_sampler_free(req.smpl);
+    req.smpl = nullptr;
+
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    pin_adapters(req.adapters, -1);
+}
+
+// Helper: Log generation speed of a finished request, with draft acceptance when speculating
+static void log_request_speed(const char * verb, const infer_request & req) {
+    double gen_s = req.decoding ? std::chrono::duration<double>(req.t_end - req.t_gen_start).count() : 0.0;
+    double tok_s = gen_s > 0 ? req.n_generated / gen_s : 0.0;
+    if (req.n_drafted > 0) {
+        ui_log("%s %d tokens in %.2fs (%.1f tok/s, draft accepted %d/%d = %.0f%%, waited %.0f ms)", verb,
+               req.n_generated, gen_s, tok_s, req.n_accepted, req.n_drafted,
+               100.0 * req.n_accepted / req.n_drafted, req.wait_ms);
+    } else {
+        ui_log("%s %d tokens in %.2fs (%.1f tok/s, waited %.0f ms)", verb, req.n_generated, gen_s, tok_s, req.wait_ms);
+    }
+}
+
+// Engine: Generate text (inference)
+// Runs on a temporary session so it can be batched with other requests.
+
+std::string engine_generate(const std::string & prompt, int maxTokens, float temperature) {
+    infer_request req;
+    int32_t tmp_session_id;
+    {
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        if (!g_model || !g_context) {
+            return "ERROR: Model not loaded";
+        }
+
+        ui_log("Generating: prompt=%zu chars, max_tokens=%d, temp=%.2f",
+               prompt.length(), maxTokens, (double) temperature);
+
+        // Fresh generation on a throwaway session. Sequences belong to sessions, so
+        // none can be borrowed — the default conversation's KV must survive this call.
+        tmp_session_id = create_session();
+        if (tmp_session_id < 0) {
+            ui_log("generate: all %d sequences in use", MAX_SESSIONS);
+            return "ERROR: All sequences are in use, destroy a session first";
+        }
+        infer_session & sess = *find_session(tmp_session_id);
+        req.fresh = true;
+
+        const char * err = prepare_request(req, sess, prompt, maxTokens, temperature);
+        if (err) {
+            g_sessions.erase(tmp_session_id);
+            return err;
+        }
+        scheduler_submit(&req);
+    }
+
+    std::string result;
+    run_request(req, nullptr, nullptr, &result);
+
+    {
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        infer_session * sess = find_session(tmp_session_id);
+        if (sess) evict_session(*sess);
+        g_sessions.erase(tmp_session_id);
+    }
+
+    if (!req.error.empty()) {
+        return req.error;
+    }
+
+    log_request_speed("Generated", req);
+
+    return result;
+}
+
+// Engine: Create inference session
+// Returns a session handle backed by its own llama sequence, or -1 if all sequences are in use.
+
+int32_t engine_create_session() {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    int32_t session_id = create_session();
+    if (session_id < 0) {
+        ui_log("createSession: all %d sequences in use", MAX_SESSIONS);
+        return -1;
+    }
+    ui_log("Session %d created (seq %d)", session_id, find_session(session_id)->seq_id);
+    return session_id;
+}
+
+// Engine: Destroy inference session (frees its KV cells)
+
+void engine_destroy_session(int32_t sessionId) {
+    if (sessionId == DEFAULT_SESSION_ID) {
+        ui_log("destroySession: default session can't be destroyed");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    infer_session * sess = find_session(sessionId);
+    if (!sess) return;
+
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> sched_lock(g_sched_mutex);
+        for (infer_request * req : g_pending) {
+            if (req->sess == sess) { queued = true; break; }
+        }
+    }
+    if (sess->busy || queued) {
+        ui_log("destroySession: session %d has a generation in progress", sessionId);
+        return;
+    }
+
+    evict_session(*sess);
+    g_sessions.erase(sessionId);
+    ui_log("Session %d destroyed", sessionId);
+}
+
+// Engine: Route a session to its own adapter set
+// Requests on the session run under this set; the scheduler groups requests by set
+// so mixed traffic doesn't switch adapters on every decode step.
+
+std::string engine_set_session_adapters(
+        int32_t sessionId,
+        const std::vector<int32_t> * ids,
+        const std::vector<float> * scales) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    infer_session * sess = find_session(sessionId);
+    if (!sess) {
+        return "ERROR: Unknown session";
+    }
+
+    if (!ids) {
+        sess->routed = false;
+        sess->route.clear();
+        ui_log("Session %d: adapters follow the default set", sessionId);
+        return "Session adapters: default";
+    }
+
+    adapter_set set;
+    const char * err = ids_to_adapter_set(*ids, scales ? *scales : std::vector<float>(), set);
+    if (err) {
+        return err;
+    }
+    sess->routed = true;
+    sess->route  = set;
+
+    std::string result = "Session adapters:" + adapter_set_desc(set);
+    ui_log("Session %d: %s", sessionId, result.c_str());
+    return result;
+}
+
+// Engine: Generate text (streaming) on a session
+// The session keeps its KV state between calls, so switching conversations doesn't re-prefill.
+// Calls on different sessions from different threads are batched together by the scheduler.
+
+bool engine_generate_session(
+        int32_t session_id,
+        const std::string & prompt,
+        int maxTokens,
+        float temperature,
+        engine_text_fn on_text,
+        void * user_data,
+        std::string * error,
+        engine_gen_stats * stats,
+        bool ignore_eos) {
+    infer_request req;
+    req.ignore_eos = ignore_eos;
+    req.timed      = stats != nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        if (!g_model || !g_context) {
+            if (error) *error = "ERROR: Model not loaded";
+            return false;
+        }
+        infer_session * sess = find_session(session_id);
+        if (!sess) {
+            if (error) *error = "ERROR: Unknown session";
+            return false;
+        }
+        const char * err = prepare_request(req, *sess, prompt, maxTokens, temperature);
+        if (err) {
+            if (error) *error = err;
+            return false;
+        }
+        scheduler_submit(&req);
+    }
+
+    run_request(req, on_text, user_data, nullptr);
+
+    if (!req.error.empty()) {
+        if (error) *error = req.error;
+        return false;
+    }
+
+    log_request_speed("Streamed", req);
+
+    if (stats) {
+        typedef std::chrono::duration<double, std::milli> ms;
+        *stats = engine_gen_stats();
+        stats->n_prompt    = (int) req.prompt.size();
+        stats->n_reused    = (int) req.n_reuse;
+        stats->n_generated = req.n_sampled;
+        stats->n_drafted   = req.n_drafted;
+        stats->n_accepted  = req.n_accepted;
+        stats->queue_ms    = req.wait_ms;
+        if (req.decoding) {
+            stats->prefill_ms = ms(req.t_gen_start - req.t_prefill_start).count();
+        }
+        if (!req.t_tokens.empty()) {
+            stats->ttft_ms   = ms(req.t_tokens.front() - req.t_submit).count();
+            stats->decode_ms = ms(req.t_tokens.back() - req.t_tokens.front()).count();
+            for (size_t i = 1; i < req.t_tokens.size(); i++) {
+                stats->token_ms.push_back(ms(req.t_tokens[i] - req.t_tokens[i - 1]).count());
+            }
+        }
+    }
+    return true;
+}
+
+// Engine: Scheduler statistics as JSON
+// Queue wait covers time queued before admission plus time paused while other adapter groups ran.
+
+std::string engine_scheduler_stats(bool reset) {
+    std::lock_guard<std::mutex> lock(g_ctx_mutex);
+    size_t n_queued;
+    {
+        std::lock_guard<std::mutex> sched_lock(g_sched_mutex);
+        n_queued = g_pending.size();
+    }
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"requests\":%lld,\"steps\":%lld,\"adapter_switches\":%lld,"
+             "\"avg_wait_ms\":%.1f,\"max_wait_ms\":%.1f,\"queued\":%zu,\"running\":%zu,"
+             "\"adapters_resident\":%zu}",
+             (long long) g_stat_requests, (long long) g_stat_steps, (long long) g_stat_switches,
+             g_stat_requests > 0 ? g_stat_wait_ms / g_stat_requests : 0.0, g_stat_wait_max,
+             n_queued, g_active.size(), g_adapter_pool.size());
+
+    if (reset) {
+        g_stat_requests = 0;
+        g_stat_steps    = 0;
+        g_stat_switches = 0;
+        g_stat_wait_ms  = 0.0;
+        g_stat_wait_max = 0.0;
+    }
+    return buf;
+}
+
+// Engine: Cleanup — aborts in-flight requests, stops the scheduler and frees everything
+
+void engine_cleanup() {
+    ui_log("Cleaning up...");
+
+    {
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        abort_requests("ERROR: Engine shutting down");
+    }
+    scheduler_shutdown();
+    cache_writer_shutdown();
+
+    {
+        std::lock_guard<std::mutex> lock(g_ctx_mutex);
+        for (auto & it : g_sessions) it.second.tokens.clear();
+        pool_free_all();
+        draft_model_free();
+        if (g_context) { llama_free(g_context); g_context = nullptr; }
+        if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
+        if (g_backend_initialized) { llama_backend_free(); g_backend_initialized = false; }
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+// Inference engine — model/context, sessions, the resident adapter pool, the batching
+// scheduler, speculative decoding and the prompt state cache.
+// Platform neutral (no JNI / Android deps): liblora.so wraps it in JNI (lora_inference.cpp)
+// and lora-cli drives it directly on a workstation.
+//
+// Functions returning std::string follow the JNI convention: a status message, or "ERROR: ...".
+// All functions are thread-safe; generation calls block until their request finishes.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define ENGINE_DEFAULT_SESSION 0   // Session used by engine_generate_session callers without their own
+
+// Receives generated text (complete UTF-8) on the thread that called the generate function
+typedef void (*engine_text_fn)(const std::string & text, void * user_data);
+
+// Called on the scheduler thread right after it starts (true) and before it exits (false)
+typedef void (*engine_thread_fn)(bool started);
+
+// Context shape — engine_load_model sets n_threads / n_ctx and keeps the rest
+struct engine_context_params {
+    int n_threads  = 0;     // 0 = cores - 2
+    int n_ctx      = 0;     // 0 = 2048
+    int n_batch    = 512;   // Logical batch (prefill chunk)
+    int n_ubatch   = 256;   // Physical batch
+    int flash_attn = -1;    // -1 = on with NPU offload, else llama.cpp's choice; 0 = off; 1 = on
+};
+
+// Timing of one generation (engine_generate_session), all in milliseconds
+struct engine_gen_stats {
+    int    n_prompt    = 0;
+    int    n_reused    = 0;      // Prompt tokens served from the session's KV or the prompt cache
+    int    n_generated = 0;      // Tokens sampled
+    int    n_drafted   = 0;      // Speculative tokens proposed / accepted
+    int    n_accepted  = 0;
+    double queue_ms    = 0.0;    // Waiting for admission or for other adapter groups
+    double ttft_ms     = 0.0;    // Submit -> first token sampled
+    double prefill_ms  = 0.0;
+    double decode_ms   = 0.0;    // First -> last token sampled
+    std::vector<double> token_ms; // Gap before each token after the first
+};
+
+// Backend / model
+bool        engine_init_backend(const std::string & native_lib_dir);
+std::string engine_load_model(const std::string & path, int n_threads, int n_ctx, int n_gpu_layers);
+bool        engine_has_model();
+// Recreates the context (model and adapter pool stay loaded, KV state is dropped)
+std::string engine_set_context_params(const engine_context_params & params);
+void        engine_set_thread_hook(engine_thread_fn hook);
+void        engine_cleanup();
+
+// Adapter pool — ids/scales are parallel; an empty set means the base model
+std::string engine_load_lora_adapter(const std::string & path);   // Pool + make it the only default adapter
+int32_t     engine_load_adapter(const std::string & path);        // Pool only; returns the id or -1
+void        engine_unload_adapter(int32_t id);
+std::string engine_set_active_adapters(const std::vector<int32_t> & ids, const std::vector<float> & scales);
+void        engine_set_adapter_budget(int64_t max_bytes);
+void        engine_remove_lora_adapter();                         // Clears the default set
+bool        engine_has_adapter();
+
+// Speculation / caching
+std::string engine_load_draft_model(const std::string & path, int n_draft);
+void        engine_remove_draft_model();
+void        engine_set_lookup_decoding(bool enabled, int n_draft);
+void        engine_set_prompt_cache(const std::string & dir, int64_t max_bytes);
+
+// Prompting
+int         engine_count_tokens(const std::string & text);   // As tokenized for generation, -1 without a model
+std::string engine_apply_chat_template(
+        const std::vector<std::string> & roles,
+        const std::vector<std::string> & contents,
+        bool add_assistant);
+
+// One-shot generation on a throwaway session; returns the text or "ERROR: ..."
+std::string engine_generate(const std::string & prompt, int max_tokens, float temperature);
+
+// Sessions — each owns a llama sequence whose KV state persists between calls
+int32_t     engine_create_session();                  // -1 if all sequences are in use
+void        engine_destroy_session(int32_t session_id);
+// ids = nullptr clears the route (the session follows the default set again)
+std::string engine_set_session_adapters(
+        int32_t session_id,
+        const std::vector<int32_t> * ids,
+        const std::vector<float> * scales);
+// Streams text to on_text; returns false and sets *error on failure.
+// stats (optional) receives the request's timing; ignore_eos generates exactly max_tokens.
+bool        engine_generate_session(
+        int32_t session_id,
+        const std::string & prompt,
+        int max_tokens,
+        float temperature,
+        engine_text_fn on_text,
+        void * user_data,
+        std::string * error,
+        engine_gen_stats * stats = nullptr,
+        bool ignore_eos = false);
+
+// Scheduler statistics as JSON
+std::string engine_scheduler_stats(bool reset);
@@ -2,19 +2,17 @@
 #include <android/log.h>
 #include <string>
 #include <vector>
-#include <cstring>
-#include <unistd.h>
 #include <mutex>
-#include <chrono>
 
-#include "llama.h"
-#include "common.h"
-#include "ggml-backend.h"
+#include "lora_engine.h"
+#include "lora_log.h"
+#include "lora_merge.h"
+
+// JNI shim over lora_engine — converts arguments, forwards logs and streamed text to Kotlin.
+// All inference logic lives in lora_engine.cpp so it also builds on a plain Linux host.
 
 #define LOG_TAG "LORA_INFERENCE"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
 
 // JNI callbacks
 
@@ -30,56 +28,8 @@ static jmethodID   g_on_complete     = nullptr;
 static jmethodID   g_on_error        = nullptr;
 static std::mutex  g_stream_mutex;
 
-// Helper: Trim trailing incomplete UTF-8 multi-byte sequence (for streaming tokens).
-static int utf8_complete_len(const char * buf, int len) {
-    if (len <= 0) return 0;
-    int i = len - 1;
-    while (i >= 0 && ((unsigned char)buf[i] & 0xC0) == 0x80) i--;
-    if (i < 0) return 0;
-    unsigned char lead = (unsigned char)buf[i];
-    int expected;
-    if ((lead & 0x80) == 0)         expected = 1;
-    else if ((lead & 0xE0) == 0xC0) expected = 2;
-    else if ((lead & 0xF0) == 0xE0) expected = 3;
-    else if ((lead & 0xF8) == 0xF0) expected = 4;
-    else return i;
-    if ((len - i) >= expected) return len;
-    return i;
-}
-
-// Helper: Sanitize a string in-place for JNI NewStringUTF.
-// Replaces invalid/incomplete UTF-8 sequences with '?' anywhere in the string.
-static void utf8_sanitize(char * buf) {
-    unsigned char * p = (unsigned char *)buf;
-    while (*p) {
-        if (*p < 0x80) { p++; continue; } // ASCII
-        int expected;
-        if ((*p & 0xE0) == 0xC0)      expected = 2;
-        else if ((*p & 0xF0) == 0xE0) expected = 3;
-        else if ((*p & 0xF8) == 0xF0) expected = 4;
-        else { *p = '?'; p++; continue; } // invalid lead byte
-        // Check continuation bytes
-        bool valid = true;
-        for (int j = 1; j < expected; j++) {
-            if ((p[j] & 0xC0) != 0x80) { valid = false; break; }
-        }
-        if (valid) { p += expected; }
-        else { *p = '?'; p++; } // replace bad lead, re-scan from next byte
-    }
-}
-
-// Send a log message to Kotlin UI (thread-safe)
-static void ui_log(const char * fmt, ...) {
-    char buf[1024];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
-
-    // Always log to logcat
-    LOGI("%s", buf);
-
-    // Forward to Kotlin callback if available
+// ui_log sink — forwards every engine log line to the Kotlin LogCallback (thread-safe)
+static void jni_log_sink(const char * msg, void * /* user_data */) {
     std::lock_guard<std::mutex> lock(g_log_mutex);
     if (!g_jvm || !g_log_callback || !g_on_log) return;
 
@@ -92,8 +42,9 @@ static void ui_log(const char * fmt, ...) {
     }
     if (env) {
         // Sanitize: llama.cpp can truncate strings mid-UTF-8 character (e.g. tokenizer merges)
-        utf8_sanitize(buf);
-        jstring jmsg = env->NewStringUTF(buf);
+        std::string safe_msg(msg);
+        utf8_sanitize(&safe_msg[0]);
+        jstring jmsg = env->NewStringUTF(safe_msg.c_str());
         env->CallVoidMethod(g_log_callback, g_on_log, jmsg);
         env->DeleteLocalRef(jmsg);
     }
@@ -102,27 +53,18 @@ static void ui_log(const char * fmt, ...) {
     }
 }
 
-// llama.cpp log callback — forwards ALL messages to both logcat and UI
-static void log_callback(enum ggml_log_level level, const char * text, void * /* user_data */) {
-    // Skip empty/whitespace-only messages
-    if (!text || text[0] == '\0' || (text[0] == '\n' && text[1] == '\0')) return;
-
-    // Strip trailing newline for cleaner UI display
-    std::string msg(text);
-    while (!msg.empty() && msg.back() == '\n') msg.pop_back();
-    if (msg.empty()) return;
-
-    // Forward to UI
-    ui_log("[llama] %s", msg.c_str());
+// Scheduler thread hook — stay attached to the JVM so logging doesn't attach/detach on every message
+static void jni_thread_hook(bool started) {
+    static thread_local bool attached = false;
+    if (started) {
+        JNIEnv * env = nullptr;
+        attached = g_jvm && g_jvm->AttachCurrentThread(&env, nullptr) == JNI_OK;
+    } else if (attached) {
+        g_jvm->DetachCurrentThread();
+        attached = false;
+    }
 }
 
-// Global inference state
-
-static llama_model                * g_model   = nullptr;
-static llama_context              * g_context = nullptr;
-static llama_adapter_lora         * g_adapter = nullptr;
-static bool                         g_backend_initialized = false;
-
 // Helper: convert jstring to std::string
 static std::string jstring_to_string(JNIEnv * env, jstring jstr) {
     if (!jstr) return "";
@@ -132,27 +74,46 @@ static std::string jstring_to_string(JNIEnv * env, jstring jstr) {
     return result;
 }
 
+// Helper: Copy parallel id/scale arrays (null = empty)
+static void jarrays_to_vectors(
+        JNIEnv * env,
+        jintArray jIds,
+        jfloatArray jScales,
+        std::vector<int32_t> & ids,
+        std::vector<float> & scales) {
+    jsize n_ids    = jIds    ? env->GetArrayLength(jIds)    : 0;
+    jsize n_scales = jScales ? env->GetArrayLength(jScales) : 0;
+    ids.resize((size_t) n_ids);
+    scales.resize((size_t) n_scales);
+    if (n_ids > 0)    env->GetIntArrayRegion(jIds, 0, n_ids, (jint *) ids.data());
+    if (n_scales > 0) env->GetFloatArrayRegion(jScales, 0, n_scales, scales.data());
+}
+
 // JNI: Register log callback
 
 extern "C" JNIEXPORT void JNICALL
 Java_com_dark_lora_LoraJNI_setLogCallback(
         JNIEnv * env, jobject /* this */,
         jobject callback) {
-    std::lock_guard<std::mutex> lock(g_log_mutex);
+    {
+        std::lock_guard<std::mutex> lock(g_log_mutex);
 
-    env->GetJavaVM(&g_jvm);
+        env->GetJavaVM(&g_jvm);
 
-    // Release old callback
-    if (g_log_callback) {
-        env->DeleteGlobalRef(g_log_callback);
-        g_log_callback = nullptr;
-    }
+        // Release old callback
+        if (g_log_callback) {
+            env->DeleteGlobalRef(g_log_callback);
+            g_log_callback = nullptr;
+        }
 
-    if (callback) {
-        g_log_callback = env->NewGlobalRef(callback);
-        jclass cls = env->GetObjectClass(callback);
-        g_on_log = env->GetMethodID(cls, "onLog", "(Ljava/lang/String;)V");
+        if (callback) {
+            g_log_callback = env->NewGlobalRef(callback);
+            jclass cls = env->GetObjectClass(callback);
+            g_on_log = env->GetMethodID(cls, "onLog", "(Ljava/lang/String;)V");
+        }
     }
+    ui_log_set_sink(jni_log_sink, nullptr);
+    engine_set_thread_hook(jni_thread_hook);
 }
 
 // JNI: Register stream callback
@@ -163,7 +124,10 @@ Java_com_dark_lora_LoraJNI_setStreamCallback(
         jobject callback) {
     std::lock_guard<std::mutex> lock(g_stream_mutex);
 
-    if (!g_jvm) env->GetJavaVM(&g_jvm);
+    if (!g_jvm) {
+        env->GetJavaVM(&g_jvm);
+        engine_set_thread_hook(jni_thread_hook);
+    }
 
     // Release old callback
     if (g_stream_callback) {
@@ -186,27 +150,7 @@ extern "C" JNIEXPORT jboolean JNICALL
 Java_com_dark_lora_LoraJNI_initLlamaBackend(
         JNIEnv * env, jobject /* this */,
         jstring jNativeLibDir) {
-    ui_log("Initializing llama.cpp backend...");
-
-    llama_log_set(log_callback, nullptr);
-
-    std::string native_lib_dir = jstring_to_string(env, jNativeLibDir);
-    ui_log("Loading backends from: %s", native_lib_dir.c_str());
-
-    // Set ADSP_LIBRARY_PATH so FastRPC can find HTP skel libraries (libggml-htp-vXX.so)
-    // Must be set BEFORE backend initialization
-    setenv("ADSP_LIBRARY_PATH", native_lib_dir.c_str(), 1);
-    ui_log("ADSP_LIBRARY_PATH set to: %s", native_lib_dir.c_str());
-
-    // Enable Hexagon experimental ops (flash attention on HTP)
-    setenv("GGML_HEXAGON_EXPERIMENTAL", "1", 1);
-
-    ggml_backend_load_all_from_path(native_lib_dir.c_str());
-    llama_backend_init();
-
-    g_backend_initialized = true;
-    ui_log("Backend initialized");
-    return JNI_TRUE;
+    return engine_init_backend(jstring_to_string(env, jNativeLibDir)) ? JNI_TRUE : JNI_FALSE;
 }
 
 // JNI: Load Model
@@ -218,103 +162,135 @@ Java_com_dark_lora_LoraJNI_loadModel(
         jint nThreads,
         jint nCtx,
         jint nGpuLayers) {
-    if (!g_backend_initialized) {
-        return env->NewStringUTF("ERROR: Backend not initialized");
-    }
+    std::string result = engine_load_model(jstring_to_string(env, jModelPath), nThreads, nCtx, nGpuLayers);
+    return env->NewStringUTF(result.c_str());
+}
 
-    // Free previous
-    if (g_context) { llama_free(g_context); g_context = nullptr; }
-    if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
+// JNI: Load LoRA adapter
+// Loads into the pool (reusing a resident copy) and makes it the only default adapter.
 
-    std::string model_path = jstring_to_string(env, jModelPath);
-    ui_log("Loading model: %s", model_path.c_str());
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_dark_lora_LoraJNI_loadLoraAdapter(
+        JNIEnv * env, jobject /* this */,
+        jstring jLoraPath) {
+    std::string result = engine_load_lora_adapter(jstring_to_string(env, jLoraPath));
+    return env->NewStringUTF(result.c_str());
+}
 
-    llama_model_params model_params = llama_model_default_params();
-    model_params.use_mmap = false; // Load into RAM — avoids mmap page-fault stalls on Android
+// JNI: Load LoRA adapter into the pool without activating it
+// Returns the pool ID, or -1 on failure.
 
-    // Offload layers to NPU (Hexagon HTP) if available
-    int n_gpu = (nGpuLayers >= 0) ? nGpuLayers : 99;
-    model_params.n_gpu_layers = n_gpu;
-    ui_log("use_mmap=false, n_gpu_layers=%d", n_gpu);
+extern "C" JNIEXPORT jint JNICALL
+Java_com_dark_lora_LoraJNI_loadAdapter(
+        JNIEnv * env, jobject /* this */,
+        jstring jLoraPath) {
+    return engine_load_adapter(jstring_to_string(env, jLoraPath));
+}
 
-    g_model = llama_model_load_from_file(model_path.c_str(), model_params);
-    if (!g_model) {
-        return env->NewStringUTF("ERROR: Failed to load model");
-    }
+// JNI: Free a pooled adapter
+// It's dropped from the default set and session routes; refused while a request uses it.
 
-    int n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
-    int n_threads_actual = (nThreads > 0) ? nThreads :
-        std::max(2, n_cpus - 2);
-    int n_ctx_actual = (nCtx > 0) ? nCtx : 2048;
-
-    ui_log("CPU cores: %d, using %d threads", n_cpus, n_threads_actual);
-    ui_log("Context size: %d", n_ctx_actual);
-
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx        = n_ctx_actual;
-    ctx_params.n_batch      = 512;
-    ctx_params.n_ubatch     = 256;
-    ctx_params.n_threads       = n_threads_actual;
-    ctx_params.n_threads_batch = n_threads_actual;
-    // Only enable flash attention when using HTP (reduces graph splits on NPU)
-    // For CPU-only, the standard attention path is faster
-    if (n_gpu > 0) {
-        ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
-    }
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_unloadAdapter(
+        JNIEnv * /* env */, jobject /* this */,
+        jint adapterId) {
+    engine_unload_adapter(adapterId);
+}
 
-    g_context = llama_init_from_model(g_model, ctx_params);
-    if (!g_context) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        return env->NewStringUTF("ERROR: Failed to create context");
-    }
+// JNI: Set the default adapter set — pooled adapters with individual scales (empty = base model)
 
-    char model_desc[256];
-    llama_model_desc(g_model, model_desc, sizeof(model_desc));
-    double model_size_gb = (double) llama_model_size(g_model) / 1024.0 / 1024.0 / 1024.0;
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_dark_lora_LoraJNI_setActiveAdapters(
+        JNIEnv * env, jobject /* this */,
+        jintArray jIds,
+        jfloatArray jScales) {
+    std::vector<int32_t> ids;
+    std::vector<float>   scales;
+    jarrays_to_vectors(env, jIds, jScales, ids, scales);
+    std::string result = engine_set_active_adapters(ids, scales);
+    return env->NewStringUTF(result.c_str());
+}
 
-    std::string result = "Model loaded: " + std::string(model_desc);
-    result += " (" + std::to_string(model_size_gb).substr(0, 4) + " GB)";
-    result += "\nThreads: " + std::to_string(n_threads_actual);
-    result += " | Context: " + std::to_string(n_ctx_actual);
+// JNI: Set the adapter pool memory budget
 
-    ui_log("Model: %s (%.2f GB)", model_desc, model_size_gb);
-    return env->NewStringUTF(result.c_str());
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_setAdapterBudget(
+        JNIEnv * /* env */, jobject /* this */,
+        jlong maxBytes) {
+    engine_set_adapter_budget(maxBytes);
 }
 
-// JNI: Load LoRA adapter
+// JNI: Load draft model for speculative decoding
 
 extern "C" JNIEXPORT jstring JNICALL
-Java_com_dark_lora_LoraJNI_loadLoraAdapter(
+Java_com_dark_lora_LoraJNI_loadDraftModel(
         JNIEnv * env, jobject /* this */,
-        jstring jLoraPath) {
-    if (!g_model || !g_context) {
-        return env->NewStringUTF("ERROR: Model not loaded");
-    }
+        jstring jDraftPath,
+        jint nDraft) {
+    std::string result = engine_load_draft_model(jstring_to_string(env, jDraftPath), nDraft);
+    return env->NewStringUTF(result.c_str());
+}
 
-    if (g_adapter) {
-        llama_rm_adapter_lora(g_context, g_adapter);
-        llama_adapter_lora_free(g_adapter);
-        g_adapter = nullptr;
-    }
+// JNI: Remove draft model (back to plain decoding)
 
-    std::string lora_path = jstring_to_string(env, jLoraPath);
-    ui_log("Loading LoRA adapter from: %s", lora_path.c_str());
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_removeDraftModel(
+        JNIEnv * /* env */, jobject /* this */) {
+    engine_remove_draft_model();
+}
 
-    g_adapter = llama_adapter_lora_init(g_model, lora_path.c_str());
-    if (!g_adapter) {
-        return env->NewStringUTF("ERROR: Failed to load LoRA adapter");
-    }
+// JNI: Enable/disable prompt lookup decoding
 
-    int32_t ret = llama_set_adapter_lora(g_context, g_adapter, 1.0f);
-    if (ret != 0) {
-        llama_adapter_lora_free(g_adapter);
-        g_adapter = nullptr;
-        return env->NewStringUTF("ERROR: Failed to apply LoRA adapter");
-    }
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_setLookupDecoding(
+        JNIEnv * /* env */, jobject /* this */,
+        jboolean enabled,
+        jint nDraft) {
+    engine_set_lookup_decoding(enabled, nDraft);
+}
+
+// JNI: Configure the on-disk prompt state cache
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_setPromptCache(
+        JNIEnv * env, jobject /* this */,
+        jstring jCacheDir,
+        jlong maxBytes) {
+    engine_set_prompt_cache(jstring_to_string(env, jCacheDir), maxBytes);
+}
 
-    ui_log("LoRA adapter loaded and applied");
-    return env->NewStringUTF(("LoRA loaded from: " + lora_path).c_str());
+// Helper: Forward lora_merge progress to the UI log
+static void merge_log_callback(const char * msg, void * /* user_data */) {
+    ui_log("%s", msg);
+}
+
+// JNI: Merge a LoRA adapter into a base GGUF (offline, file to file)
+// Doesn't touch the loaded model; the merged file can be loaded with loadModel afterwards.
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_dark_lora_LoraJNI_mergeLoraAdapter(
+        JNIEnv * env, jobject /* this */,
+        jstring jBasePath,
+        jstring jAdapterPath,
+        jstring jOutputPath,
+        jfloat scale,
+        jint nThreads) {
+    lora_merge_params params;
+    params.base_path    = jstring_to_string(env, jBasePath);
+    params.adapter_path = jstring_to_string(env, jAdapterPath);
+    params.output_path  = jstring_to_string(env, jOutputPath);
+    params.scale        = scale;
+    params.n_threads    = nThreads;
+    params.log          = merge_log_callback;
+
+    ui_log("Merging %s into %s", params.adapter_path.c_str(), params.base_path.c_str());
+
+    std::string error;
+    if (!lora_merge(params, &error)) {
+        ui_log("Merge failed: %s", error.c_str());
+        return env->NewStringUTF(("ERROR: " + error).c_str());
+    }
+    return env->NewStringUTF(("Merged model saved to: " + params.output_path).c_str());
 }
 
 // JNI: Apply model's chat template to messages
@@ -326,49 +302,92 @@ Java_com_dark_lora_LoraJNI_applyChatTemplate(
         jobjectArray jRoles,
         jobjectArray jContents,
         jboolean addAssistant) {
-    if (!g_model) {
-        return env->NewStringUTF("");
-    }
-
     int n_msg = env->GetArrayLength(jRoles);
 
-    // Build llama_chat_message array
     std::vector<std::string> roles(n_msg), contents(n_msg);
-    std::vector<llama_chat_message> messages(n_msg);
-
     for (int i = 0; i < n_msg; i++) {
         auto jr = (jstring) env->GetObjectArrayElement(jRoles, i);
         auto jc = (jstring) env->GetObjectArrayElement(jContents, i);
         roles[i] = jstring_to_string(env, jr);
         contents[i] = jstring_to_string(env, jc);
-        messages[i].role = roles[i].c_str();
-        messages[i].content = contents[i].c_str();
         env->DeleteLocalRef(jr);
         env->DeleteLocalRef(jc);
     }
 
-    // Get model's chat template
-    const char * tmpl = llama_model_chat_template(g_model, nullptr);
+    // "" when there's no usable template — Kotlin side falls back to its own
+    std::string result = engine_apply_chat_template(roles, contents, addAssistant);
+    return env->NewStringUTF(result.c_str());
+}
+
 
-    // First call to get required size
-    int32_t needed = llama_chat_apply_template(
-        tmpl, messages.data(), (size_t) n_msg, (bool) addAssistant, nullptr, 0);
+// Streaming target — the Kotlin StreamCallback a generation reports to.
+// generateStreaming uses the registered global callback; session calls pass their own.
+
+struct stream_target {
+    JNIEnv  * env         = nullptr;
+    jobject   callback    = nullptr;
+    jmethodID on_token    = nullptr;
+    jmethodID on_complete = nullptr;
+    jmethodID on_error    = nullptr;
+};
+
+// Helper: Resolve StreamCallback method IDs for a callback object
+static stream_target make_stream_target(JNIEnv * env, jobject callback) {
+    stream_target target;
+    target.env = env;
+    if (!callback) return target;
+    jclass cls = env->GetObjectClass(callback);
+    target.callback    = callback;
+    target.on_token    = env->GetMethodID(cls, "onToken", "(Ljava/lang/String;)V");
+    target.on_complete = env->GetMethodID(cls, "onComplete", "()V");
+    target.on_error    = env->GetMethodID(cls, "onError", "(Ljava/lang/String;)V");
+    env->DeleteLocalRef(cls);
+    return target;
+}
 
-    if (needed <= 0) {
-        // Fallback: return empty string, Kotlin side can use its own template
-        return env->NewStringUTF("");
+// Helper: Send error to stream callback (for early returns)
+static void stream_error(const stream_target & target, const std::string & error_msg) {
+    if (!target.callback || !target.on_error) return;
+    // Sanitize in case error message contains truncated UTF-8
+    std::string safe_msg(error_msg);
+    utf8_sanitize(&safe_msg[0]);
+    jstring jerror = target.env->NewStringUTF(safe_msg.c_str());
+    target.env->CallVoidMethod(target.callback, target.on_error, jerror);
+    target.env->DeleteLocalRef(jerror);
+}
+
+// Helper: Send a text chunk to stream callback (engine_text_fn, runs on the calling thread)
+static void stream_text(const std::string & text, void * user_data) {
+    const stream_target & target = *(const stream_target *) user_data;
+    if (!target.callback || !target.on_token) return;
+    jstring jtoken = target.env->NewStringUTF(text.c_str());
+    if (jtoken) {
+        target.env->CallVoidMethod(target.callback, target.on_token, jtoken);
+        target.env->DeleteLocalRef(jtoken);
     }
+}
 
-    // Allocate and format
-    std::vector<char> buf(needed + 1);
-    llama_chat_apply_template(
-        tmpl, messages.data(), (size_t) n_msg, (bool) addAssistant, buf.data(), (int32_t) buf.size());
-    buf[needed] = '\0';
+// Helper: Streaming generation on one session's sequence
+static void stream_generate(
+        int32_t session_id,
+        const stream_target & target,
+        const std::string & prompt,
+        int maxTokens,
+        float temperature) {
+    std::string error;
+    if (!engine_generate_session(session_id, prompt, maxTokens, temperature,
+                                 stream_text, (void *) &target, &error)) {
+        stream_error(target, error);
+        return;
+    }
 
-    return env->NewStringUTF(buf.data());
+    if (target.callback && target.on_complete) {
+        target.env->CallVoidMethod(target.callback, target.on_complete);
+    }
 }
 
 // JNI: Generate text (inference)
+// Runs on a temporary session so it can be batched with other requests.
 
 extern "C" JNIEXPORT jstring JNICALL
 Java_com_dark_lora_LoraJNI_generate(
@@ -376,140 +395,10 @@ Java_com_dark_lora_LoraJNI_generate(
         jstring jPrompt,
         jint maxTokens,
         jfloat temperature) {
-    if (!g_model || !g_context) {
-        return env->NewStringUTF("ERROR: Model not loaded");
-    }
-
-    std::string prompt = jstring_to_string(env, jPrompt);
-    ui_log("Generating: prompt=%zu chars, max_tokens=%d, temp=%.2f",
-           prompt.length(), maxTokens, (double) temperature);
-
-    // Clear KV cache for fresh generation
-    llama_memory_clear(llama_get_memory(g_context), true);
-
-    // Tokenize prompt (parse_special=true so <|im_start|> etc. become single special tokens)
-    std::vector<llama_token> tokens = common_tokenize(g_context, prompt, true, true);
-    ui_log("Prompt tokens: %zu", tokens.size());
-
-    if (tokens.empty()) {
-        return env->NewStringUTF("ERROR: Empty prompt after tokenization");
-    }
-
-    int n_ctx = llama_n_ctx(g_context);
-    if ((int) tokens.size() >= n_ctx) {
-        return env->NewStringUTF("ERROR: Prompt too long for context");
-    }
-
-    // Create sampler
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
-    if (temperature <= 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
-    } else {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-        llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
-    }
-
-    // Process prompt
-    llama_batch batch = llama_batch_get_one(tokens.data(), (int32_t) tokens.size());
-    if (llama_decode(g_context, batch) != 0) {
-        llama_sampler_free(smpl);
-        return env->NewStringUTF("ERROR: Failed to decode prompt");
-    }
-
-    // Stop strings for text-based detection (catches multi-token BPE sequences)
-    const char * stop_strs[] = {
-        "<|im_end|>", "<|im_start|>",           // ChatML
-        "<|eot_id|>", "<|start_header_id|>",    // Llama 3
-        "<end_of_turn>", "<start_of_turn>",      // Gemma
-        "<|end|>", "<|user|>", "<|assistant|>",  // Phi
-        nullptr
-    };
-
-    // Generate tokens
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
-    std::string result;
-    int n_generated = 0;
-    int max_gen = (maxTokens > 0) ? maxTokens : 128;
-
-    auto t_start = std::chrono::steady_clock::now();
-
-    for (int i = 0; i < max_gen; i++) {
-        llama_token new_token = llama_sampler_sample(smpl, g_context, -1);
-
-        if (llama_vocab_is_eog(vocab, new_token)) {
-            ui_log("EOG at token %d", i + 1);
-            break;
-        }
-
-        // Convert token to text (special=false: don't render control tokens)
-        char piece[256];
-        int n = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, false);
-        if (n > 0) {
-            result.append(piece, n);
-        }
-
-        // Text-based stop sequence detection
-        bool is_stop = false;
-        for (int s = 0; stop_strs[s]; s++) {
-            size_t stop_len = strlen(stop_strs[s]);
-            if (result.size() >= stop_len &&
-                result.compare(result.size() - stop_len, stop_len, stop_strs[s]) == 0) {
-                result.resize(result.size() - stop_len);
-                ui_log("Stop string '%s' at token %d", stop_strs[s], i + 1);
-                is_stop = true;
-                break;
-            }
-        }
-        if (is_stop) break;
-
-        // Decode single token
-        batch = llama_batch_get_one(&new_token, 1);
-        if (llama_decode(g_context, batch) != 0) {
-            ui_log("Decode failed at token %d", i + 1);
-            break;
-        }
-        n_generated++;
-    }
-
-    llama_sampler_free(smpl);
-
-    auto t_end = std::chrono::steady_clock::now();
-    double elapsed = std::chrono::duration<double>(t_end - t_start).count();
-    ui_log("Generated %d tokens in %.2fs (%.1f tok/s)", n_generated, elapsed,
-           elapsed > 0 ? n_generated / elapsed : 0.0);
-
+    std::string result = engine_generate(jstring_to_string(env, jPrompt), maxTokens, temperature);
     return env->NewStringUTF(result.c_str());
 }
 
-// Helper: Send error to stream callback (thread-safe, for early returns)
-
-static void stream_error(const char * error_msg) {
-    std::lock_guard<std::mutex> lock(g_stream_mutex);
-    if (!g_jvm || !g_stream_callback || !g_on_error) return;
-
-    JNIEnv * env = nullptr;
-    bool attached = false;
-    int status = g_jvm->GetEnv((void **)&env, JNI_VERSION_1_6);
-    if (status == JNI_EDETACHED) {
-        g_jvm->AttachCurrentThread(&env, nullptr);
-        attached = true;
-    }
-    if (env) {
-        // Sanitize in case error message contains truncated UTF-8
-        std::string safe_msg(error_msg);
-        utf8_sanitize(&safe_msg[0]);
-        jstring jerror = env->NewStringUTF(safe_msg.c_str());
-        env->CallVoidMethod(g_stream_callback, g_on_error, jerror);
-        env->DeleteLocalRef(jerror);
-    }
-    if (attached) {
-        g_jvm->DetachCurrentThread();
-    }
-}
-
 // JNI: Generate text (streaming)
 
 extern "C" JNIEXPORT void JNICALL
@@ -518,208 +407,90 @@ Java_com_dark_lora_LoraJNI_generateStreaming(
         jstring jPrompt,
         jint maxTokens,
         jfloat temperature) {
-    if (!g_model || !g_context) {
-        stream_error("ERROR: Model not loaded");
-        return;
+    stream_target target;
+    target.env = env;
+    {
+        std::lock_guard<std::mutex> lock(g_stream_mutex);
+        target.callback    = g_stream_callback;
+        target.on_token    = g_on_token;
+        target.on_complete = g_on_complete;
+        target.on_error    = g_on_error;
     }
 
     std::string prompt = jstring_to_string(env, jPrompt);
     ui_log("Streaming generation: prompt=%zu chars, max_tokens=%d, temp=%.2f",
            prompt.length(), maxTokens, (double) temperature);
 
-    // Clear KV cache for fresh generation
-    llama_memory_clear(llama_get_memory(g_context), true);
-
-    // Tokenize prompt (parse_special=true so <|im_start|> etc. become single special tokens)
-    std::vector<llama_token> tokens = common_tokenize(g_context, prompt, true, true);
-    ui_log("Prompt tokens: %zu", tokens.size());
+    stream_generate(ENGINE_DEFAULT_SESSION, target, prompt, maxTokens, temperature);
+}
 
-    if (tokens.empty()) {
-        stream_error("ERROR: Empty prompt after tokenization");
-        return;
-    }
+// JNI: Create inference session
+// Returns a session handle backed by its own llama sequence, or -1 if all sequences are in use.
 
-    int n_ctx = llama_n_ctx(g_context);
-    if ((int) tokens.size() >= n_ctx) {
-        stream_error("ERROR: Prompt too long for context");
-        return;
-    }
+extern "C" JNIEXPORT jint JNICALL
+Java_com_dark_lora_LoraJNI_createSession(
+        JNIEnv * /* env */, jobject /* this */) {
+    return engine_create_session();
+}
 
-    // Create sampler
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
-    if (temperature <= 0.0f) {
-        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
-    } else {
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
-        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-        llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
-    }
+// JNI: Destroy inference session (frees its KV cells)
 
-    // Batched prefill — process prompt in n_batch chunks, logits only on last token
-    auto t_prefill_start = std::chrono::steady_clock::now();
-    {
-        const int n_batch_size = llama_n_batch(g_context);
-        llama_batch batch = llama_batch_init(n_batch_size, 0, 1);
-        size_t idx = 0;
-        int32_t pos = 0;
-
-        while (idx < tokens.size()) {
-            const int32_t take = std::min<int32_t>(
-                n_batch_size, (int32_t)(tokens.size() - idx));
-
-            batch.n_tokens = take;
-            for (int i = 0; i < take; ++i) {
-                batch.token[i]     = tokens[idx + i];
-                batch.pos[i]       = pos + i;
-                batch.n_seq_id[i]  = 1;
-                batch.seq_id[i][0] = 0;
-                batch.logits[i]    = (idx + (size_t)i + 1 == tokens.size());
-            }
-
-            if (llama_decode(g_context, batch) != 0) {
-                llama_batch_free(batch);
-                llama_sampler_free(smpl);
-                stream_error("ERROR: Failed to decode prompt");
-                return;
-            }
-
-            pos += take;
-            idx += (size_t)take;
-        }
-        llama_batch_free(batch);
-    }
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_destroySession(
+        JNIEnv * /* env */, jobject /* this */,
+        jint sessionId) {
+    engine_destroy_session(sessionId);
+}
 
-    auto t_prefill_end = std::chrono::steady_clock::now();
-    double prefill_s = std::chrono::duration<double>(t_prefill_end - t_prefill_start).count();
-    ui_log("Prefill done: %zu tokens in %.2fs (%.1f tok/s)", tokens.size(), prefill_s,
-           prefill_s > 0 ? tokens.size() / prefill_s : 0.0);
-
-    // Stop strings for text-based detection (catches multi-token BPE sequences)
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
-    const char * stop_strs[] = {
-        "<|im_end|>", "<|im_start|>",           // ChatML
-        "<|eot_id|>", "<|start_header_id|>",    // Llama 3
-        "<end_of_turn>", "<start_of_turn>",      // Gemma
-        "<|end|>", "<|user|>", "<|assistant|>",  // Phi
-        nullptr
-    };
-
-    // Generate tokens — stream directly via env (no mutex / GetEnv overhead)
-    std::string accumulated;  // Full generated text for stop detection
-    int n_generated = 0;
-    int max_gen = (maxTokens > 0) ? maxTokens : 128;
-    int n_streamed_chars = 0;  // Characters already sent to UI
-
-    auto t_gen_start = std::chrono::steady_clock::now();
-
-    for (int i = 0; i < max_gen; i++) {
-        llama_token new_token = llama_sampler_sample(smpl, g_context, -1);
-
-        // Check EOG (single-token stop — catches proper special tokens)
-        if (llama_vocab_is_eog(vocab, new_token)) {
-            ui_log("EOG at token %d", i + 1);
-            break;
-        }
+// JNI: Generate text (streaming) on a session
+// The session keeps its KV state between calls, so switching conversations doesn't re-prefill.
+// Calls on different sessions from different threads are batched together by the scheduler.
 
-        // Convert token to text (special=false: don't render control tokens)
-        char piece[256];
-        int n = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, false);
-        if (n > 0) {
-            accumulated.append(piece, n);
-        }
+extern "C" JNIEXPORT void JNICALL
+Java_com_dark_lora_LoraJNI_generateSessionStreaming(
+        JNIEnv * env, jobject /* this */,
+        jint sessionId,
+        jstring jPrompt,
+        jint maxTokens,
+        jfloat temperature,
+        jobject callback) {
+    stream_target target = make_stream_target(env, callback);
 
-        // Text-based stop sequence detection (catches multi-token BPE sequences)
-        bool is_stop = false;
-        for (int s = 0; stop_strs[s]; s++) {
-            size_t stop_len = strlen(stop_strs[s]);
-            if (accumulated.size() >= stop_len &&
-                accumulated.compare(accumulated.size() - stop_len, stop_len, stop_strs[s]) == 0) {
-                accumulated.resize(accumulated.size() - stop_len);
-                ui_log("Stop string '%s' at token %d", stop_strs[s], i + 1);
-                is_stop = true;
-                break;
-            }
-        }
-        if (is_stop) {
-            // Flush any remaining un-streamed text before the stop string
-            if ((int) accumulated.size() > n_streamed_chars) {
-                std::string remaining = accumulated.substr(n_streamed_chars);
-                int safe_len = utf8_complete_len(remaining.c_str(), (int) remaining.size());
-                if (safe_len > 0) {
-                    jstring jtoken = env->NewStringUTF(remaining.substr(0, safe_len).c_str());
-                    if (jtoken) {
-                        env->CallVoidMethod(g_stream_callback, g_on_token, jtoken);
-                        env->DeleteLocalRef(jtoken);
-                    }
-                }
-            }
-            break;
-        }
+    std::string prompt = jstring_to_string(env, jPrompt);
+    ui_log("Streaming generation (session %d): prompt=%zu chars, max_tokens=%d, temp=%.2f",
+           sessionId, prompt.length(), maxTokens, (double) temperature);
 
-        // Stream new characters to Kotlin (only the delta since last stream)
-        if ((int) accumulated.size() > n_streamed_chars) {
-            // Hold back characters that could be the start of a stop string
-            int max_stop_len = 0;
-            for (int s = 0; stop_strs[s]; s++) {
-                int slen = (int) strlen(stop_strs[s]);
-                if (slen > max_stop_len) max_stop_len = slen;
-            }
-
-            int safe_end = (int) accumulated.size() - max_stop_len;
-            if (safe_end > n_streamed_chars) {
-                // Ensure we don't split a multi-byte UTF-8 character
-                int chunk_len = safe_end - n_streamed_chars;
-                int safe_len = utf8_complete_len(accumulated.c_str() + n_streamed_chars, chunk_len);
-                if (safe_len > 0) {
-                    std::string chunk = accumulated.substr(n_streamed_chars, safe_len);
-                    jstring jtoken = env->NewStringUTF(chunk.c_str());
-                    if (jtoken) {
-                        env->CallVoidMethod(g_stream_callback, g_on_token, jtoken);
-                        env->DeleteLocalRef(jtoken);
-                    }
-                    n_streamed_chars += safe_len;
-                }
-            }
-        }
+    stream_generate(sessionId, target, prompt, maxTokens, temperature);
+}
 
-        // Decode single token
-        llama_batch gen_batch = llama_batch_get_one(&new_token, 1);
-        if (llama_decode(g_context, gen_batch) != 0) {
-            ui_log("Decode failed at token %d", i + 1);
-            jstring jerr = env->NewStringUTF("Decode failed");
-            if (jerr) {
-                env->CallVoidMethod(g_stream_callback, g_on_error, jerr);
-                env->DeleteLocalRef(jerr);
-            }
-            llama_sampler_free(smpl);
-            return;
-        }
-        n_generated++;
-    }
+// JNI: Route a session to its own adapter set
+// ids = null clears the route (the session follows setActiveAdapters again).
 
-    // Flush any remaining buffered text
-    if ((int) accumulated.size() > n_streamed_chars) {
-        std::string remaining = accumulated.substr(n_streamed_chars);
-        int safe_len = utf8_complete_len(remaining.c_str(), (int) remaining.size());
-        if (safe_len > 0) {
-            jstring jtoken = env->NewStringUTF(remaining.substr(0, safe_len).c_str());
-            if (jtoken) {
-                env->CallVoidMethod(g_stream_callback, g_on_token, jtoken);
-                env->DeleteLocalRef(jtoken);
-            }
-        }
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_dark_lora_LoraJNI_setSessionAdapters(
+        JNIEnv * env, jobject /* this */,
+        jint sessionId,
+        jintArray jIds,
+        jfloatArray jScales) {
+    std::string result;
+    if (!jIds) {
+        result = engine_set_session_adapters(sessionId, nullptr, nullptr);
+    } else {
+        std::vector<int32_t> ids;
+        std::vector<float>   scales;
+        jarrays_to_vectors(env, jIds, jScales, ids, scales);
+        result = engine_set_session_adapters(sessionId, &ids, &scales);
     }
+    return env->NewStringUTF(result.c_str());
+}
 
-    llama_sampler_free(smpl);
-
-    auto t_gen_end = std::chrono::steady_clock::now();
-    double gen_s = std::chrono::duration<double>(t_gen_end - t_gen_start).count();
-    ui_log("Streamed %d tokens in %.2fs (%.1f tok/s)", n_generated, gen_s,
-           gen_s > 0 ? n_generated / gen_s : 0.0);
+// JNI: Scheduler statistics as JSON
 
-    env->CallVoidMethod(g_stream_callback, g_on_complete);
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_dark_lora_LoraJNI_getSchedulerStats(
+        JNIEnv * env, jobject /* this */,
+        jboolean reset) {
+    return env->NewStringUTF(engine_scheduler_stats(reset).c_str());
 }
 
 // JNI: Remove LoRA adapter
@@ -727,12 +498,7 @@ Java_com_dark_lora_LoraJNI_generateStreaming(
 extern "C" JNIEXPORT void JNICALL
 Java_com_dark_lora_LoraJNI_removeLoraAdapter(
         JNIEnv * /* env */, jobject /* this */) {
-    if (g_adapter && g_context) {
-        llama_rm_adapter_lora(g_context, g_adapter);
-        llama_adapter_lora_free(g_adapter);
-        g_adapter = nullptr;
-        ui_log("LoRA adapter removed");
-    }
+    engine_remove_lora_adapter();
 }
 
 // JNI: Check if adapter is loaded
@@ -740,7 +506,7 @@ Java_com_dark_lora_LoraJNI_removeLoraAdapter(
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_dark_lora_LoraJNI_hasAdapter(
         JNIEnv * /* env */, jobject /* this */) {
-    return g_adapter != nullptr ? JNI_TRUE : JNI_FALSE;
+    return engine_has_adapter() ? JNI_TRUE : JNI_FALSE;
 }
 
 // JNI: Check if model is loaded
@@ -748,7 +514,7 @@ Java_com_dark_lora_LoraJNI_hasAdapter(
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_dark_lora_LoraJNI_hasModel(
         JNIEnv * /* env */, jobject /* this */) {
-    return (g_model != nullptr && g_context != nullptr) ? JNI_TRUE : JNI_FALSE;
+    return engine_has_model() ? JNI_TRUE : JNI_FALSE;
 }
 
 // JNI: Cleanup
@@ -756,15 +522,10 @@ Java_com_dark_lora_LoraJNI_hasModel(
 extern "C" JNIEXPORT void JNICALL
 Java_com_dark_lora_LoraJNI_cleanupLlama(
         JNIEnv * env, jobject /* this */) {
-    ui_log("Cleaning up...");
-
-    if (g_adapter && g_context) { llama_rm_adapter_lora(g_context, g_adapter); }
-    if (g_adapter) { llama_adapter_lora_free(g_adapter); g_adapter = nullptr; }
-    if (g_context) { llama_free(g_context); g_context = nullptr; }
-    if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
-    if (g_backend_initialized) { llama_backend_free(); g_backend_initialized = false; }
+    engine_cleanup();
 
     // Release callbacks
+    ui_log_set_sink(nullptr, nullptr);
     {
         std::lock_guard<std::mutex> lock(g_log_mutex);
         if (g_log_callback && env) {
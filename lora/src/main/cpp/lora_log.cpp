@@ -0,0 +1,94 @@
+#include "lora_log.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+#include <mutex>
+
+#include "llama.h"
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOG_TAG "LORA"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGI(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#endif
+
+static ui_log_sink_fn g_log_sink      = nullptr;
+static void         * g_log_sink_user = nullptr;
+static std::mutex     g_log_mutex;
+
+int utf8_complete_len(const char * buf, int len) {
+    if (len <= 0) return 0;
+    int i = len - 1;
+    while (i >= 0 && ((unsigned char)buf[i] & 0xC0) == 0x80) i--;
+    if (i < 0) return 0;
+    unsigned char lead = (unsigned char)buf[i];
+    int expected;
+    if ((lead & 0x80) == 0)         expected = 1;
+    else if ((lead & 0xE0) == 0xC0) expected = 2;
+    else if ((lead & 0xF0) == 0xE0) expected = 3;
+    else if ((lead & 0xF8) == 0xF0) expected = 4;
+    else return i;
+    if ((len - i) >= expected) return len;
+    return i;
+}
+
+void utf8_sanitize(char * buf) {
+    unsigned char * p = (unsigned char *)buf;
+    while (*p) {
+        if (*p < 0x80) { p++; continue; } // ASCII
+        int expected;
+        if ((*p & 0xE0) == 0xC0)      expected = 2;
+        else if ((*p & 0xF0) == 0xE0) expected = 3;
+        else if ((*p & 0xF8) == 0xF0) expected = 4;
+        else { *p = '?'; p++; continue; } // invalid lead byte
+        // Check continuation bytes
+        bool valid = true;
+        for (int j = 1; j < expected; j++) {
+            if ((p[j] & 0xC0) != 0x80) { valid = false; break; }
+        }
+        if (valid) { p += expected; }
+        else { *p = '?'; p++; } // replace bad lead, re-scan from next byte
+    }
+}
+
+void ui_log(const char * fmt, ...) {
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    // Always log to logcat / stderr
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    LOGI("%s", buf);
+
+    if (g_log_sink) {
+        g_log_sink(buf, g_log_sink_user);
+    }
+}
+
+void ui_log_set_sink(ui_log_sink_fn sink, void * user_data) {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    g_log_sink      = sink;
+    g_log_sink_user = user_data;
+}
+
+// llama.cpp log callback — forwards ALL messages to ui_log
+static void log_callback(enum ggml_log_level /* level */, const char * text, void * /* user_data */) {
+    // Skip empty/whitespace-only messages
+    if (!text || text[0] == '\0' || (text[0] == '\n' && text[1] == '\0')) return;
+
+    // Strip trailing newline for cleaner UI display
+    std::string msg(text);
+    while (!msg.empty() && msg.back() == '\n') msg.pop_back();
+    if (msg.empty()) return;
+
+    ui_log("[llama] %s", msg.c_str());
+}
+
+void ui_log_attach_llama() {
+    llama_log_set(log_callback, nullptr);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Logging shared by the native core (lora_engine, lora_train_engine) and its front ends.
+// Messages always go to logcat on Android and stderr elsewhere; a front end can add a
+// sink on top (the JNI shims forward to the Kotlin LogCallback, the CLI doesn't need one).
+
+typedef void (*ui_log_sink_fn)(const char * msg, void * user_data);
+
+// printf-style log line (thread-safe, truncated to 1 KB)
+void ui_log(const char * fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Install (or clear with nullptr) the extra sink every ui_log message is forwarded to
+void ui_log_set_sink(ui_log_sink_fn sink, void * user_data);
+
+// Route llama.cpp / ggml logging through ui_log with a "[llama] " prefix
+void ui_log_attach_llama();
+
+// Length of buf[0..len) without a trailing incomplete UTF-8 sequence (for streaming tokens)
+int  utf8_complete_len(const char * buf, int len);
+
+// Replace invalid/incomplete UTF-8 sequences in-place with '?' (for JNI NewStringUTF)
+void utf8_sanitize(char * buf);
@@ -0,0 +1,358 @@
+#include "lora_merge.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "ggml.h"
+#include "gguf.h"
+
+#define MERGE_CHUNK_ROWS 16   // Rows dequantized/requantized per work item
+
+// Helper: printf-style progress message to the caller's log callback
+static void merge_log(const lora_merge_params & params, const char * fmt, ...) {
+    if (!params.log) return;
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    params.log(buf, params.log_user);
+}
+
+// Helper: Convert a (small) adapter tensor to f32
+static bool tensor_to_f32(const ggml_tensor * t, std::vector<float> & out) {
+    const int64_t n = ggml_nelements(t);
+    out.resize((size_t) n);
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(out.data(), t->data, (size_t) n * sizeof(float));
+        return true;
+    }
+    const ggml_type_traits * traits = ggml_get_type_traits(t->type);
+    if (!traits->to_float) return false;
+    traits->to_float(t->data, out.data(), n);
+    return true;
+}
+
+// Helper: Dequantize rows of a base tensor into f32
+static void rows_to_f32(ggml_type type, const uint8_t * src, float * dst, int64_t n_rows, int64_t n_per_row) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, (size_t) (n_rows * n_per_row) * sizeof(float));
+        return;
+    }
+    ggml_get_type_traits(type)->to_float(src, dst, n_rows * n_per_row);
+}
+
+// One adapted projection: W[o][i] += s * sum_k left[o][k] * right[k][i]
+struct merge_delta {
+    std::vector<float> left;    // [n_out][rank]
+    std::vector<float> right;   // [rank][n_in]
+    int64_t            rank  = 0;
+    float              scale = 0.0f;
+};
+
+// Helper: Build the delta factors for a base tensor from its lora_a / lora_b pair.
+// Layout follows llama.cpp adapters: lora_a ne = [n_in, r], lora_b ne = [r, n_out].
+// token_embd is the exception (applied to get_rows output): lora_a ne = [r, n_vocab],
+// lora_b ne = [r, n_embd].
+static bool build_delta(const ggml_tensor * w, const ggml_tensor * a, const ggml_tensor * b,
+                        bool is_token_embd, float scale, float alpha, merge_delta & delta, std::string * error) {
+    std::vector<float> fa, fb;
+    if (!tensor_to_f32(a, fa) || !tensor_to_f32(b, fb)) {
+        *error = std::string("unsupported adapter tensor type for ") + w->name;
+        return false;
+    }
+
+    const int64_t n_in  = w->ne[0];
+    const int64_t n_out = w->ne[1];
+    if (is_token_embd) {
+        const int64_t r = a->ne[0];
+        if (b->ne[0] != r || a->ne[1] != n_out || b->ne[1] != n_in) {
+            *error = std::string("adapter shape mismatch for ") + w->name;
+            return false;
+        }
+        // left = A as [n_vocab][r]; right = B transposed to [r][n_embd]
+        delta.rank = r;
+        delta.left = std::move(fa);
+        delta.right.resize((size_t) (r * n_in));
+        for (int64_t i = 0; i < n_in; i++) {
+            for (int64_t k = 0; k < r; k++) {
+                delta.right[(size_t) (k * n_in + i)] = fb[(size_t) (i * r + k)];
+            }
+        }
+    } else {
+        const int64_t r = a->ne[1];
+        if (a->ne[0] != n_in || b->ne[0] != r || b->ne[1] != n_out) {
+            *error = std::string("adapter shape mismatch for ") + w->name;
+            return false;
+        }
+        // left = B as [n_out][r]; right = A as [r][n_in]
+        delta.rank  = r;
+        delta.left  = std::move(fb);
+        delta.right = std::move(fa);
+    }
+
+    // Same scaling as llama.cpp: alpha == 0 means no alpha/rank factor
+    delta.scale = alpha != 0.0f ? scale * alpha / (float) delta.rank : scale;
+    return true;
+}
+
+// Helper: Merge the delta into rows [row0, row1) of a base tensor in place.
+// Each row is dequantized, updated and re-quantized to the same type and size.
+static void merge_rows(const ggml_tensor * w, uint8_t * data, const merge_delta & delta,
+                       int64_t row0, int64_t row1, std::vector<float> & scratch) {
+    const int64_t n_in     = w->ne[0];
+    const size_t  row_size = ggml_row_size(w->type, n_in);
+
+    for (int64_t r0 = row0; r0 < row1; r0 += MERGE_CHUNK_ROWS) {
+        const int64_t n_rows = std::min<int64_t>(MERGE_CHUNK_ROWS, row1 - r0);
+        scratch.resize((size_t) (n_rows * n_in));
+        uint8_t * rows = data + (size_t) r0 * row_size;
+
+        rows_to_f32(w->type, rows, scratch.data(), n_rows, n_in);
+
+        for (int64_t o = 0; o < n_rows; o++) {
+            float * dst = scratch.data() + o * n_in;
+            const float * left = delta.left.data() + (r0 + o) * delta.rank;
+            for (int64_t k = 0; k < delta.rank; k++) {
+                const float c = delta.scale * left[k];
+                if (c == 0.0f) continue;
+                const float * right = delta.right.data() + k * n_in;
+                for (int64_t i = 0; i < n_in; i++) {
+                    dst[i] += c * right[i];
+                }
+            }
+        }
+
+        ggml_quantize_chunk(w->type, scratch.data(), rows, 0, n_rows, n_in, nullptr);
+    }
+}
+
+// Helper: Read a base tensor's data from the GGUF file
+static bool read_tensor_data(FILE * f, size_t offset, uint8_t * dst, size_t size) {
+    if (fseeko(f, (off_t) offset, SEEK_SET) != 0) return false;
+    return fread(dst, 1, size, f) == size;
+}
+
+// Helper: Write zero padding up to the next multiple of align
+static bool write_padding(FILE * f, size_t size, size_t align) {
+    static const uint8_t zeros[64] = {};
+    size_t pad = (align - (size % align)) % align;
+    while (pad > 0) {
+        size_t n = std::min(pad, sizeof(zeros));
+        if (fwrite(zeros, 1, n, f) != n) return false;
+        pad -= n;
+    }
+    return true;
+}
+
+// Helper: whether two paths name the same existing file (symlinks and ./.. resolved)
+static bool same_file(const std::string & a, const std::string & b) {
+    char real_a[PATH_MAX], real_b[PATH_MAX];
+    return realpath(a.c_str(), real_a) && realpath(b.c_str(), real_b) && strcmp(real_a, real_b) == 0;
+}
+
+bool lora_merge(const lora_merge_params & params, std::string * error) {
+    std::string err_local;
+    if (!error) error = &err_local;
+    error->clear();
+
+    const int n_threads = params.n_threads > 0 ? params.n_threads :
+        std::max(1, (int) std::thread::hardware_concurrency());
+    auto t_start = std::chrono::steady_clock::now();
+
+    // Opening the output truncates it (and a failed merge removes it): never over an input
+    if (same_file(params.output_path, params.base_path) || same_file(params.output_path, params.adapter_path)) {
+        *error = "output " + params.output_path + " is one of the input files";
+        return false;
+    }
+
+    // Base: metadata only — tensor data is streamed from the file
+    ggml_context * base_meta = nullptr;
+    gguf_context * base = gguf_init_from_file(params.base_path.c_str(), { /*no_alloc*/ true, &base_meta });
+    if (!base) {
+        *error = "failed to read base model " + params.base_path;
+        return false;
+    }
+
+    // Adapter: fully loaded (small)
+    ggml_context * adapter_data = nullptr;
+    gguf_context * adapter = gguf_init_from_file(params.adapter_path.c_str(), { /*no_alloc*/ false, &adapter_data });
+    if (!adapter) {
+        gguf_free(base);
+        ggml_free(base_meta);
+        *error = "failed to read adapter " + params.adapter_path;
+        return false;
+    }
+
+    gguf_context * out   = nullptr;
+    FILE         * f_in  = nullptr;
+    FILE         * f_out = nullptr;
+    bool ok = false;
+
+    auto fail = [&](const std::string & msg) { *error = msg; };
+
+    do {
+        // Adapter must be a LoRA for the same architecture
+        int64_t kid = gguf_find_key(adapter, "adapter.type");
+        if (kid >= 0 && strcmp(gguf_get_val_str(adapter, kid), "lora") != 0) {
+            fail("adapter is not a LoRA adapter");
+            break;
+        }
+        int64_t arch_a = gguf_find_key(adapter, "general.architecture");
+        int64_t arch_b = gguf_find_key(base, "general.architecture");
+        if (arch_a >= 0 && arch_b >= 0 &&
+            strcmp(gguf_get_val_str(adapter, arch_a), gguf_get_val_str(base, arch_b)) != 0) {
+            fail(std::string("adapter architecture ") + gguf_get_val_str(adapter, arch_a) +
+                 " doesn't match base " + gguf_get_val_str(base, arch_b));
+            break;
+        }
+        int64_t alpha_id = gguf_find_key(adapter, "adapter.lora.alpha");
+        const float alpha = alpha_id >= 0 ? gguf_get_val_f32(adapter, alpha_id) : 0.0f;
+
+        // Every adapter pair must target a base tensor
+        const int64_t n_adapter_tensors = gguf_get_n_tensors(adapter);
+        int64_t n_pairs = 0;
+        for (int64_t i = 0; i < n_adapter_tensors; i++) {
+            std::string name = gguf_get_tensor_name(adapter, i);
+            const std::string suffix = ".lora_a";
+            if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+            std::string base_name = name.substr(0, name.size() - suffix.size());
+            if (gguf_find_tensor(base, base_name.c_str()) < 0 ||
+                !ggml_get_tensor(adapter_data, (base_name + ".lora_b").c_str())) {
+                fail("adapter tensor " + name + " has no matching base tensor or lora_b");
+                break;
+            }
+            n_pairs++;
+        }
+        if (!error->empty()) break;
+        if (n_pairs == 0) {
+            fail("adapter has no lora_a/lora_b tensors");
+            break;
+        }
+
+        // Output metadata: all base KVs and tensor infos (types and shapes are unchanged)
+        out = gguf_init_empty();
+        gguf_set_kv(out, base);
+        const int64_t n_tensors = gguf_get_n_tensors(base);
+        for (int64_t i = 0; i < n_tensors; i++) {
+            gguf_add_tensor(out, ggml_get_tensor(base_meta, gguf_get_tensor_name(base, i)));
+        }
+        const size_t align = gguf_get_alignment(out);
+
+        f_in = fopen(params.base_path.c_str(), "rb");
+        f_out = fopen(params.output_path.c_str(), "wb");
+        if (!f_in || !f_out) {
+            fail("failed to open " + std::string(!f_in ? params.base_path : params.output_path));
+            break;
+        }
+
+        // Placeholder for the metadata — written last, once every tensor is on disk
+        const size_t meta_size = gguf_get_meta_size(out);
+        std::vector<uint8_t> meta(meta_size, 0);
+        if (fwrite(meta.data(), 1, meta_size, f_out) != meta_size) {
+            fail("failed to write " + params.output_path);
+            break;
+        }
+
+        merge_log(params, "Merging %lld adapter tensors into %lld base tensors (alpha=%.1f, scale=%.2f, %d threads)",
+                  (long long) n_pairs, (long long) n_tensors, (double) alpha, (double) params.scale, n_threads);
+
+        const size_t data_offset = gguf_get_data_offset(base);
+        std::vector<uint8_t> buf;
+        std::vector<std::vector<float>> scratch((size_t) n_threads);
+        int64_t n_merged = 0;
+
+        for (int64_t i = 0; i < n_tensors && error->empty(); i++) {
+            const char * name = gguf_get_tensor_name(base, i);
+            const ggml_tensor * w = ggml_get_tensor(base_meta, name);
+            const size_t size = ggml_nbytes(w);
+
+            buf.resize(size);
+            if (!read_tensor_data(f_in, data_offset + gguf_get_tensor_offset(base, i), buf.data(), size)) {
+                fail(std::string("failed to read tensor ") + name);
+                break;
+            }
+
+            const ggml_tensor * a = ggml_get_tensor(adapter_data, (std::string(name) + ".lora_a").c_str());
+            const ggml_tensor * b = ggml_get_tensor(adapter_data, (std::string(name) + ".lora_b").c_str());
+            if (a && b) {
+                if (w->ne[2] != 1 || w->ne[3] != 1) {
+                    fail(std::string("can't merge into non-2D tensor ") + name);
+                    break;
+                }
+                if (w->type != GGML_TYPE_F32 && !ggml_get_type_traits(w->type)->to_float) {
+                    fail(std::string("can't dequantize ") + name + " (" + ggml_type_name(w->type) + ")");
+                    break;
+                }
+                if (ggml_quantize_requires_imatrix(w->type)) {
+                    fail(std::string("re-quantizing ") + name + " to " + ggml_type_name(w->type) +
+                         " needs an importance matrix — merge into a higher-precision base instead");
+                    break;
+                }
+
+                merge_delta delta;
+                const bool is_token_embd = strcmp(name, "token_embd.weight") == 0;
+                if (!build_delta(w, a, b, is_token_embd, params.scale, alpha, delta, error)) break;
+
+                ggml_quantize_init(w->type);
+
+                // Split rows across threads; each thread works on its own rows in place
+                const int64_t n_rows  = w->ne[1];
+                const int64_t n_chunks = (n_rows + MERGE_CHUNK_ROWS - 1) / MERGE_CHUNK_ROWS;
+                const int64_t n_split = std::max<int64_t>(1, std::min<int64_t>(n_threads, n_chunks));   // 1 for n_rows == 0
+                const int64_t per     = (n_rows + n_split - 1) / n_split;
+                std::vector<std::thread> workers;
+                for (int64_t t = 1; t < n_split; t++) {
+                    const int64_t r0 = t * per, r1 = std::min(n_rows, r0 + per);
+                    if (r0 >= r1) break;
+                    workers.emplace_back(merge_rows, w, buf.data(), std::cref(delta), r0, r1, std::ref(scratch[(size_t) t]));
+                }
+                merge_rows(w, buf.data(), delta, 0, std::min(n_rows, per), scratch[0]);
+                for (auto & th : workers) th.join();
+
+                n_merged++;
+                merge_log(params, "[%lld/%lld] %s: merged (%s, rank %lld)", (long long) (i + 1), (long long) n_tensors,
+                          name, ggml_type_name(w->type), (long long) delta.rank);
+            }
+
+            if (fwrite(buf.data(), 1, size, f_out) != size || !write_padding(f_out, size, align)) {
+                fail("failed to write " + params.output_path);
+                break;
+            }
+        }
+        if (!error->empty()) break;
+
+        // Real metadata over the placeholder
+        gguf_get_meta_data(out, meta.data());
+        if (fseeko(f_out, 0, SEEK_SET) != 0 || fwrite(meta.data(), 1, meta_size, f_out) != meta_size) {
+            fail("failed to write metadata to " + params.output_path);
+            break;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        merge_log(params, "Merged %lld tensors in %.1fs -> %s", (long long) n_merged, elapsed, params.output_path.c_str());
+        ok = true;
+    } while (false);
+
+    if (f_in) fclose(f_in);
+    if (f_out && fclose(f_out) != 0 && ok) {
+        fail("failed to close " + params.output_path);
+        ok = false;
+    }
+    if (!ok && f_out) remove(params.output_path.c_str());
+
+    if (out) gguf_free(out);
+    gguf_free(adapter);
+    ggml_free(adapter_data);
+    gguf_free(base);
+    ggml_free(base_meta);
+    return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Offline LoRA merge — bakes an adapter into a base GGUF.
+// Platform neutral (no JNI / Android deps) so it builds into both liblora.so and the
+// lora-merge CLI. The base model is streamed tensor by tensor: only one base tensor
+// (plus the adapter) is in memory at a time.
+
+#include <string>
+
+typedef void (*lora_merge_log_fn)(const char * msg, void * user_data);
+
+struct lora_merge_params {
+    std::string        base_path;            // Base model .gguf (any non-imatrix quant type)
+    std::string        adapter_path;         // LoRA adapter .gguf (saveLoraAdapter output)
+    std::string        output_path;          // Merged model .gguf
+    float              scale     = 1.0f;     // Adapter scale, as passed to llama_set_adapter_lora
+    int                n_threads = 0;        // 0 = all hardware threads
+    lora_merge_log_fn  log       = nullptr;  // Progress messages (optional)
+    void             * log_user  = nullptr;
+};
+
+// Writes base + scale * (alpha / rank) * B·A for every adapted tensor, re-quantized to the
+// base tensor's type. Returns false and sets *error on failure (output file removed), or
+// without touching anything when output_path resolves to the base or the adapter.
+bool lora_merge(const lora_merge_params & params, std::string * error);
@@ -0,0 +1,65 @@
+// lora-merge — host CLI for the offline LoRA merge (see lora_merge.h)
+//
+//   lora-merge -m base.gguf -a adapter.gguf -o merged.gguf [-s scale] [-t threads]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "lora_merge.h"
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr,
+            "usage: %s -m BASE.gguf -a ADAPTER.gguf -o OUTPUT.gguf [-s SCALE] [-t THREADS]\n"
+            "\n"
+            "Bakes a LoRA adapter into the base model, re-quantizing each merged\n"
+            "tensor to its original type. Tensors are streamed one at a time.\n"
+            "\n"
+            "  -m, --model     base model GGUF\n"
+            "  -a, --adapter   LoRA adapter GGUF\n"
+            "  -o, --output    merged model GGUF\n"
+            "  -s, --scale     adapter scale (default 1.0)\n"
+            "  -t, --threads   worker threads (default: all)\n",
+            argv0);
+}
+
+static void log_stderr(const char * msg, void * /* user_data */) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+int main(int argc, char ** argv) {
+    lora_merge_params params;
+    params.log = log_stderr;
+
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ((!strcmp(arg, "-m") || !strcmp(arg, "--model")) && has_value) {
+            params.base_path = argv[++i];
+        } else if ((!strcmp(arg, "-a") || !strcmp(arg, "--adapter")) && has_value) {
+            params.adapter_path = argv[++i];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && has_value) {
+            params.output_path = argv[++i];
+        } else if ((!strcmp(arg, "-s") || !strcmp(arg, "--scale")) && has_value) {
+            params.scale = strtof(argv[++i], nullptr);
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && has_value) {
+            params.n_threads = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (params.base_path.empty() || params.adapter_path.empty() || params.output_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::string error;
+    if (!lora_merge(params, &error)) {
+        fprintf(stderr, "error: %s\n", error.c_str());
+        return 1;
+    }
+    return 0;
+}
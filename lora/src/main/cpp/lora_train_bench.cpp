@@ -0,0 +1,349 @@
+// lora-train-bench — training throughput benchmark over the training engine (see lora_train_engine.h)
+//
+//   lora-train-bench -m model.gguf [--rank 4,8,16] [-c 256,512] [-t 4,8] [--skip 0]
+//                    [-ub 0,128] [--mode f32,qlora,qlora-f16kv] [--targets all,attn_q+attn_v]
+//                    [--steps 8] [-o results.json]
+//
+// Runs createLoraAdapter -> setTrainingData -> initTraining -> trainEpoch for every
+// combination of the listed values on a deterministic synthetic corpus, with the epoch set to
+// exactly --steps optimizer steps (one step = one n_ctx window, run as n_ctx / ubatch
+// micro-batches). The model is reloaded for every combination, since the optimizer context
+// can only be initialized once.
+//
+// Modes: f32 = base loaded into RAM + F32 KV (the default), qlora = base mapped in its GGUF
+// types, qlora-f16kv = qlora with an F16 KV cache.
+//
+// Targets: all = createLoraAdapter (every projection), otherwise '+'-joined modules for
+// createTargetedLoraAdapter. Those runs also report the adapter's parameters, training
+// memory and extra forward FLOPs, next to the measured speed — the quality / speed trade.
+//
+// Reported per combination: training tokens/s, per-step time split into forward
+// (measured on the eval batches, which run the forward pass only) and backward + AdamW
+// (the remainder), peak RSS and the train/eval loss after the steps.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+
+#include "lora_train_engine.h"
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL.gguf [options]\n"
+            "\n"
+            "Lists are comma separated; every combination is run.\n"
+            "\n"
+            "  -m, --model      model GGUF\n"
+            "      --rank       LoRA ranks (default 4,8,16)\n"
+            "  -c, --ctx        context sizes (default 256,512)\n"
+            "  -t, --threads    thread counts (default: cores - 2)\n"
+            "      --skip       leading layers without LoRA (default 0)\n"
+            "  -ub, --ubatch    micro-batch tokens, 0 = n_ctx (default 0)\n"
+            "      --mode       f32, qlora, qlora-f16kv (default f32)\n"
+            "      --targets    LoRA module sets: all, or modules joined by + (default all)\n"
+            "      --steps      train batches per run (default 8)\n"
+            "      --lr         learning rate (default 1e-4)\n"
+            "  -o, --output     write JSON here instead of stdout\n",
+            argv0);
+}
+
+static bool parse_list(const char * arg, std::vector<int> & out) {
+    out.clear();
+    const char * p = arg;
+    while (*p) {
+        char * end = nullptr;
+        long v = strtol(p, &end, 10);
+        if (end == p) return false;
+        out.push_back((int) v);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return false;
+    }
+    return !out.empty();
+}
+
+static const char * k_modes[] = { "f32", "qlora", "qlora-f16kv" };
+
+static bool parse_modes(const char * arg, std::vector<int> & out) {
+    out.clear();
+    std::string list = arg;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        const std::string name = list.substr(pos, end - pos);
+        int mode = -1;
+        for (int m = 0; m < (int) (sizeof(k_modes) / sizeof(k_modes[0])); m++) {
+            if (name == k_modes[m]) mode = m;
+        }
+        if (mode < 0) return false;
+        out.push_back(mode);
+        pos = end + 1;
+    }
+    return !out.empty();
+}
+
+static std::vector<std::string> split(const std::string & list, char sep) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = list.find(sep, pos);
+        if (end == std::string::npos) end = list.size();
+        if (end > pos) out.push_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return out;
+}
+
+static std::string json_escape(const std::string & in) {
+    std::string out;
+    for (char c : in) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if ((unsigned char) c < 0x20) out += ' ';
+        else out += c;
+    }
+    return out;
+}
+
+static bool is_error(const std::string & result) {
+    return result.compare(0, 6, "ERROR:") == 0;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Peak RSS bookkeeping through procfs: writing "5" to clear_refs resets VmHWM (Linux >= 4.0)
+static void reset_peak_rss() {
+    FILE * f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+static double peak_rss_mb() {
+    FILE * f = fopen("/proc/self/status", "r");
+    if (!f) return 0.0;
+    char line[256];
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb / 1024.0;
+}
+
+// Deterministic corpus that tokenizes to at least n_tokens (as setTrainingData tokenizes it).
+// Varied enough that the loss moves, identical across builds and devices.
+static std::string make_corpus(int n_tokens) {
+    static const char * words[] = {
+        "the", "model", "learns", "a", "small", "adapter", "while", "its", "base", "weights",
+        "stay", "frozen", "and", "each", "step", "updates", "only", "low", "rank", "matrices",
+        "on", "phones", "with", "limited", "memory", "so", "we", "measure", "every", "setting",
+    };
+    const int n_words = (int) (sizeof(words) / sizeof(words[0]));
+    auto build = [&](int count) {
+        std::string text;
+        for (int i = 0; i < count; i++) {
+            text += words[(i * 11 + i / n_words) % n_words];
+            text += (i % 12 == 11) ? ".\n" : " ";
+        }
+        return text;
+    };
+
+    // Token count grows monotonically with the word count — binary search the word count
+    int lo = 1, hi = std::max(2, n_tokens);
+    while (train_count_tokens(build(hi)) < n_tokens) hi *= 2;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (train_count_tokens(build(mid)) < n_tokens) lo = mid + 1;
+        else hi = mid;
+    }
+    return build(lo);
+}
+
+int main(int argc, char ** argv) {
+    std::string model_path;
+    std::string output_path;
+    std::vector<int> ranks   = { 4, 8, 16 };
+    std::vector<int> ctxs    = { 256, 512 };
+    std::vector<int> threads = { std::max(2, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2) };
+    std::vector<int> skips   = { 0 };
+    std::vector<int> ubatches = { 0 };
+    std::vector<int> modes    = { 0 };
+    std::vector<std::string> target_sets = { "all" };
+    int   n_steps = 8;
+    float lr      = 1e-4f;
+
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        bool ok = has_value;
+        if ((!strcmp(arg, "-m") || !strcmp(arg, "--model")) && has_value) {
+            model_path = argv[++i];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && has_value) {
+            output_path = argv[++i];
+        } else if (!strcmp(arg, "--rank") && has_value) {
+            ok = parse_list(argv[++i], ranks);
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--ctx")) && has_value) {
+            ok = parse_list(argv[++i], ctxs);
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && has_value) {
+            ok = parse_list(argv[++i], threads);
+        } else if (!strcmp(arg, "--skip") && has_value) {
+            ok = parse_list(argv[++i], skips);
+        } else if ((!strcmp(arg, "-ub") || !strcmp(arg, "--ubatch")) && has_value) {
+            ok = parse_list(argv[++i], ubatches);
+        } else if (!strcmp(arg, "--mode") && has_value) {
+            ok = parse_modes(argv[++i], modes);
+        } else if (!strcmp(arg, "--targets") && has_value) {
+            target_sets = split(argv[++i], ',');
+            ok = !target_sets.empty();
+        } else if (!strcmp(arg, "--steps") && has_value) {
+            n_steps = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--lr") && has_value) {
+            lr = strtof(argv[++i], nullptr);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (model_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!train_init_backend("")) return 1;
+
+    train_set_steps_per_epoch(n_steps);
+
+    const char * tmp_dir = getenv("TMPDIR");
+    const std::string init_path = std::string(tmp_dir ? tmp_dir : "/tmp") + "/lora-train-bench-init.gguf";
+
+    std::string results;
+    bool failed = false;
+    for (int mode : modes)
+    for (int n_ctx : ctxs)
+    for (int n_ubatch_req : ubatches)
+    for (int n_threads : threads)
+    for (int rank : ranks)
+    for (int n_skip : skips)
+    for (const std::string & target_set : target_sets) {
+        reset_peak_rss();
+        auto t_setup = std::chrono::steady_clock::now();
+
+        train_set_micro_batch(n_ubatch_req);
+        train_set_qlora(mode >= 1, mode == 2);
+
+        // ~2 windows per n_ctx tokens (stride n_ctx/2): plenty of distinct windows to sample,
+        // plus the held-out tail for the eval batches
+        std::string status = train_load_model(model_path, n_threads, n_ctx);
+        if (!is_error(status)) {
+            status = target_set == "all"
+                ? train_create_lora_adapter(rank, 2.0f * (float) rank, n_skip)
+                : train_create_targeted_lora_adapter(split(target_set, '+'), std::vector<int>((size_t) n_skip, 0),
+                                                     rank, 2.0f * (float) rank, init_path);
+        }
+        train_adapter_info adapter;
+        train_get_adapter_info(&adapter);
+        if (!is_error(status)) {
+            status = train_set_training_data(make_corpus((n_steps + 2) * n_ctx));
+        }
+        if (!is_error(status)) {
+            status = train_init_training(lr, 1);
+        }
+        double setup_ms = elapsed_ms(t_setup);
+        if (!is_error(status)) {
+            status = train_epoch(0);
+        }
+
+        char head[256];
+        snprintf(head, sizeof(head),
+                 "{\"mode\":\"%s\",\"rank\":%d,\"alpha\":%d,\"n_ctx\":%d,\"ubatch\":%d,\"n_threads\":%d,\"n_layers_skip\":%d",
+                 k_modes[mode], rank, 2 * rank, n_ctx, n_ubatch_req, n_threads, n_skip);
+        std::string row = head;
+        row += ",\"targets\":\"" + json_escape(target_set) + "\"";
+        if (adapter.n_tensors > 0) {
+            char cost[256];
+            snprintf(cost, sizeof(cost),
+                     ",\"lora_tensors\":%lld,\"lora_params\":%lld,\"lora_train_mb\":%.2f,"
+                     "\"lora_mflop_per_token\":%.3f,\"lora_flop_pct\":%.3f",
+                     (long long) adapter.n_tensors, (long long) adapter.n_params, adapter.train_mb,
+                     adapter.mflop_per_token, adapter.flop_pct);
+            row += cost;
+        }
+
+        if (is_error(status)) {
+            fprintf(stderr, "%s (%s rank=%d ctx=%d t=%d skip=%d targets=%s)\n", status.c_str(), k_modes[mode], rank,
+                    n_ctx, n_threads, n_skip, target_set.c_str());
+            row += ",\"error\":\"" + json_escape(status) + "\"}";
+            failed = true;
+        } else {
+            train_epoch_stats stats;
+            train_get_epoch_stats(&stats);
+
+            // Batches are micro-batches; a step is one window of n_accum of them. The first
+            // micro-batch also pays for graph / buffer setup; steady state excludes it.
+            const int64_t n_train  = stats.n_train_batches;
+            const int     n_accum  = stats.n_ubatch > 0 ? stats.n_ctx / stats.n_ubatch : 1;
+            const double  micro_ms = n_train > 1 ? (stats.train_ms - stats.train_first_ms) / (double) (n_train - 1)
+                                                 : stats.train_ms;
+            const double  step_ms  = micro_ms * n_accum;
+            const double  first_ms = stats.train_first_ms + micro_ms * (n_accum - 1);
+            const double  fwd_ms   = stats.n_eval_batches > 0 ? stats.eval_ms * n_accum / (double) stats.n_eval_batches : 0.0;
+            const double  bwd_ms   = std::max(0.0, step_ms - fwd_ms);
+            const double  tok_s    = step_ms > 0 ? stats.n_ctx * 1000.0 / step_ms : 0.0;
+
+            char body[640];
+            snprintf(body, sizeof(body),
+                     ",\"n_ubatch\":%d,\"n_steps\":%lld,\"n_eval\":%lld,\"tokens_per_s\":%.2f,"
+                     "\"step_ms\":%.2f,\"first_step_ms\":%.2f,\"forward_ms\":%.2f,\"backward_ms\":%.2f,"
+                     "\"epoch_ms\":%.2f,\"setup_ms\":%.2f,\"peak_rss_mb\":%.1f,"
+                     "\"train_loss\":%.5f,\"eval_loss\":%.5f}",
+                     stats.n_ubatch, (long long) (n_train / n_accum), (long long) (stats.n_eval_batches / n_accum), tok_s,
+                     step_ms, first_ms, fwd_ms, bwd_ms,
+                     stats.train_ms + stats.eval_ms, setup_ms, peak_rss_mb(),
+                     stats.train_loss, stats.eval_loss);
+            row += body;
+
+            fprintf(stderr, "%s rank=%d ctx=%d ub=%d t=%d skip=%d targets=%s: %.1f tok/s, step %.1f ms "
+                            "(fwd %.1f / bwd+opt %.1f), peak %.0f MB, loss %.4f\n",
+                    k_modes[mode], rank, n_ctx, stats.n_ubatch, n_threads, n_skip, target_set.c_str(), tok_s, step_ms,
+                    fwd_ms, bwd_ms, peak_rss_mb(), stats.train_loss);
+        }
+        if (!results.empty()) results += ",\n    ";
+        results += row;
+    }
+
+    train_cleanup();
+    unlink(init_path.c_str());
+
+    char meta[256];
+    snprintf(meta, sizeof(meta),
+             "  \"steps\": %d,\n  \"learning_rate\": %g,\n  \"n_cpus\": %d,\n",
+             n_steps, (double) lr, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    std::string json = "{\n  \"model\": \"" + json_escape(model_path) + "\",\n" + meta +
+                       "  \"results\": [\n    " + results + "\n  ]\n}\n";
+
+    if (output_path.empty()) {
+        fputs(json.c_str(), stdout);
+    } else {
+        FILE * f = fopen(output_path.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "ERROR: Failed to write %s\n", output_path.c_str());
+            return 1;
+        }
+        fputs(json.c_str(), f);
+        fclose(f);
+        fprintf(stderr, "Results written to %s\n", output_path.c_str());
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,2006 @@
+#include "lora_train_engine.h"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <atomic>
+
+#include "llama.h"
+#include "common.h"
+#include "ggml-opt.h"
+#include "ggml-backend.h"
+#include "gguf.h"
+#include "lora_log.h"
+#include "lora_dataset.h"
+
+// Timing of the current / last epoch, filled by the progress callback
+static train_epoch_stats            g_epoch_stats;
+
+// Writes the periodic checkpoint once a window's optimizer step is done (defined below)
+static void checkpoint_after_step(ggml_opt_context_t opt_ctx, int64_t step);
+// Drains and stops the background checkpoint writer before the adapter goes away
+static void checkpoint_reset();
+// Applies queued worker commands between batches; blocks while paused (defined below)
+static void worker_poll_commands();
+// True while a worker job uses the model / adapter / dataset and the caller isn't the worker:
+// entry points that change or use them then return WORKER_BUSY instead
+static bool worker_busy();
+#define WORKER_BUSY "ERROR: Training worker is running"
+static void progress_publish(int state, double loss, double tokens_per_s, double elapsed_s, double eta_s);
+// Thread governor: measures train batches and adjusts the thread count between them (defined below)
+static void governor_on_batch(int64_t ibatch);
+static void governor_reset(int n_threads);
+
+static std::atomic<bool>            g_worker_pending{false}; // Commands queued for the worker
+static std::atomic<bool>            g_abort{false};          // Cancel: remaining graphs abort at their first node
+static int64_t                      g_paused_us = 0;         // Time paused in the current phase
+static int64_t                      g_progress_step = 0;     // Steps done in the current epoch (progress)
+static int64_t                      g_progress_n_steps = 0;  // Steps in the current epoch
+static int                          g_progress_epochs_left = 0; // Epochs after the current one
+
+// Abort callback of the training context (see g_abort)
+static bool train_abort_callback(void * /* data */) {
+    return g_abort.load(std::memory_order_relaxed);
+}
+
+// Training progress callback — called after EVERY micro-batch
+static void train_progress_callback(
+        bool               train,
+        ggml_opt_context_t opt_ctx,
+        ggml_opt_dataset_t /* dataset */,
+        ggml_opt_result_t  result,
+        int64_t            ibatch,
+        int64_t            ibatch_max,
+        int64_t            t_start_us) {
+
+    // Pause / cancel requests take effect here, between batches (paused time isn't counted;
+    // t_start_us is per phase, so neither is the count)
+    if (ibatch == 0) g_paused_us = 0;
+    if (g_worker_pending.load(std::memory_order_acquire)) worker_poll_commands();
+    if (g_abort.load(std::memory_order_relaxed)) return;
+
+    double loss = 0.0;
+    ggml_opt_result_loss(result, &loss, nullptr);
+
+    double elapsed_s = (double)(ggml_time_us() - t_start_us - g_paused_us) / 1e6;
+    double batches_per_sec = (ibatch + 1) / (elapsed_s > 0 ? elapsed_s : 1.0);
+
+    // t_start_us is per phase, so the last call of each phase holds its total time
+    if (train) {
+        g_epoch_stats.n_train_batches = ibatch + 1;
+        g_epoch_stats.train_ms        = elapsed_s * 1e3;
+        g_epoch_stats.train_loss      = loss;
+        if (ibatch == 0) g_epoch_stats.train_first_ms = elapsed_s * 1e3;
+
+        // The optimizer steps after the last micro-batch of each window
+        const int64_t n_accum = g_epoch_stats.n_ubatch > 0 ? g_epoch_stats.n_ctx / g_epoch_stats.n_ubatch : 1;
+        if ((ibatch + 1) % n_accum == 0) checkpoint_after_step(opt_ctx, (ibatch + 1) / n_accum);
+
+        // ETA from this run's steady step time: the rest of this epoch plus the epochs left
+        const double  step_s     = elapsed_s * n_accum / (double) (ibatch + 1);
+        const int64_t steps_left = g_progress_n_steps - g_progress_step +
+                                   (int64_t) g_progress_epochs_left * g_progress_n_steps;
+        progress_publish(-1, loss, (ibatch + 1) * g_epoch_stats.n_ubatch / (elapsed_s > 0 ? elapsed_s : 1.0),
+                         elapsed_s, steps_left * step_s);
+
+        governor_on_batch(ibatch);
+    } else {
+        g_epoch_stats.n_eval_batches  = ibatch + 1;
+        g_epoch_stats.eval_ms         = elapsed_s * 1e3;
+        g_epoch_stats.eval_loss       = loss;
+    }
+
+    const char * phase = train ? "TRAIN" : "EVAL";
+    ui_log("[%s] batch %lld/%lld | loss: %.4f | %.2f batch/s | %.1fs elapsed",
+           phase, (long long)(ibatch + 1), (long long)ibatch_max,
+           loss, batches_per_sec, elapsed_s);
+}
+
+// ============================================
+// Global training state
+// ============================================
+static llama_model                * g_model   = nullptr;
+static llama_context              * g_context = nullptr;
+static llama_adapter_lora         * g_adapter = nullptr;
+static std::string                  g_model_path;      // Base GGUF (targeted adapters read its layout)
+static train_adapter_info           g_adapter_info;    // Size / cost of g_adapter, when known
+static ggml_opt_dataset_t           g_dataset = nullptr; // Current epoch's windows (dataset_materialize)
+static dataset_tokens               g_tokens;          // Mapped token cache behind the plans (if any)
+static dataset_token_store          g_token_store;     // Tokens behind the plans when not cached
+static dataset_plan                 g_plan_train;      // Windows over the training documents
+static dataset_plan                 g_plan_eval;       // Windows over the held-out documents
+static llama_token                  g_eos = 0;         // Label after a document's last token / filler
+static std::string                  g_token_cache_dir; // Token cache for setTrainingData ("" = off)
+static bool                         g_packing = false; // Pack whole documents instead of sliding windows
+static int                          g_steps_per_epoch = 0; // 0 = every train window once, in order
+static int                          g_micro_batch = 0; // Tokens per forward/backward pass, 0 = n_ctx
+static bool                         g_qlora = false;   // Base weights mapped in their GGUF types
+static bool                         g_f16_kv = false;  // F16 K/V cache instead of F32
+static std::string                  g_ckpt_path;       // Periodic checkpoint ("" = off)
+static int                          g_ckpt_every = 0;  // Optimizer steps between checkpoints
+static int                          g_pos_epoch = 0;   // Training position: epoch index ...
+static int64_t                      g_pos_step = 0;    // ... and steps (windows) done in it
+static int64_t                      g_step_offset = 0; // Steps skipped at the start of this epoch (resume)
+static int                          g_resume_epoch = -1; // Pending resume (train_resume_training)
+static int64_t                      g_resume_step = 0;
+static int                          g_resume_warmup = 0; // Optimizer steps left in the post-resume LR ramp
+static struct lr_opt                g_lr;
+static bool                         g_backend_initialized = false;
+
+// Helper: drop the training data (tokens, plans and the epoch dataset)
+static void reset_data() {
+    if (g_dataset) { ggml_opt_dataset_free(g_dataset); g_dataset = nullptr; }
+    dataset_tokens_close(&g_tokens);
+    g_token_store = dataset_token_store();
+    g_plan_train.clear();
+    g_plan_eval.clear();
+}
+
+// Helper: tokens the plans point into
+static dataset_tokens data_tokens() {
+    return g_tokens.tokens ? g_tokens : dataset_store_view(g_token_store);
+}
+
+// ============================================
+// Train: Init Backend
+// ============================================
+bool train_init_backend(const std::string & native_lib_dir) {
+    ui_log("Initializing llama.cpp backend...");
+
+    ui_log_attach_llama();
+
+    if (!native_lib_dir.empty()) {
+        ui_log("Loading backends from: %s", native_lib_dir.c_str());
+        ggml_backend_load_all_from_path(native_lib_dir.c_str());
+    } else {
+        ggml_backend_load_all();
+    }
+    llama_backend_init();
+
+    g_backend_initialized = true;
+    ui_log("Backend initialized (CPU)");
+    return true;
+}
+
+// ============================================
+// Train: Load Model
+// ============================================
+std::string train_load_model(const std::string & model_path, int nThreads, int nCtx) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_backend_initialized) {
+        return "ERROR: Backend not initialized";
+    }
+
+    // Free previous (dataset windows and adapter belong to the old context / model)
+    reset_data();
+    g_resume_epoch  = -1;
+    g_resume_warmup = 0;
+    checkpoint_reset();
+    if (g_adapter && g_context) { llama_rm_adapter_lora(g_context, g_adapter); }
+    if (g_adapter) { llama_adapter_lora_free(g_adapter); g_adapter = nullptr; }
+    if (g_context) { llama_free(g_context); g_context = nullptr; }
+    if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
+
+    ui_log("Loading model: %s", model_path.c_str());
+
+    // The base is frozen (only LoRA A/B are parameters) and the quantized weights are
+    // dequantized inside each matmul, so QLoRA can map the GGUF read-only: the weights stay
+    // in their file types, page cache backed, instead of a private copy in RAM
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = g_qlora;
+    ui_log(g_qlora ? "use_mmap=true (QLoRA: frozen base weights mapped in their GGUF types)"
+                   : "use_mmap=false");
+
+    g_model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (!g_model) {
+        return "ERROR: Failed to load model";
+    }
+    g_model_path   = model_path;
+    g_adapter_info = train_adapter_info();
+
+    int n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads_actual = (nThreads > 0) ? nThreads :
+        std::max(2, n_cpus - 2);
+    int n_ctx_actual = (nCtx > 0) ? nCtx : 512;
+
+    // ggml-opt needs n_ubatch to divide the window: largest divisor of n_ctx <= the request
+    int n_ubatch = n_ctx_actual;
+    if (g_micro_batch > 0 && g_micro_batch < n_ctx_actual) {
+        n_ubatch = g_micro_batch;
+        while (n_ctx_actual % n_ubatch != 0) n_ubatch--;
+    }
+
+    ui_log("CPU cores: %d, using %d threads", n_cpus, n_threads_actual);
+    ui_log("Context size: %d, %s KV cache, flash_attn=off", n_ctx_actual, g_f16_kv ? "F16" : "F32");
+    if (n_ubatch < n_ctx_actual) {
+        ui_log("Micro-batch: %d tokens, gradients accumulated over %d micro-batches per step",
+               n_ubatch, n_ctx_actual / n_ubatch);
+    }
+
+    // One window (n_batch) is one optimizer step; each n_ubatch slice of it is one
+    // forward/backward graph, so activation memory follows n_ubatch instead of n_ctx
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx        = n_ctx_actual;
+    ctx_params.n_batch      = n_ctx_actual;
+    ctx_params.n_ubatch     = n_ubatch;
+    ctx_params.n_threads    = n_threads_actual;
+    ctx_params.n_threads_batch = n_threads_actual;
+    ctx_params.type_k = g_f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    ctx_params.type_v = g_f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    ctx_params.flash_attn_type = static_cast<llama_flash_attn_type>(0);
+    ctx_params.abort_callback  = train_abort_callback;   // Worker cancel
+
+    g_context = llama_init_from_model(g_model, ctx_params);
+    if (!g_context) {
+        llama_model_free(g_model);
+        g_model = nullptr;
+        return "ERROR: Failed to create context";
+    }
+    governor_reset(n_threads_actual);
+
+    char model_desc[256];
+    llama_model_desc(g_model, model_desc, sizeof(model_desc));
+    double model_size_gb = (double) llama_model_size(g_model) / 1024.0 / 1024.0 / 1024.0;
+
+    std::string result = "Model loaded: " + std::string(model_desc);
+    result += " (" + std::to_string(model_size_gb).substr(0, 4) + " GB)";
+    result += "\nThreads: " + std::to_string(n_threads_actual);
+    result += " | Context: " + std::to_string(n_ctx_actual);
+    if (n_ubatch < n_ctx_actual) result += " | Micro-batch: " + std::to_string(n_ubatch);
+    if (g_qlora)  result += " | QLoRA";
+    if (g_f16_kv) result += " | F16 KV";
+
+    ui_log("Model: %s (%.2f GB)", model_desc, model_size_gb);
+    return result;
+}
+
+// ============================================
+// Train: LoRA adapter layout
+// ============================================
+// Module of a base tensor LoRA can target: "attn_q" for blk.N.attn_q.weight (*layer = N),
+// "output" for output.weight (*layer = -1). "" for anything else — token_embd (different
+// adapter layout), norms and other non-matrix tensors.
+static std::string lora_module_name(const std::string & name, const ggml_tensor * w, int * layer) {
+    *layer = -1;
+    const std::string suffix = ".weight";
+    if (!w || w->ne[1] <= 1 || w->ne[2] != 1 || w->ne[3] != 1) return "";
+    if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) return "";
+    const std::string stem = name.substr(0, name.size() - suffix.size());
+    if (stem == "output") return stem;
+
+    int n = -1, consumed = 0;
+    if (sscanf(stem.c_str(), "blk.%d.%n", &n, &consumed) != 1 || consumed == 0) return "";
+    *layer = n;
+    return stem.substr((size_t) consumed);
+}
+
+// Parameter count, memory and forward cost of an adapter file, relative to the loaded base.
+// Per adapted W (n_in x n_out) at rank r: r * (n_in + n_out) parameters and as many
+// multiply-adds per token on top of the base's n_in * n_out.
+static bool adapter_info_from_file(const std::string & path, train_adapter_info * info) {
+    ggml_context * adapter_meta = nullptr;
+    gguf_context * adapter = gguf_init_from_file(path.c_str(), { /*no_alloc*/ true, &adapter_meta });
+    if (!adapter) return false;
+
+    *info = train_adapter_info();
+    std::unordered_set<int> layers;
+    const int64_t n_tensors = gguf_get_n_tensors(adapter);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const std::string name = gguf_get_tensor_name(adapter, i);
+        const std::string suffix = ".lora_a";
+        if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+        const std::string base_name = name.substr(0, name.size() - suffix.size());
+        const ggml_tensor * a = ggml_get_tensor(adapter_meta, name.c_str());
+        const ggml_tensor * b = ggml_get_tensor(adapter_meta, (base_name + ".lora_b").c_str());
+        if (!a || !b) continue;
+
+        info->n_tensors++;
+        info->n_params += ggml_nelements(a) + ggml_nelements(b);
+        info->adapter_mb += (double) (ggml_nbytes(a) + ggml_nbytes(b)) / (1024.0 * 1024.0);
+        int layer = -1;
+        if (sscanf(base_name.c_str(), "blk.%d.", &layer) == 1) layers.insert(layer);
+    }
+    gguf_free(adapter);
+    ggml_free(adapter_meta);
+    info->n_layers = (int) layers.size();
+
+    // A/B (F32) plus their gradients and both AdamW moments
+    info->train_mb = 4.0 * (double) info->n_params * sizeof(float) / (1024.0 * 1024.0);
+    info->mflop_per_token = 2.0 * (double) info->n_params / 1e6;
+
+    // Base matmul cost from the model's layout (metadata only)
+    ggml_context * base_meta = nullptr;
+    gguf_context * base = gguf_init_from_file(g_model_path.c_str(), { /*no_alloc*/ true, &base_meta });
+    if (base) {
+        double base_mflop = 0.0;
+        const int64_t n_base = gguf_get_n_tensors(base);
+        for (int64_t i = 0; i < n_base; i++) {
+            const char * name = gguf_get_tensor_name(base, i);
+            const ggml_tensor * w = ggml_get_tensor(base_meta, name);
+            int layer = -1;
+            if (lora_module_name(name, w, &layer).empty()) continue;
+            base_mflop += 2.0 * (double) w->ne[0] * (double) w->ne[1] / 1e6;
+        }
+        gguf_free(base);
+        ggml_free(base_meta);
+        info->flop_pct = base_mflop > 0 ? 100.0 * info->mflop_per_token / base_mflop : 0.0;
+    }
+    return true;
+}
+
+static void log_adapter_info(const train_adapter_info & info) {
+    ui_log("LoRA: %lld tensors in %d layers, %.2fM params | adapter %.1f MB, %.1f MB training (+ grads, AdamW)",
+           (long long) info.n_tensors, info.n_layers, info.n_params / 1e6, info.adapter_mb, info.train_mb);
+    ui_log("LoRA: +%.2f MFLOP/token forward (+%.2f%% of the base matmuls; backward ~2x that)",
+           info.mflop_per_token, info.flop_pct);
+}
+
+void train_get_adapter_info(train_adapter_info * info) {
+    *info = g_adapter_info;
+}
+
+// ============================================
+// Train: Create LoRA Adapter
+// ============================================
+std::string train_create_lora_adapter(int rank, float alpha, int nLayersSkip) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    ui_log("Creating LoRA adapter (rank=%d, alpha=%.1f, skip_layers=%d)...", rank, (double) alpha, nLayersSkip);
+
+    // Free previous adapter
+    checkpoint_reset();
+    if (g_adapter) {
+        llama_rm_adapter_lora(g_context, g_adapter);
+        llama_adapter_lora_free(g_adapter);
+        g_adapter = nullptr;
+    }
+
+    g_adapter_info = train_adapter_info();
+    g_adapter = llama_adapter_lora_create(g_model, rank, alpha, nullptr, nLayersSkip);
+    if (!g_adapter) {
+        return "ERROR: Failed to create LoRA adapter";
+    }
+
+    int32_t ret = llama_set_adapter_lora(g_context, g_adapter, 1.0f);
+    if (ret != 0) {
+        llama_adapter_lora_free(g_adapter);
+        g_adapter = nullptr;
+        return "ERROR: Failed to apply LoRA adapter";
+    }
+
+    ui_log("LoRA adapter applied to context");
+
+    // The layout is chosen inside llama.cpp: save the fresh adapter once and measure the file
+    const char * tmp_dir = getenv("TMPDIR");
+    const std::string info_path = tmp_dir ? std::string(tmp_dir) + "/lora-train-info.gguf"
+                                          : g_model_path + ".lora-info.tmp";
+    if (llama_lora_save_adapter(g_adapter, info_path.c_str()) == 0 &&
+        adapter_info_from_file(info_path, &g_adapter_info)) {
+        log_adapter_info(g_adapter_info);
+    } else {
+        ui_log("LoRA: could not measure the adapter (%s not writable)", info_path.c_str());
+    }
+    remove(info_path.c_str());
+
+    std::string result = "LoRA adapter created (rank=" + std::to_string(rank);
+    result += ", alpha=" + std::to_string(alpha);
+    result += ", skip=" + std::to_string(nLayersSkip) + ")";
+    return result;
+}
+
+// ============================================
+// Train: Load existing LoRA adapter
+// ============================================
+std::string train_load_lora_adapter(const std::string & lora_path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    checkpoint_reset();
+    if (g_adapter) {
+        llama_rm_adapter_lora(g_context, g_adapter);
+        llama_adapter_lora_free(g_adapter);
+        g_adapter = nullptr;
+    }
+
+    ui_log("Loading LoRA adapter from: %s", lora_path.c_str());
+
+    g_adapter_info = train_adapter_info();
+    g_adapter = llama_adapter_lora_init(g_model, lora_path.c_str());
+    if (!g_adapter) {
+        return "ERROR: Failed to load LoRA adapter";
+    }
+    adapter_info_from_file(lora_path, &g_adapter_info);
+
+    int32_t ret = llama_set_adapter_lora(g_context, g_adapter, 1.0f);
+    if (ret != 0) {
+        llama_adapter_lora_free(g_adapter);
+        g_adapter = nullptr;
+        return "ERROR: Failed to apply loaded LoRA adapter";
+    }
+
+    ui_log("LoRA adapter loaded and applied");
+    if (g_adapter_info.n_tensors > 0) log_adapter_info(g_adapter_info);
+    return "LoRA loaded from: " + lora_path;
+}
+
+// ============================================
+// Train: Create targeted LoRA adapter
+// ============================================
+// llama_adapter_lora_create only takes a layer skip, so the adapter is built here: lora_a /
+// lora_b pairs for the selected base tensors, written as an adapter GGUF and loaded like any
+// other. A ~ U(-1/sqrt(n_in), 1/sqrt(n_in)) (PEFT's default), B = 0, so training starts from
+// the base model's output.
+std::string train_create_targeted_lora_adapter(const std::vector<std::string> & target_modules,
+                                               const std::vector<int> & layer_ranks,
+                                               int rank, float alpha, const std::string & init_path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+    if (target_modules.empty() || init_path.empty()) {
+        return "ERROR: Target modules and an init path are required";
+    }
+
+    ggml_context * base_meta = nullptr;
+    gguf_context * base = gguf_init_from_file(g_model_path.c_str(), { /*no_alloc*/ true, &base_meta });
+    if (!base) {
+        return "ERROR: Failed to read model layout from " + g_model_path;
+    }
+
+    // Selected tensors and their ranks
+    struct lora_target { const ggml_tensor * w; int rank; };
+    std::vector<lora_target> targets;
+    size_t data_size = 0;
+    const int64_t n_base = gguf_get_n_tensors(base);
+    for (int64_t i = 0; i < n_base; i++) {
+        const char * name = gguf_get_tensor_name(base, i);
+        const ggml_tensor * w = ggml_get_tensor(base_meta, name);
+        int layer = -1;
+        const std::string module = lora_module_name(name, w, &layer);
+        if (module.empty()) continue;
+
+        bool match = false;
+        for (const std::string & pattern : target_modules) {
+            const bool glob = pattern.find_first_of("*?[") != std::string::npos;
+            if (glob ? fnmatch(pattern.c_str(), name, 0) == 0 : pattern == module) { match = true; break; }
+        }
+        if (!match) continue;
+
+        const int r = layer >= 0 && layer < (int) layer_ranks.size() ? layer_ranks[(size_t) layer] : rank;
+        if (r <= 0) continue;
+        targets.push_back({ w, r });
+        data_size += (size_t) r * (size_t) (w->ne[0] + w->ne[1]) * sizeof(float);
+    }
+    if (targets.empty()) {
+        gguf_free(base);
+        ggml_free(base_meta);
+        return "ERROR: No base tensor matches the target modules";
+    }
+
+    ggml_init_params params = {
+        /*mem_size   =*/ 2 * targets.size() * (ggml_tensor_overhead() + 64) + data_size,
+        /*mem_buffer =*/ nullptr,
+        /*no_alloc   =*/ false,
+    };
+    ggml_context * data = ggml_init(params);
+    if (!data) {
+        gguf_free(base);
+        ggml_free(base_meta);
+        return "ERROR: Out of memory for the initial adapter";
+    }
+    gguf_context * out = gguf_init_empty();
+
+    const int64_t arch_id = gguf_find_key(base, "general.architecture");
+    if (arch_id >= 0) gguf_set_val_str(out, "general.architecture", gguf_get_val_str(base, arch_id));
+    gguf_set_val_str(out, "general.type", "adapter");
+    gguf_set_val_str(out, "adapter.type", "lora");
+    gguf_set_val_f32(out, "adapter.lora.alpha", alpha);
+
+    // Layout follows llama.cpp adapters: lora_a ne = [n_in, r], lora_b ne = [r, n_out]
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (const lora_target & t : targets) {
+        const std::string name = ggml_get_name(t.w);
+        ggml_tensor * a = ggml_new_tensor_2d(data, GGML_TYPE_F32, t.w->ne[0], t.rank);
+        ggml_tensor * b = ggml_new_tensor_2d(data, GGML_TYPE_F32, t.rank, t.w->ne[1]);
+        ggml_set_name(a, (name + ".lora_a").c_str());
+        ggml_set_name(b, (name + ".lora_b").c_str());
+
+        const float bound = 1.0f / std::sqrt((float) t.w->ne[0]);
+        float * a_data = (float *) a->data;
+        for (int64_t j = 0; j < ggml_nelements(a); j++) {
+            // splitmix64 — same init on every device
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            a_data[j] = bound * (2.0f * (float) ((z >> 40) * (1.0 / 16777216.0)) - 1.0f);
+        }
+        memset(b->data, 0, ggml_nbytes(b));
+
+        gguf_add_tensor(out, a);
+        gguf_add_tensor(out, b);
+    }
+
+    const bool written = gguf_write_to_file(out, init_path.c_str(), false);
+    gguf_free(out);
+    ggml_free(data);
+    gguf_free(base);
+    ggml_free(base_meta);
+    if (!written) {
+        return "ERROR: Failed to write " + init_path;
+    }
+
+    std::string targets_desc;
+    for (const std::string & pattern : target_modules) {
+        targets_desc += (targets_desc.empty() ? "" : ",") + pattern;
+    }
+    ui_log("Creating targeted LoRA adapter (targets=%s, rank=%d, alpha=%.1f, %zu tensors)...",
+           targets_desc.c_str(), rank, (double) alpha, targets.size());
+
+    std::string result = train_load_lora_adapter(init_path);
+    if (result.compare(0, 6, "ERROR:") == 0) return result;
+
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "LoRA adapter created (targets=%s, %lld tensors, %.2fM params, %.1f MB training, +%.2f%% forward FLOPs)",
+             targets_desc.c_str(), (long long) g_adapter_info.n_tensors, g_adapter_info.n_params / 1e6,
+             g_adapter_info.train_mb, g_adapter_info.flop_pct);
+    return summary;
+}
+
+#define WARN_PAD_PCT 25.0   // Train windows' EOS filler share that gets a warning ...
+#define MAX_PAD_PCT  50.0   // ... and that refuses the data (ask for a smaller n_ctx)
+
+// Helper: plans the train / eval windows over the tokens — packed documents, or n_ctx
+// windows with stride n_ctx/2 — and returns the status string. doc_starts = nullptr: one document.
+static std::string plan_dataset(const dataset_tokens & data) {
+    int n_ctx = llama_n_ctx(g_context);
+    const size_t     n_tokens   = (size_t) data.n_tokens;
+    const uint64_t * doc_starts = data.doc_starts;
+    const size_t     n_docs     = (size_t) data.n_docs;
+
+    if (n_tokens < 2) {
+        return "ERROR: Training text too short";
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+    g_eos = llama_vocab_eos(vocab);
+    if (g_eos < 0) g_eos = llama_vocab_bos(vocab);
+
+    // Held-out documents (or the tail of a single one) never appear in a train window
+    const int64_t n = (int64_t) n_tokens;
+    const int64_t split = dataset_split_eval(doc_starts, n_docs, n, n_ctx);
+
+    if (g_packing) {
+        dataset_pack_stats stats;
+        dataset_plan_packed(doc_starts, n_docs, 0, split, n_ctx, data.loss_mask, &g_plan_train, &stats);
+        dataset_plan_packed(doc_starts, n_docs, split, n, n_ctx, data.loss_mask, &g_plan_eval, &stats);
+        const int64_t n_windows = g_plan_train.n_windows() + g_plan_eval.n_windows();
+        const double fill = n_windows > 0
+            ? 100.0 * (1.0 - (double) stats.n_pad / ((double) n_windows * n_ctx)) : 0.0;
+
+        ui_log("Dataset (packed): %lld documents -> %lld windows, ctx=%d, %.1f%% filled, %lld split",
+               (long long) stats.n_docs, (long long) n_windows, n_ctx, fill, (long long) stats.n_split_docs);
+        if (stats.n_dropped > 0) {
+            ui_log("Dropped %lld prompt-only pieces (no assistant tokens)", (long long) stats.n_dropped);
+        }
+    } else {
+        int64_t stride = std::max((int64_t) 1, (int64_t) n_ctx / 2);
+        int64_t n_dropped = 0;
+        dataset_plan_windows(0, split, n_ctx, stride, data.loss_mask, &g_plan_train, &n_dropped);
+        dataset_plan_windows(split, n, n_ctx, stride, data.loss_mask, &g_plan_eval, &n_dropped);
+        if (n_dropped > 0) {
+            ui_log("Dropped %lld prompt-only windows (no assistant tokens)", (long long) n_dropped);
+        }
+        ui_log("Dataset: %lld + %lld windows, stride=%lld, ctx=%d",
+               (long long) g_plan_train.n_windows(), (long long) g_plan_eval.n_windows(), (long long) stride, n_ctx);
+    }
+
+    // EOS filler trains EOS -> EOS: a corpus much shorter than its windows would mostly learn that
+    const int64_t n_train_slots = g_plan_train.n_windows() * n_ctx;
+    const int64_t n_train_real  = g_plan_train.n_tokens();
+    const double pad_pct = n_train_slots > 0 ? 100.0 * (double) (n_train_slots - n_train_real) / (double) n_train_slots : 0.0;
+    if (pad_pct > MAX_PAD_PCT) {
+        const int64_t n_ctx_fit = n_train_real / g_plan_train.n_windows();
+        g_plan_train.clear();
+        g_plan_eval.clear();
+        return "ERROR: Training data too short for ctx=" + std::to_string(n_ctx) + ": " +
+               std::to_string((int) pad_pct) + "% of the train windows would be EOS padding; " +
+               "load the model with n_ctx <= " + std::to_string(n_ctx_fit) + " or add data";
+    }
+    if (pad_pct > WARN_PAD_PCT) {
+        ui_log("WARNING: %.1f%% of the train windows are EOS padding (%lld of %lld tokens); "
+               "a smaller n_ctx fits this data better", pad_pct,
+               (long long) (n_train_slots - n_train_real), (long long) n_train_slots);
+    }
+    ui_log("Eval split: %lld held-out tokens%s", (long long) (n - split),
+           split < n ? "" : " (not enough data, eval skipped)");
+
+    if (data.loss_mask) {
+        int64_t n_targets = 0;
+        for (size_t i = 0; i < n_tokens; i++) n_targets += data.loss_mask[i] ? 1 : 0;
+        ui_log("Assistant tokens: %lld of %zu (%.1f%%); windows without any are dropped, "
+               "the loss still covers every token",
+               (long long) n_targets, n_tokens, 100.0 * (double) n_targets / (double) n_tokens);
+    }
+    if (g_plan_train.n_windows() == 0) {
+        return "ERROR: No training windows with assistant tokens";
+    }
+
+    std::string result = "Data: " + std::to_string(n_tokens) + " tokens";
+    result += " -> " + std::to_string(g_plan_train.n_windows()) + " train";
+    result += " + " + std::to_string(g_plan_eval.n_windows()) + " eval data points";
+    return result;
+}
+
+// Helper: log how the tokens were obtained
+static void log_tokens(bool from_cache, int64_t t_start) {
+    double load_s = (double)(ggml_time_us() - t_start) / 1e6;
+    if (from_cache) {
+        ui_log("Token cache hit: %lld tokens, %lld documents (%.2fs, no tokenization)",
+               (long long) g_tokens.n_tokens, (long long) g_tokens.n_docs, load_s);
+    } else {
+        ui_log("Tokenized: %lld tokens, %lld documents in %.1fs (%.0f tok/s)",
+               (long long) g_tokens.n_tokens, (long long) g_tokens.n_docs, load_s,
+               load_s > 0 ? g_tokens.n_tokens / load_s : 0.0);
+    }
+}
+
+// ============================================
+// Train: Set Training Data
+// ============================================
+std::string train_set_training_data(const std::string & training_text) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_context) {
+        return "ERROR: Context not initialized";
+    }
+
+    reset_data();
+
+    ui_log("Training text: %zu chars", training_text.length());
+
+    if (!g_token_cache_dir.empty()) {
+        int64_t t_start = ggml_time_us();
+        bool from_cache = false;
+        std::string error;
+        if (!dataset_load_text(llama_model_get_vocab(g_model), nullptr, training_text, false, g_token_cache_dir,
+                               llama_n_threads(g_context), &g_tokens, &from_cache, &error)) {
+            return "ERROR: " + error;
+        }
+        log_tokens(from_cache, t_start);
+        return plan_dataset(g_tokens);
+    }
+
+    g_token_store.tokens = common_tokenize(g_context, training_text, true);
+    ui_log("Tokenized: %zu tokens", g_token_store.tokens.size());
+
+    return plan_dataset(data_tokens());
+}
+
+// Helper: JSON string literal
+static std::string json_quote(const std::string & in) {
+    std::string out = "\"";
+    char hex[8];
+    for (char c : in) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    snprintf(hex, sizeof(hex), "\\u%04x", (unsigned) c);
+                    out += hex;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// ============================================
+// Train: Set chat training data (instruction tuning)
+// ============================================
+std::string train_set_chat_data(const std::vector<std::string> & roles,
+                                const std::vector<std::string> & contents,
+                                const std::vector<int> & turns_per_conversation) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_context || !g_model) {
+        return "ERROR: Context not initialized";
+    }
+    if (roles.size() != contents.size()) {
+        return "ERROR: roles and contents differ in length";
+    }
+
+    const char * tmpl = llama_model_chat_template(g_model, nullptr);
+    if (!tmpl) {
+        return "ERROR: Model has no chat template";
+    }
+
+    reset_data();
+
+    // One JSONL "messages" record per conversation: the same path as a .jsonl training file
+    std::string records;
+    size_t next = 0;
+    for (int n_turns : turns_per_conversation) {
+        if (n_turns <= 0) continue;
+        if (next + (size_t) n_turns > roles.size()) {
+            return "ERROR: turns_per_conversation exceeds the number of messages";
+        }
+        records += "{\"messages\":[";
+        for (int i = 0; i < n_turns; i++, next++) {
+            if (i > 0) records += ",";
+            records += "{\"role\":" + json_quote(roles[next]) + ",\"content\":" + json_quote(contents[next]) + "}";
+        }
+        records += "]}\n";
+    }
+    ui_log("Chat data: %zu messages in %zu conversations", next, turns_per_conversation.size());
+
+    int64_t t_start = ggml_time_us();
+    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+    std::string error;
+    if (!g_token_cache_dir.empty()) {
+        bool from_cache = false;
+        if (!dataset_load_text(vocab, tmpl, records, true, g_token_cache_dir,
+                               llama_n_threads(g_context), &g_tokens, &from_cache, &error)) {
+            return "ERROR: " + error;
+        }
+        log_tokens(from_cache, t_start);
+        return plan_dataset(g_tokens);
+    }
+
+    if (!dataset_tokenize_text(vocab, tmpl, records, true, llama_n_threads(g_context), &g_token_store, &error)) {
+        return "ERROR: " + error;
+    }
+    ui_log("Tokenized: %zu tokens, %zu conversations in %.1fs", g_token_store.tokens.size(),
+           g_token_store.doc_starts.size(), (double) (ggml_time_us() - t_start) / 1e6);
+    return plan_dataset(data_tokens());
+}
+
+// ============================================
+// Train: Token cache for setTrainingData
+// ============================================
+void train_set_token_cache_dir(const std::string & dir) {
+    g_token_cache_dir = dir;
+    ui_log("Token cache: %s", dir.empty() ? "off" : dir.c_str());
+}
+
+// ============================================
+// Train: Steps per epoch
+// ============================================
+void train_set_steps_per_epoch(int steps) {
+    if (worker_busy()) { ui_log("setStepsPerEpoch: training worker is running, ignored"); return; }
+    g_steps_per_epoch = std::max(0, steps);
+    if (g_steps_per_epoch > 0) {
+        ui_log("Steps per epoch: %d (windows sampled with replacement)", g_steps_per_epoch);
+    } else {
+        ui_log("Steps per epoch: one pass over the training windows");
+    }
+}
+
+// ============================================
+// Train: Micro-batch size for the next loadModel
+// ============================================
+void train_set_micro_batch(int n_tokens) {
+    g_micro_batch = std::max(0, n_tokens);
+    if (g_micro_batch > 0) {
+        ui_log("Micro-batch: %d tokens (applies at the next model load)", g_micro_batch);
+    } else {
+        ui_log("Micro-batch: whole window");
+    }
+}
+
+// ============================================
+// Train: QLoRA / KV cache precision for the next loadModel
+// ============================================
+void train_set_qlora(bool quantized_base, bool f16_kv) {
+    g_qlora  = quantized_base;
+    g_f16_kv = f16_kv;
+    ui_log("Base weights: %s, KV cache: %s (applies at the next model load)",
+           quantized_base ? "mapped, GGUF types (QLoRA)" : "loaded into RAM",
+           f16_kv ? "F16" : "F32");
+}
+
+// ============================================
+// Train: Sequence packing for the next setTrainingData / setTrainingFile
+// ============================================
+void train_set_packing(bool enabled) {
+    g_packing = enabled;
+    ui_log("Sequence packing: %s", enabled ? "on (whole documents, no overlap)" : "off (stride n_ctx/2)");
+}
+
+// ============================================
+// Train: Thread governor (thermal + throughput)
+// ============================================
+// Long runs on phones throttle, and a throttled SoC often trains as fast on fewer threads.
+// Every interval (>= GOV_MIN_BATCHES train batches, whole windows so the AdamW steps count
+// evenly) the governor measures tokens/s and the hottest thermal zone, then:
+//   hot (>= max temp)          one thread fewer
+//   every GOV_PROBE_EVERY      one interval on a neighbouring count: fewer when warm, else
+//                              alternately more / fewer. Kept when more is > 3% faster or
+//                              fewer is < 2% slower (same work, less heat), else reverted.
+// Counts stay within [1, threads at loadModel] and change between batches.
+#define GOV_MIN_BATCHES    8
+#define GOV_PROBE_EVERY    4
+#define GOV_DEFAULT_MAX_C  75.0f
+#define GOV_WARM_MARGIN_C  5.0f
+
+static bool                         g_gov_enabled = false;
+static std::string                  g_gov_root = "/sys/class/thermal";
+static float                        g_gov_max_c = GOV_DEFAULT_MAX_C;
+static std::vector<std::string>     g_gov_zones;            // <root>/thermal_zoneN/temp
+static int                          g_gov_max_threads = 0;  // Threads at loadModel (0 = no model)
+static int                          g_gov_threads = 0;      // Current thread count
+static float                        g_gov_temp_c = -1.0f;   // Last reading, < 0 = no zone
+static int64_t                      g_gov_t_start = 0;      // Current interval: start ...
+static int64_t                      g_gov_paused0 = 0;      // ... g_paused_us at its start
+static int64_t                      g_gov_n_batches = 0;    // ... batches measured so far
+static int64_t                      g_gov_interval = 0;     // Batches per interval
+static int                          g_gov_since_probe = 0;  // Intervals since the last probe
+static int                          g_gov_probe_from = 0;   // Probing: count before it, 0 = not probing
+static double                       g_gov_probe_base = 0.0; // Probing: tokens/s before it
+static bool                         g_gov_probe_up = true;  // Direction of the next cool probe
+
+// CPU zones when the tree names any (type contains "cpu"), otherwise every zone
+static void governor_find_zones() {
+    g_gov_zones.clear();
+    std::vector<std::string> all, cpu;
+    DIR * dir = opendir(g_gov_root.c_str());
+    if (dir) {
+        while (dirent * entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "thermal_zone", 12) != 0) continue;
+            const std::string zone = g_gov_root + "/" + entry->d_name;
+            char type[64] = {};
+            if (FILE * f = fopen((zone + "/type").c_str(), "r")) {
+                if (!fgets(type, sizeof(type), f)) type[0] = 0;
+                fclose(f);
+            }
+            for (char * c = type; *c; c++) *c = (char) tolower((unsigned char) *c);
+            all.push_back(zone + "/temp");
+            if (strstr(type, "cpu")) cpu.push_back(zone + "/temp");
+        }
+        closedir(dir);
+    }
+    g_gov_zones = cpu.empty() ? all : cpu;
+    std::sort(g_gov_zones.begin(), g_gov_zones.end());
+}
+
+// Hottest zone in °C (sysfs reports millidegrees), -1 without a readable zone
+static float governor_read_temp() {
+    float max_c = -1.0f;
+    for (const std::string & path : g_gov_zones) {
+        FILE * f = fopen(path.c_str(), "r");
+        if (!f) continue;
+        long value = 0;
+        if (fscanf(f, "%ld", &value) == 1) {
+            max_c = std::max(max_c, value > 1000 ? value / 1000.0f : (float) value);
+        }
+        fclose(f);
+    }
+    return max_c;
+}
+
+// Takes effect with the next graph the context computes
+static void governor_set_threads(int n_threads) {
+    g_gov_threads = n_threads;
+    if (g_context) llama_set_n_threads(g_context, n_threads, n_threads);
+}
+
+static void governor_decide(double tok_s) {
+    if (g_gov_probe_from > 0) {
+        const bool more = g_gov_threads > g_gov_probe_from;
+        const bool keep = more ? tok_s > g_gov_probe_base * 1.03 : tok_s >= g_gov_probe_base * 0.98;
+        ui_log("Governor: %d threads %.1f tok/s vs %d threads %.1f tok/s -> %s %d",
+               g_gov_threads, tok_s, g_gov_probe_from, g_gov_probe_base,
+               keep ? "keep" : "back to", keep ? g_gov_threads : g_gov_probe_from);
+        if (!keep) governor_set_threads(g_gov_probe_from);
+        g_gov_probe_from  = 0;
+        g_gov_since_probe = 0;
+        return;
+    }
+
+    if (g_gov_temp_c >= g_gov_max_c && g_gov_threads > 1) {
+        ui_log("Governor: %.1f C >= %.1f C, %d -> %d threads (%.1f tok/s)",
+               g_gov_temp_c, g_gov_max_c, g_gov_threads, g_gov_threads - 1, tok_s);
+        governor_set_threads(g_gov_threads - 1);
+        g_gov_since_probe = 0;
+        return;
+    }
+
+    if (++g_gov_since_probe < GOV_PROBE_EVERY) return;
+    g_gov_since_probe = 0;
+
+    int target = g_gov_threads - 1;
+    if (g_gov_temp_c < g_gov_max_c - GOV_WARM_MARGIN_C) {
+        target = g_gov_probe_up ? g_gov_threads + 1 : g_gov_threads - 1;
+        if (target > g_gov_max_threads) target = g_gov_threads - 1;
+        if (target < 1)                 target = g_gov_threads + 1;
+        g_gov_probe_up = !g_gov_probe_up;
+    }
+    if (target < 1 || target > g_gov_max_threads) return;
+
+    g_gov_probe_from = g_gov_threads;
+    g_gov_probe_base = tok_s;
+    governor_set_threads(target);
+}
+
+// New context (n_threads from loadModel is the ceiling), or none (0)
+static void governor_reset(int n_threads) {
+    g_gov_max_threads = n_threads;
+    g_gov_threads     = n_threads;
+    g_gov_t_start     = 0;
+    g_gov_probe_from  = 0;
+}
+
+// End of the train phase: a probe cut short by it proves nothing, so it's undone
+static void governor_end_phase() {
+    if (g_gov_probe_from > 0) governor_set_threads(g_gov_probe_from);
+    g_gov_probe_from = 0;
+    g_gov_t_start    = 0;
+}
+
+// Train batches only; the first of each epoch includes graph / buffer setup and isn't measured
+static void governor_on_batch(int64_t ibatch) {
+    if (!g_gov_enabled || g_gov_max_threads == 0) return;
+
+    const int64_t now = ggml_time_us();
+    if (ibatch == 0 || g_gov_t_start == 0) {
+        const int64_t n_accum = g_epoch_stats.n_ubatch > 0 ? g_epoch_stats.n_ctx / g_epoch_stats.n_ubatch : 1;
+        g_gov_interval  = (GOV_MIN_BATCHES + n_accum - 1) / n_accum * n_accum;
+        g_gov_t_start   = now;
+        g_gov_paused0   = g_paused_us;
+        g_gov_n_batches = 0;
+        return;
+    }
+    if (++g_gov_n_batches < g_gov_interval) return;
+
+    const double s = (double) (now - g_gov_t_start - (g_paused_us - g_gov_paused0)) / 1e6;
+    const double tok_s = s > 0 ? (double) (g_gov_n_batches * g_epoch_stats.n_ubatch) / s : 0.0;
+    g_gov_t_start   = now;
+    g_gov_paused0   = g_paused_us;
+    g_gov_n_batches = 0;
+
+    g_gov_temp_c = governor_read_temp();
+    governor_decide(tok_s);
+}
+
+// Between loadModel's count and 1; back to loadModel's count when disabled
+void train_set_thread_governor(bool enabled, const std::string & thermal_root, float max_temp_c) {
+    if (worker_busy()) { ui_log("setThreadGovernor: training worker is running, ignored"); return; }
+    g_gov_enabled    = enabled;
+    g_gov_root       = thermal_root.empty() ? "/sys/class/thermal" : thermal_root;
+    g_gov_max_c      = max_temp_c > 0.0f ? max_temp_c : GOV_DEFAULT_MAX_C;
+    g_gov_t_start    = 0;
+    g_gov_probe_from = 0;
+    g_gov_temp_c     = -1.0f;
+
+    if (!enabled) {
+        if (g_context && g_gov_max_threads > 0 && g_gov_threads != g_gov_max_threads) {
+            governor_set_threads(g_gov_max_threads);
+        }
+        ui_log("Thread governor: off");
+        return;
+    }
+
+    governor_find_zones();
+    g_gov_temp_c = governor_read_temp();
+    if (g_gov_zones.empty()) {
+        ui_log("Thread governor: no thermal zones under %s, throughput only", g_gov_root.c_str());
+    } else {
+        ui_log("Thread governor: %zu zone(s) under %s, now %.1f C, limit %.1f C",
+               g_gov_zones.size(), g_gov_root.c_str(), g_gov_temp_c, g_gov_max_c);
+    }
+}
+
+// ============================================
+// Train: Set Training Data from a file (text or JSONL)
+// ============================================
+std::string train_set_training_file(const std::string & path, const std::string & token_path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_context || !g_model) {
+        return "ERROR: Context not initialized";
+    }
+
+    reset_data();
+
+    const std::string cache_path = token_path.empty() ? path + ".tokens" : token_path;
+    int64_t t_start = ggml_time_us();
+
+    // Reuses cache_path when it was tokenized from this exact file with this vocab
+    bool from_cache = false;
+    std::string error;
+    if (!dataset_load_file(llama_model_get_vocab(g_model), llama_model_chat_template(g_model, nullptr), path, cache_path,
+                           llama_n_threads(g_context), &g_tokens, &from_cache, &error)) {
+        return "ERROR: " + error;
+    }
+    log_tokens(from_cache, t_start);
+
+    // Windows are copied straight out of the mapped cache, one epoch at a time
+    std::string result = plan_dataset(g_tokens);
+    if (from_cache && result.compare(0, 6, "ERROR:") != 0) result += " (cached)";
+    return result;
+}
+
+// ============================================
+// Train: Checkpoints (adapter + training position, one GGUF)
+// ============================================
+#define TRAIN_CHECKPOINT_VERSION 1
+#define RESUME_WARMUP_STEPS      16   // LR ramp after a resume (see train_opt_pars)
+
+// Training position and schedule, captured on the training thread
+struct checkpoint_info {
+    int      epoch;
+    int64_t  step;
+    lr_opt   lr;
+    int      steps_per_epoch;
+    uint32_t n_ctx;
+    uint64_t n_train_windows;
+    uint64_t n_tokens;
+};
+
+// Windows one epoch trains (see train_epoch)
+static int64_t epoch_steps() {
+    return g_steps_per_epoch > 0 ? g_steps_per_epoch : g_plan_train.n_windows();
+}
+
+static checkpoint_info checkpoint_capture() {
+    checkpoint_info info;
+    info.epoch           = g_pos_epoch;
+    info.step            = g_pos_step;
+    if (info.step >= epoch_steps()) {
+        // Every window trained (cancelled during eval, or killed before the epoch-end save):
+        // a resume starts the next epoch rather than an empty training phase
+        info.epoch++;
+        info.step = 0;
+    }
+    info.lr              = g_lr;
+    info.steps_per_epoch = g_steps_per_epoch;
+    info.n_ctx           = llama_n_ctx(g_context);
+    info.n_train_windows = (uint64_t) g_plan_train.n_windows();
+    info.n_tokens        = (uint64_t) data_tokens().n_tokens;
+    return info;
+}
+
+static void checkpoint_set_kv(gguf_context * out, const checkpoint_info & info) {
+    gguf_set_val_u32(out, "training.checkpoint_version", TRAIN_CHECKPOINT_VERSION);
+    gguf_set_val_u32(out, "training.epoch", (uint32_t) info.epoch);
+    gguf_set_val_u64(out, "training.step", (uint64_t) info.step);
+    gguf_set_val_f32(out, "training.lr.lr0", info.lr.lr0);
+    gguf_set_val_f32(out, "training.lr.lr_min", info.lr.lr_min);
+    gguf_set_val_f32(out, "training.lr.decay_epochs", info.lr.decay_epochs);
+    gguf_set_val_f32(out, "training.lr.wd", info.lr.wd);
+    gguf_set_val_u32(out, "training.lr.epochs", info.lr.epochs);
+    gguf_set_val_i32(out, "training.steps_per_epoch", info.steps_per_epoch);
+    gguf_set_val_u32(out, "training.n_ctx", info.n_ctx);
+    gguf_set_val_u64(out, "training.n_train_windows", info.n_train_windows);
+    gguf_set_val_u64(out, "training.n_tokens", info.n_tokens);
+}
+
+// Writes out to path + ".tmp", fsyncs it and renames it over path, so the file at path is
+// always a complete checkpoint
+static bool checkpoint_commit(const gguf_context * out, const std::string & path) {
+    const std::string tmp = path + ".tmp";
+    bool ok = gguf_write_to_file(out, tmp.c_str(), false);
+    if (ok) {
+        FILE * f = fopen(tmp.c_str(), "rb");
+        ok = f && fsync(fileno(f)) == 0;
+        if (f) fclose(f);
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Synchronous checkpoint: the adapter GGUF as llama_lora_save_adapter writes it, plus
+// training.* KVs. Still loads as a plain adapter.
+static bool write_checkpoint(const std::string & path) {
+    if (!g_adapter || !g_context) return false;
+    int64_t t_start = ggml_time_us();
+
+    const std::string adapter_tmp = path + ".adapter.tmp";
+    if (llama_lora_save_adapter(g_adapter, adapter_tmp.c_str()) != 0) {
+        ui_log("Checkpoint: failed to write adapter to %s", adapter_tmp.c_str());
+        return false;
+    }
+
+    ggml_context * data = nullptr;
+    gguf_context * in = gguf_init_from_file(adapter_tmp.c_str(), { /*no_alloc*/ false, &data });
+    if (!in) {
+        remove(adapter_tmp.c_str());
+        ui_log("Checkpoint: failed to read back %s", adapter_tmp.c_str());
+        return false;
+    }
+
+    gguf_context * out = gguf_init_empty();
+    gguf_set_kv(out, in);
+    checkpoint_set_kv(out, checkpoint_capture());
+    const int64_t n_tensors = gguf_get_n_tensors(in);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        gguf_add_tensor(out, ggml_get_tensor(data, gguf_get_tensor_name(in, i)));
+    }
+
+    bool ok = checkpoint_commit(out, path);
+    gguf_free(out);
+    gguf_free(in);
+    ggml_free(data);
+    remove(adapter_tmp.c_str());
+    if (!ok) {
+        ui_log("Checkpoint: failed to write %s", path.c_str());
+        return false;
+    }
+
+    ui_log("Checkpoint: epoch %d, step %lld -> %s (%.0f ms)", g_pos_epoch + 1, (long long) g_pos_step,
+           path.c_str(), (double) (ggml_time_us() - t_start) / 1e3);
+    return true;
+}
+
+// ============================================
+// Train: Background checkpoint writer
+// ============================================
+// Periodic checkpoints after the first are written off the training thread. Between
+// batches the trainer only copies the LoRA tensors into a staging slot (pre-allocated, two
+// of them: one can fill while the other is being written); the writer thread builds the
+// GGUF from the first checkpoint's metadata, writes, fsyncs and renames it. A newer
+// snapshot replaces a queued one that the writer hasn't started yet.
+// Only the LoRA tensors are staged: ggml-opt keeps the AdamW moments private (see
+// train_resume_training), so there is no optimizer state to copy alongside them.
+struct checkpoint_slot {
+    std::vector<uint8_t> data;   // Tensors in layout order
+    checkpoint_info      info;
+    std::string          path;
+};
+
+static gguf_context               * g_ckpt_layout      = nullptr; // KVs + tensor infos of the first checkpoint
+static ggml_context               * g_ckpt_layout_meta = nullptr;
+static std::vector<ggml_tensor *>   g_ckpt_tensors;       // Live LoRA tensors, in layout order
+static std::vector<size_t>          g_ckpt_offsets;       // Their offsets in a slot
+static checkpoint_slot              g_ckpt_slots[2];
+static int                          g_ckpt_pending = -1;  // Slot queued for the writer
+static int                          g_ckpt_busy    = -1;  // Slot being written
+static bool                         g_ckpt_stop    = false;
+static std::thread                  g_ckpt_thread;
+static std::mutex                   g_ckpt_mutex;
+static std::condition_variable      g_ckpt_cv;
+
+static void checkpoint_writer() {
+    std::unique_lock<std::mutex> lock(g_ckpt_mutex);
+    while (true) {
+        g_ckpt_cv.wait(lock, [] { return g_ckpt_stop || g_ckpt_pending >= 0; });
+        if (g_ckpt_pending < 0) break;   // Stopping, nothing queued
+        g_ckpt_busy    = g_ckpt_pending;
+        g_ckpt_pending = -1;
+        const checkpoint_slot & slot = g_ckpt_slots[g_ckpt_busy];
+        lock.unlock();
+
+        int64_t t_start = ggml_time_us();
+        gguf_context * out = gguf_init_empty();
+        gguf_set_kv(out, g_ckpt_layout);
+        checkpoint_set_kv(out, slot.info);
+        for (size_t i = 0; i < g_ckpt_tensors.size(); i++) {
+            const char * name = gguf_get_tensor_name(g_ckpt_layout, (int64_t) i);
+            gguf_add_tensor(out, ggml_get_tensor(g_ckpt_layout_meta, name));
+            gguf_set_tensor_data(out, name, slot.data.data() + g_ckpt_offsets[i]);
+        }
+        bool ok = checkpoint_commit(out, slot.path);
+        gguf_free(out);
+        if (ok) {
+            ui_log("Checkpoint: epoch %d, step %lld -> %s (%.0f ms, background)", slot.info.epoch + 1,
+                   (long long) slot.info.step, slot.path.c_str(), (double) (ggml_time_us() - t_start) / 1e3);
+        } else {
+            ui_log("Checkpoint: failed to write %s", slot.path.c_str());
+        }
+
+        lock.lock();
+        g_ckpt_busy = -1;
+        g_ckpt_cv.notify_all();
+    }
+}
+
+// Waits for queued checkpoints to reach the disk
+static void checkpoint_flush() {
+    std::unique_lock<std::mutex> lock(g_ckpt_mutex);
+    g_ckpt_cv.wait(lock, [] { return g_ckpt_pending < 0 && g_ckpt_busy < 0; });
+}
+
+// Stops the writer (after the queue drains) and forgets the layout — the adapter changed
+static void checkpoint_reset() {
+    if (g_ckpt_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(g_ckpt_mutex);
+            g_ckpt_stop = true;
+        }
+        g_ckpt_cv.notify_all();
+        g_ckpt_thread.join();
+        g_ckpt_stop = false;
+    }
+    if (g_ckpt_layout)      { gguf_free(g_ckpt_layout); g_ckpt_layout = nullptr; }
+    if (g_ckpt_layout_meta) { ggml_free(g_ckpt_layout_meta); g_ckpt_layout_meta = nullptr; }
+    g_ckpt_tensors.clear();
+    g_ckpt_offsets.clear();
+    for (auto & slot : g_ckpt_slots) slot = checkpoint_slot();
+}
+
+// Matches the checkpoint's tensors with the trainable (PARAM) tensors of the training graph
+// and allocates the staging slots. False = stay synchronous.
+static bool checkpoint_init_staging(ggml_opt_context_t opt_ctx, const std::string & path) {
+    gguf_context * layout = gguf_init_from_file(path.c_str(), { /*no_alloc*/ true, &g_ckpt_layout_meta });
+    if (!layout) return false;
+    g_ckpt_layout = layout;
+
+    // The LoRA tensors are the graph's parameters (llama_opt_param_filter_lora)
+    std::vector<ggml_tensor *> stack = { ggml_opt_loss(opt_ctx) };
+    std::unordered_set<ggml_tensor *> seen;
+    std::unordered_map<std::string, ggml_tensor *> params;
+    while (!stack.empty()) {
+        ggml_tensor * t = stack.back();
+        stack.pop_back();
+        if (!t || !seen.insert(t).second) continue;
+        if (t->flags & GGML_TENSOR_FLAG_PARAM) params[t->name] = t;
+        for (int i = 0; i < GGML_MAX_SRC; i++) stack.push_back(t->src[i]);
+        stack.push_back(t->view_src);
+    }
+
+    size_t size = 0;
+    const int64_t n_tensors = gguf_get_n_tensors(layout);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const char * name = gguf_get_tensor_name(layout, i);
+        auto it = params.find(name);
+        if (it == params.end() || ggml_nbytes(it->second) != gguf_get_tensor_size(layout, i) ||
+            it->second->type != gguf_get_tensor_type(layout, i)) {
+            // The layout stays set, so this isn't retried: checkpoints remain synchronous
+            ui_log("Checkpoint: %s not found as a trainable tensor, background writes off", name);
+            g_ckpt_tensors.clear();
+            g_ckpt_offsets.clear();
+            return false;
+        }
+        g_ckpt_tensors.push_back(it->second);
+        g_ckpt_offsets.push_back(size);
+        size += GGML_PAD(ggml_nbytes(it->second), 32);
+    }
+    for (auto & slot : g_ckpt_slots) slot.data.resize(size);
+
+    g_ckpt_thread = std::thread(checkpoint_writer);
+    ui_log("Checkpoint: %lld tensors, 2 x %.1f MB staging, background writer started",
+           (long long) n_tensors, size / 1024.0 / 1024.0);
+    return true;
+}
+
+// Copies the adapter into a free slot and queues it — the only checkpoint cost on the
+// training thread
+static void checkpoint_enqueue(const std::string & path) {
+    int64_t t_start = ggml_time_us();
+    int s;
+    {
+        std::lock_guard<std::mutex> lock(g_ckpt_mutex);
+        s = g_ckpt_busy == 0 ? 1 : 0;
+        if (g_ckpt_pending == s) g_ckpt_pending = -1;   // Superseded before it was written
+    }
+    checkpoint_slot & slot = g_ckpt_slots[s];
+    for (size_t i = 0; i < g_ckpt_tensors.size(); i++) {
+        ggml_backend_tensor_get(g_ckpt_tensors[i], slot.data.data() + g_ckpt_offsets[i], 0,
+                                ggml_nbytes(g_ckpt_tensors[i]));
+    }
+    slot.info = checkpoint_capture();
+    slot.path = path;
+    {
+        std::lock_guard<std::mutex> lock(g_ckpt_mutex);
+        g_ckpt_pending = s;
+    }
+    g_ckpt_cv.notify_all();
+    ui_log("Checkpoint: step %lld staged (%.1f ms)", (long long) g_pos_step, (double) (ggml_time_us() - t_start) / 1e3);
+}
+
+static void checkpoint_after_step(ggml_opt_context_t opt_ctx, int64_t step) {
+    g_pos_step = g_step_offset + step;
+    g_progress_step = g_pos_step;
+    if (g_ckpt_every <= 0 || g_ckpt_path.empty() || g_pos_step % g_ckpt_every != 0) return;
+
+    if (g_ckpt_thread.joinable()) {
+        checkpoint_enqueue(g_ckpt_path);
+    } else if (write_checkpoint(g_ckpt_path) && !g_ckpt_layout) {
+        // First one is synchronous; its layout makes the rest a copy + background write
+        checkpoint_init_staging(opt_ctx, g_ckpt_path);
+    }
+}
+
+void train_set_checkpoint(const std::string & path, int every_n_steps) {
+    if (worker_busy()) { ui_log("setCheckpoint: training worker is running, ignored"); return; }
+    g_ckpt_path  = path;
+    g_ckpt_every = path.empty() ? 0 : std::max(0, every_n_steps);
+    if (g_ckpt_every > 0) {
+        ui_log("Checkpoints: every %d steps and after each epoch -> %s", g_ckpt_every, path.c_str());
+    } else {
+        ui_log("Checkpoints: off");
+    }
+}
+
+std::string train_save_checkpoint(const std::string & path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_adapter) {
+        return "ERROR: No adapter to save";
+    }
+    checkpoint_flush();
+    if (!write_checkpoint(path)) {
+        return "ERROR: Failed to write checkpoint " + path;
+    }
+    return "Checkpoint: epoch " + std::to_string(g_pos_epoch + 1) + ", step " + std::to_string(g_pos_step);
+}
+
+std::string train_resume_training(const std::string & path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+    if (g_plan_train.n_windows() == 0) {
+        return "ERROR: Set the training data before resuming";
+    }
+
+    gguf_context * meta = gguf_init_from_file(path.c_str(), { /*no_alloc*/ true, nullptr });
+    if (!meta) {
+        return "ERROR: Failed to read checkpoint " + path;
+    }
+    auto key = [&](const char * name) { return gguf_find_key(meta, name); };
+    if (key("training.checkpoint_version") < 0 ||
+        gguf_get_val_u32(meta, key("training.checkpoint_version")) != TRAIN_CHECKPOINT_VERSION) {
+        gguf_free(meta);
+        return "ERROR: Not a training checkpoint (or an unsupported version): " + path;
+    }
+
+    // The data cursor only means something for the same windows
+    const uint32_t n_ctx     = gguf_get_val_u32(meta, key("training.n_ctx"));
+    const uint64_t n_windows = gguf_get_val_u64(meta, key("training.n_train_windows"));
+    const uint64_t n_tokens  = gguf_get_val_u64(meta, key("training.n_tokens"));
+    if (n_ctx != llama_n_ctx(g_context) || n_windows != (uint64_t) g_plan_train.n_windows() ||
+        n_tokens != (uint64_t) data_tokens().n_tokens) {
+        gguf_free(meta);
+        return "ERROR: Checkpoint was taken with different training data or context size";
+    }
+
+    int     epoch = (int) gguf_get_val_u32(meta, key("training.epoch"));
+    int64_t step  = (int64_t) gguf_get_val_u64(meta, key("training.step"));
+    g_lr.lr0          = gguf_get_val_f32(meta, key("training.lr.lr0"));
+    g_lr.lr_min       = gguf_get_val_f32(meta, key("training.lr.lr_min"));
+    g_lr.decay_epochs = gguf_get_val_f32(meta, key("training.lr.decay_epochs"));
+    g_lr.wd           = gguf_get_val_f32(meta, key("training.lr.wd"));
+    g_lr.epochs       = gguf_get_val_u32(meta, key("training.lr.epochs"));
+    g_steps_per_epoch = gguf_get_val_i32(meta, key("training.steps_per_epoch"));
+    gguf_free(meta);
+    if (step >= epoch_steps()) {   // Older checkpoints may hold a finished epoch's last step
+        epoch++;
+        step = 0;
+    }
+
+    std::string result = train_load_lora_adapter(path);
+    if (result.compare(0, 6, "ERROR:") == 0) return result;
+
+    g_resume_epoch = epoch;
+    g_resume_step  = step;
+    g_pos_epoch    = epoch;
+    g_pos_step     = step;
+    g_resume_warmup = RESUME_WARMUP_STEPS;
+    ui_log("Resume: epoch %d, step %lld (AdamW state not in the checkpoint: restarts from zero, "
+           "LR ramped over %d steps)", epoch + 1, (long long) step, RESUME_WARMUP_STEPS);
+
+    return "Resumed: epoch " + std::to_string(epoch + 1) + ", step " + std::to_string(step) +
+           " (optimizer state restarted)";
+}
+
+int train_get_resume_epoch() {
+    return g_resume_epoch;
+}
+
+// Optimizer params, fetched by ggml-opt for each optimizer step: the LR schedule, ramped up
+// linearly over the first RESUME_WARMUP_STEPS steps after a resume. With the AdamW moments
+// restarted, those first updates are close to sign steps (m / sqrt(v) ~ +-1 per weight), which
+// at the full LR kick the adapter away from where the checkpoint left it.
+static struct ggml_opt_optimizer_params train_opt_pars(void * userdata) {
+    struct ggml_opt_optimizer_params pars = common_opt_lr_pars(userdata);
+    if (g_resume_warmup > 0) {
+        const float scale = (float) (RESUME_WARMUP_STEPS - g_resume_warmup + 1) / (RESUME_WARMUP_STEPS + 1);
+        pars.adamw.alpha *= scale;
+        pars.sgd.alpha   *= scale;
+        g_resume_warmup--;
+    }
+    return pars;
+}
+
+// ============================================
+// Train: Init Training
+// ============================================
+std::string train_init_training(float learningRate, int epochs) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_context || !g_model || !g_adapter) {
+        return "ERROR: Model, context, or adapter not ready";
+    }
+
+    if (g_resume_epoch >= 0) {
+        // Resuming: the checkpoint's schedule, so the LR continues where it stopped
+        ui_log("Initializing AdamW optimizer (LR schedule from checkpoint: lr=%.6f, epochs=%u)...",
+               (double) g_lr.lr0, g_lr.epochs);
+    } else {
+        ui_log("Initializing AdamW optimizer (lr=%.6f, epochs=%d)...", (double) learningRate, epochs);
+
+        g_lr.lr0    = learningRate;
+        g_lr.lr_min = learningRate * 0.1f;
+        g_lr.epochs = (unsigned) epochs;
+        g_lr.wd     = 0.0f;
+        g_lr.decay_epochs = -1;
+        g_resume_warmup = 0;
+    }
+    g_lr.init();
+
+    struct llama_opt_params lopt_params {
+        /*n_ctx_train     =*/ 0,
+        /*param_filter    =*/ llama_opt_param_filter_lora,
+        /*param_filter_ud =*/ nullptr,
+        /*get_opt_pars    =*/ train_opt_pars,
+        /*get_opt_pars_ud =*/ &g_lr,
+        /*optimizer_type  =*/ GGML_OPT_OPTIMIZER_TYPE_ADAMW,
+    };
+    llama_opt_init(g_context, g_model, lopt_params);
+
+    ui_log("Optimizer ready. Training only LoRA A/B tensors (base model frozen).");
+
+    const int n_accum = (int) (llama_n_ctx(g_context) / llama_n_ubatch(g_context));
+    if (n_accum > 1) {
+        ui_log("Gradient accumulation: optimizer step every %d micro-batches of %u tokens",
+               n_accum, llama_n_ubatch(g_context));
+    }
+
+    std::string result = "Optimizer: AdamW | LR: " + std::to_string(learningRate);
+    if (n_accum > 1) result += " | Accumulation: " + std::to_string(n_accum) + " micro-batches";
+    return result;
+}
+
+// ============================================
+// Train: Train Epoch
+// ============================================
+std::string train_epoch(int epochIndex) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_context || g_plan_train.n_windows() == 0) {
+        return "ERROR: Training not initialized";
+    }
+
+    g_lr.epoch = (unsigned) epochIndex;
+
+    // This epoch's windows: every train window once in order, or g_steps_per_epoch windows
+    // sampled with replacement (seeded by the epoch, so a rerun sees the same batches)
+    std::vector<int64_t> train_windows;
+    const int64_t n_train_windows = g_plan_train.n_windows();
+    if (g_steps_per_epoch > 0) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL * (uint64_t) (epochIndex + 1);
+        for (int i = 0; i < g_steps_per_epoch; i++) {
+            // splitmix64 — portable, unlike std:: distributions
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            train_windows.push_back((int64_t) (z % (uint64_t) n_train_windows));
+        }
+    } else {
+        for (int64_t i = 0; i < n_train_windows; i++) train_windows.push_back(i);
+    }
+
+    // Resumed mid-epoch: the windows before the checkpoint were already trained
+    g_pos_epoch   = epochIndex;
+    g_step_offset = 0;
+    if (g_resume_epoch == epochIndex) {
+        g_step_offset = std::min((int64_t) train_windows.size(), g_resume_step);
+        train_windows.erase(train_windows.begin(), train_windows.begin() + g_step_offset);
+        ui_log("Resuming epoch %d at step %lld", epochIndex + 1, (long long) g_step_offset);
+    }
+    g_resume_epoch = -1;
+    g_pos_step = g_step_offset;
+
+    if (g_dataset) { ggml_opt_dataset_free(g_dataset); g_dataset = nullptr; }
+    int64_t n_targets = 0;
+    g_dataset = dataset_materialize(data_tokens(), g_eos, llama_n_ctx(g_context),
+                                    g_plan_train, train_windows, g_plan_eval, &n_targets);
+    if (!g_dataset || train_windows.empty()) {
+        if (g_dataset) { ggml_opt_dataset_free(g_dataset); g_dataset = nullptr; }
+        return "ERROR: No training windows left in epoch " + std::to_string(epochIndex + 1);
+    }
+
+    int64_t ndata = ggml_opt_dataset_ndata(g_dataset);
+    int64_t idata_split = (int64_t) train_windows.size();
+    bool has_eval = idata_split < ndata;
+
+    ui_log("========================================");
+    ui_log("=== EPOCH %d START ===", epochIndex + 1);
+    ui_log("========================================");
+    ui_log("Total data points: %lld", (long long) ndata);
+    ui_log("Train split: %lld data points", (long long) idata_split);
+    if (g_tokens.loss_mask || !g_token_store.loss_mask.empty()) {
+        ui_log("Assistant labels: %.1f%% (the loss covers all labels)",
+               100.0 * (double) n_targets / (double) (idata_split * llama_n_ctx(g_context)));
+    }
+    ui_log("Eval split: %lld data points%s", (long long)(ndata - idata_split),
+           has_eval ? "" : " (skipped)");
+    ui_log("Learning rate: %.6f", g_lr.get_lr());
+    ui_log("Building computation graph (forward + backward)...");
+
+    int64_t t_epoch_start = ggml_time_us();
+    g_epoch_stats = train_epoch_stats();
+    g_epoch_stats.n_ctx    = llama_n_ctx(g_context);
+    g_epoch_stats.n_ubatch = llama_n_ubatch(g_context);
+
+    ggml_opt_result_t result_train = ggml_opt_result_init();
+    ggml_opt_result_t result_eval  = has_eval ? ggml_opt_result_init() : nullptr;
+
+    g_progress_step    = g_step_offset;
+    g_progress_n_steps = g_step_offset + idata_split;
+    if (g_progress_epochs_left == 0) g_progress_epochs_left = std::max(0, (int) g_lr.epochs - epochIndex - 1);
+    progress_publish(-1, 0.0, 0.0, 0.0, 0.0);
+
+    ui_log("--- Training phase ---");
+    llama_opt_epoch(g_context, g_dataset,
+                    result_train, result_eval, idata_split,
+                    train_progress_callback, has_eval ? train_progress_callback : nullptr);
+    governor_end_phase();
+
+    if (g_abort.load()) {
+        // Cancelled: the graphs after the request aborted before their first node, so the
+        // adapter holds exactly the completed steps — checkpoint them for a later resume
+        g_abort = false;
+        ggml_opt_result_free(result_train);
+        if (result_eval) ggml_opt_result_free(result_eval);
+        ui_log("=== EPOCH %d CANCELLED at step %lld ===", epochIndex + 1, (long long) g_pos_step);
+        if (!g_ckpt_path.empty()) {
+            checkpoint_flush();
+            write_checkpoint(g_ckpt_path);
+        }
+        return "Cancelled: epoch " + std::to_string(epochIndex + 1) + ", step " + std::to_string(g_pos_step);
+    }
+
+    double train_loss = 0.0, eval_loss = 0.0;
+    ggml_opt_result_loss(result_train, &train_loss, nullptr);
+    if (has_eval && result_eval) {
+        ggml_opt_result_loss(result_eval, &eval_loss, nullptr);
+    }
+
+    double epoch_time_s = (double)(ggml_time_us() - t_epoch_start) / 1e6;
+
+    // Epoch done: a resume from here starts the next one
+    g_pos_epoch = epochIndex + 1;
+    g_pos_step  = 0;
+    if (g_ckpt_every > 0 && !g_ckpt_path.empty()) {
+        if (g_ckpt_thread.joinable()) checkpoint_enqueue(g_ckpt_path);
+        else write_checkpoint(g_ckpt_path);
+    }
+    g_epoch_stats.n_threads = g_gov_threads;
+
+    ggml_opt_result_free(result_train);
+    if (result_eval) ggml_opt_result_free(result_eval);
+
+    ui_log("========================================");
+    ui_log("=== EPOCH %d COMPLETE ===", epochIndex + 1);
+    ui_log("  Train loss: %.4f", train_loss);
+    if (has_eval) {
+        ui_log("  Eval loss:  %.4f", eval_loss);
+    } else {
+        ui_log("  Eval loss:  (skipped — not enough data)");
+    }
+    ui_log("  LR:         %.6f", g_lr.get_lr());
+    ui_log("  Time:       %.1fs", epoch_time_s);
+    if (g_gov_enabled) {
+        ui_log("  Threads:    %d of %d (governor) | %.1f C", g_gov_threads, g_gov_max_threads, g_gov_temp_c);
+    }
+    ui_log("========================================");
+
+    std::string result = "Epoch " + std::to_string(epochIndex + 1);
+    result += " | Train loss: " + std::to_string(train_loss);
+    if (has_eval) {
+        result += " | Eval loss: " + std::to_string(eval_loss);
+    }
+    result += " | Time: " + std::to_string((int) epoch_time_s) + "s";
+    return result;
+}
+
+// ============================================
+// Train: Background worker
+// ============================================
+// Runs train_epoch on its own thread. Commands go through a queue; the progress callback
+// checks an atomic flag between batches and only takes the lock when something is queued.
+// Pause blocks inside the callback; cancel arms the context's abort callback.
+enum worker_cmd_type { WORKER_START, WORKER_PAUSE, WORKER_RESUME, WORKER_CANCEL, WORKER_STOP };
+
+struct worker_cmd {
+    worker_cmd_type type;
+    int             first_epoch;
+    int             n_epochs;
+};
+
+static std::deque<worker_cmd>       g_worker_queue;
+static std::mutex                   g_worker_mutex;
+static std::condition_variable      g_worker_cv;
+static std::thread                  g_worker_thread;
+static std::atomic<int>             g_worker_state{TRAIN_STATE_IDLE};
+static bool                         g_worker_paused = false;   // Worker thread only
+static bool                         g_worker_stop   = false;   // Worker thread only
+static std::string                  g_worker_result;           // Guarded by g_worker_mutex
+
+// Progress snapshot, one writer (the training thread) and any number of readers. Seqlock:
+// the counter is odd while a write is in progress and readers retry on a change, so
+// polling never blocks training and never sees a torn snapshot.
+static std::atomic<uint32_t>        g_progress_seq{0};
+static std::atomic<int>             g_progress_state{TRAIN_STATE_IDLE};
+static std::atomic<int>             g_progress_epoch{0};
+static std::atomic<int64_t>         g_progress_cur_step{0};
+static std::atomic<int64_t>         g_progress_cur_n_steps{0};
+static std::atomic<double>          g_progress_loss{0.0};
+static std::atomic<double>          g_progress_tok_s{0.0};
+static std::atomic<double>          g_progress_elapsed{0.0};
+static std::atomic<double>          g_progress_eta{0.0};
+static std::atomic<int>             g_progress_threads{0};
+static std::atomic<float>           g_progress_temp{-1.0f};
+
+// state < 0 keeps the current state
+static void progress_publish(int state, double loss, double tokens_per_s, double elapsed_s, double eta_s) {
+    const uint32_t seq = g_progress_seq.load(std::memory_order_relaxed);
+    g_progress_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (state >= 0) g_progress_state.store(state, std::memory_order_relaxed);
+    g_progress_epoch.store(g_pos_epoch, std::memory_order_relaxed);
+    g_progress_cur_step.store(g_progress_step, std::memory_order_relaxed);
+    g_progress_cur_n_steps.store(g_progress_n_steps, std::memory_order_relaxed);
+    g_progress_loss.store(loss, std::memory_order_relaxed);
+    g_progress_tok_s.store(tokens_per_s, std::memory_order_relaxed);
+    g_progress_elapsed.store(elapsed_s, std::memory_order_relaxed);
+    g_progress_eta.store(eta_s, std::memory_order_relaxed);
+    g_progress_threads.store(g_gov_threads, std::memory_order_relaxed);
+    g_progress_temp.store(g_gov_temp_c, std::memory_order_relaxed);
+    g_progress_seq.store(seq + 2, std::memory_order_release);
+}
+
+// Worker state change, reflected in the snapshot without touching the numbers (but the
+// thread count, which the governor may have moved back after the last batch)
+static void worker_set_state(int state) {
+    g_worker_state = state;
+    const uint32_t seq = g_progress_seq.load(std::memory_order_relaxed);
+    g_progress_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    g_progress_state.store(state, std::memory_order_relaxed);
+    g_progress_threads.store(g_gov_threads, std::memory_order_relaxed);
+    g_progress_seq.store(seq + 2, std::memory_order_release);
+}
+
+void train_get_progress(train_progress * out) {
+    while (true) {
+        const uint32_t seq = g_progress_seq.load(std::memory_order_acquire);
+        if (seq & 1) continue;
+        out->state        = g_progress_state.load(std::memory_order_relaxed);
+        out->epoch        = g_progress_epoch.load(std::memory_order_relaxed);
+        out->step         = g_progress_cur_step.load(std::memory_order_relaxed);
+        out->n_steps      = g_progress_cur_n_steps.load(std::memory_order_relaxed);
+        out->loss         = g_progress_loss.load(std::memory_order_relaxed);
+        out->tokens_per_s = g_progress_tok_s.load(std::memory_order_relaxed);
+        out->elapsed_s    = g_progress_elapsed.load(std::memory_order_relaxed);
+        out->eta_s        = g_progress_eta.load(std::memory_order_relaxed);
+        out->n_threads    = g_progress_threads.load(std::memory_order_relaxed);
+        out->temp_c       = g_progress_temp.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (g_progress_seq.load(std::memory_order_relaxed) == seq) return;
+    }
+}
+
+static void worker_post(const worker_cmd & cmd) {
+    {
+        std::lock_guard<std::mutex> lock(g_worker_mutex);
+        g_worker_queue.push_back(cmd);
+        g_worker_pending.store(true, std::memory_order_release);
+    }
+    g_worker_cv.notify_all();
+}
+
+// Training thread, between batches
+static void worker_poll_commands() {
+    std::unique_lock<std::mutex> lock(g_worker_mutex);
+    while (true) {
+        while (!g_worker_queue.empty()) {
+            const worker_cmd cmd = g_worker_queue.front();
+            g_worker_queue.pop_front();
+            switch (cmd.type) {
+                case WORKER_PAUSE:  g_worker_paused = true;  break;
+                case WORKER_RESUME: g_worker_paused = false; break;
+                case WORKER_STOP:   g_worker_stop = true;    // fallthrough
+                case WORKER_CANCEL: g_worker_paused = false; g_abort = true; break;
+                case WORKER_START:  ui_log("Worker: already training, start ignored"); break;
+            }
+        }
+        g_worker_pending.store(false, std::memory_order_release);
+        if (!g_worker_paused || g_abort) break;
+
+        worker_set_state(TRAIN_STATE_PAUSED);
+        ui_log("Worker: paused at epoch %d, step %lld", g_pos_epoch + 1, (long long) g_progress_step);
+        int64_t t_pause = ggml_time_us();
+        g_worker_cv.wait(lock, [] { return !g_worker_queue.empty(); });
+        g_paused_us += ggml_time_us() - t_pause;
+        if (g_worker_state == TRAIN_STATE_PAUSED) worker_set_state(TRAIN_STATE_RUNNING);
+    }
+    if (g_abort) {
+        worker_set_state(TRAIN_STATE_CANCELLING);
+    } else if (g_worker_state != TRAIN_STATE_RUNNING) {
+        worker_set_state(TRAIN_STATE_RUNNING);
+        ui_log("Worker: resumed");
+    }
+}
+
+static void worker_run(int first_epoch, int n_epochs) {
+    g_worker_paused = false;
+    worker_set_state(TRAIN_STATE_RUNNING);
+
+    std::string result;
+    int state = TRAIN_STATE_DONE;
+    for (int epoch = first_epoch; epoch < first_epoch + n_epochs; epoch++) {
+        g_progress_epochs_left = first_epoch + n_epochs - epoch - 1;
+        result = train_epoch(epoch);
+        if (result.compare(0, 6, "ERROR:") == 0)  { state = TRAIN_STATE_FAILED;    break; }
+        if (result.compare(0, 10, "Cancelled:") == 0) { state = TRAIN_STATE_CANCELLED; break; }
+    }
+    g_progress_epochs_left = 0;
+
+    {
+        // Result and final state in one hold: a waiter checks the state under this mutex,
+        // so it either sees the final state or is already waiting for the notify
+        std::lock_guard<std::mutex> lock(g_worker_mutex);
+        g_worker_result = result;
+        worker_set_state(state);
+    }
+    g_worker_cv.notify_all();
+}
+
+static void worker_main() {
+    std::unique_lock<std::mutex> lock(g_worker_mutex);
+    while (!g_worker_stop) {
+        g_worker_cv.wait(lock, [] { return !g_worker_queue.empty(); });
+        const worker_cmd cmd = g_worker_queue.front();
+        g_worker_queue.pop_front();
+        g_worker_pending.store(!g_worker_queue.empty(), std::memory_order_release);
+        if (cmd.type == WORKER_STOP) break;
+        if (cmd.type != WORKER_START) continue;   // Pause / resume / cancel with nothing running
+
+        lock.unlock();
+        worker_run(cmd.first_epoch, cmd.n_epochs);
+        lock.lock();
+    }
+    g_worker_stop = false;
+}
+
+std::string train_worker_start(int first_epoch, int n_epochs) {
+    if (!g_context || g_plan_train.n_windows() == 0) {
+        return "ERROR: Training not initialized";
+    }
+    const int state = g_worker_state;
+    if (state == TRAIN_STATE_RUNNING || state == TRAIN_STATE_PAUSED || state == TRAIN_STATE_CANCELLING) {
+        return "ERROR: Training already running";
+    }
+    if (!g_worker_thread.joinable()) g_worker_thread = std::thread(worker_main);
+
+    worker_set_state(TRAIN_STATE_RUNNING);   // Visible right away, before the worker picks it up
+    worker_post({ WORKER_START, first_epoch, std::max(1, n_epochs) });
+    return "Training started: epochs " + std::to_string(first_epoch + 1) + ".." +
+           std::to_string(first_epoch + std::max(1, n_epochs));
+}
+
+// Commands only mean something while a job runs; queued later they'd hit the next one
+static bool worker_active() {
+    const int state = g_worker_state;
+    return g_worker_thread.joinable() &&
+           (state == TRAIN_STATE_RUNNING || state == TRAIN_STATE_PAUSED || state == TRAIN_STATE_CANCELLING);
+}
+
+static bool worker_busy() {
+    return worker_active() && std::this_thread::get_id() != g_worker_thread.get_id();
+}
+
+void train_worker_pause()  { if (worker_active()) worker_post({ WORKER_PAUSE,  0, 0 }); }
+void train_worker_resume() { if (worker_active()) worker_post({ WORKER_RESUME, 0, 0 }); }
+void train_worker_cancel() { if (worker_active()) worker_post({ WORKER_CANCEL, 0, 0 }); }
+
+std::string train_worker_wait() {
+    std::unique_lock<std::mutex> lock(g_worker_mutex);
+    g_worker_cv.wait(lock, [] {
+        const int state = g_worker_state;
+        return state != TRAIN_STATE_RUNNING && state != TRAIN_STATE_PAUSED && state != TRAIN_STATE_CANCELLING;
+    });
+    return g_worker_result;
+}
+
+// Cancels a running job and ends the worker thread
+static void worker_shutdown() {
+    if (!g_worker_thread.joinable()) return;
+    worker_post({ WORKER_STOP, 0, 0 });
+    g_worker_thread.join();
+    std::lock_guard<std::mutex> lock(g_worker_mutex);
+    g_worker_queue.clear();
+    g_worker_pending = false;
+    g_abort = false;
+    g_worker_state = TRAIN_STATE_IDLE;
+}
+
+// ============================================
+// Train: Timing of the last epoch
+// ============================================
+void train_get_epoch_stats(train_epoch_stats * stats) {
+    *stats = g_epoch_stats;
+}
+
+// ============================================
+// Train: Count tokens as setTrainingData tokenizes them
+// ============================================
+int train_count_tokens(const std::string & text) {
+    if (!g_context) return -1;
+    return (int) common_tokenize(g_context, text, true).size();
+}
+
+// ============================================
+// Train: Save LoRA Adapter
+// ============================================
+std::string train_save_lora_adapter(const std::string & output_path) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_adapter) {
+        return "ERROR: No adapter to save";
+    }
+
+    ui_log("Saving LoRA adapter to: %s", output_path.c_str());
+
+    int32_t ret = llama_lora_save_adapter(g_adapter, output_path.c_str());
+    if (ret != 0) {
+        return "ERROR: Failed to save adapter";
+    }
+
+    ui_log("Adapter saved successfully!");
+    return "Saved: " + output_path;
+}
+
+// ============================================
+// Train: Generate text (inference)
+// ============================================
+std::string train_generate(const std::string & prompt, int maxTokens, float temperature) {
+    if (worker_busy()) return WORKER_BUSY;
+    if (!g_model || !g_context) {
+        return "ERROR: Model not loaded";
+    }
+
+    ui_log("Generating: prompt=%zu chars, max_tokens=%d, temp=%.2f",
+           prompt.length(), maxTokens, (double) temperature);
+
+    // Clear KV cache for fresh generation
+    llama_memory_clear(llama_get_memory(g_context), true);
+
+    // Tokenize prompt
+    std::vector<llama_token> tokens = common_tokenize(g_context, prompt, true);
+    ui_log("Prompt tokens: %zu", tokens.size());
+
+    if (tokens.empty()) {
+        return "ERROR: Empty prompt after tokenization";
+    }
+
+    int n_ctx = llama_n_ctx(g_context);
+    if ((int) tokens.size() >= n_ctx) {
+        return "ERROR: Prompt too long for context";
+    }
+
+    // Create sampler
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    if (temperature <= 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    } else {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(0));
+    }
+
+    // Process prompt
+    llama_batch batch = llama_batch_get_one(tokens.data(), (int32_t) tokens.size());
+    if (llama_decode(g_context, batch) != 0) {
+        llama_sampler_free(smpl);
+        return "ERROR: Failed to decode prompt";
+    }
+
+    // Generate tokens
+    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+    std::string result;
+    int n_generated = 0;
+    int max_gen = (maxTokens > 0) ? maxTokens : 128;
+
+    for (int i = 0; i < max_gen; i++) {
+        llama_token new_token = llama_sampler_sample(smpl, g_context, -1);
+
+        if (llama_vocab_is_eog(vocab, new_token)) {
+            ui_log("EOS at token %d", i + 1);
+            break;
+        }
+
+        // Convert token to text
+        char piece[256];
+        int n = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, true);
+        if (n > 0) {
+            result.append(piece, n);
+        }
+
+        // Decode single token
+        batch = llama_batch_get_one(&new_token, 1);
+        if (llama_decode(g_context, batch) != 0) {
+            ui_log("Decode failed at token %d", i + 1);
+            break;
+        }
+        n_generated++;
+    }
+
+    llama_sampler_free(smpl);
+    ui_log("Generated %d tokens", n_generated);
+
+    return result;
+}
+
+// ============================================
+// Train: Remove LoRA adapter (for comparison)
+// ============================================
+void train_remove_lora_adapter() {
+    if (worker_busy()) { ui_log("removeLoraAdapter: training worker is running, ignored"); return; }
+    checkpoint_reset();
+    if (g_adapter && g_context) {
+        llama_rm_adapter_lora(g_context, g_adapter);
+        llama_adapter_lora_free(g_adapter);
+        g_adapter = nullptr;
+        g_adapter_info = train_adapter_info();
+        ui_log("LoRA adapter removed");
+    }
+}
+
+// ============================================
+// Train: Check if adapter is loaded
+// ============================================
+bool train_has_adapter() {
+    return g_adapter != nullptr;
+}
+
+// ============================================
+// Train: Check if model is loaded
+// ============================================
+bool train_has_model() {
+    return g_model != nullptr && g_context != nullptr;
+}
+
+// ============================================
+// Train: Cleanup
+// ============================================
+void train_cleanup() {
+    ui_log("Cleaning up...");
+
+    worker_shutdown();
+    reset_data();
+    checkpoint_reset();
+    governor_reset(0);
+    if (g_adapter && g_context) { llama_rm_adapter_lora(g_context, g_adapter); }
+    if (g_adapter) { llama_adapter_lora_free(g_adapter); g_adapter = nullptr; }
+    if (g_context) { llama_free(g_context); g_context = nullptr; }
+    if (g_model)   { llama_model_free(g_model); g_model = nullptr; }
+    g_adapter_info = train_adapter_info();
+    if (g_backend_initialized) { llama_backend_free(); g_backend_initialized = false; }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+// Training engine — on-device LoRA fine-tuning through llama.cpp's ggml-opt.
+// Platform neutral (no JNI / Android deps): lora_train.cpp wraps it in JNI and
+// lora-cli's `train` command drives it directly on a workstation.
+//
+// Functions returning std::string follow the JNI convention: a status message, or "ERROR: ...".
+// Calls are not thread-safe; drive training from one thread. While a train_worker_* job runs,
+// calls that change or use the model, adapter, data or schedule return (or log) an
+// "ERROR: Training worker is running" instead; the worker_* calls and progress stay available.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Timing of the last train_epoch. One batch is one n_ubatch-token micro-batch (a whole
+// n_ctx window unless a micro-batch is set); eval batches run the forward pass only, train
+// batches add the backward pass, and the last micro-batch of each window the AdamW step.
+struct train_epoch_stats {
+    int64_t n_train_batches = 0;
+    int64_t n_eval_batches  = 0;
+    double  train_ms        = 0.0;
+    double  train_first_ms  = 0.0;   // First train batch alone (includes graph / buffer setup)
+    double  eval_ms         = 0.0;
+    double  train_loss      = 0.0;   // Mean over the epoch's train batches
+    double  eval_loss       = 0.0;
+    int     n_ctx           = 0;
+    int     n_ubatch        = 0;     // Tokens per batch
+    int     n_threads       = 0;     // Thread count at the end of the epoch (see the thread governor)
+};
+
+// Size and cost of the current adapter (train_get_adapter_info), measured from its GGUF
+// (train_create_lora_adapter saves the fresh adapter to a scratch file for this).
+struct train_adapter_info {
+    int64_t n_tensors       = 0;     // Adapted base tensors (lora_a / lora_b pairs)
+    int     n_layers        = 0;     // Blocks with at least one of them
+    int64_t n_params        = 0;
+    double  adapter_mb      = 0.0;   // A/B weights (also the saved adapter size)
+    double  train_mb        = 0.0;   // Weights + gradients + AdamW moments
+    double  mflop_per_token = 0.0;   // Extra forward cost (inference too)
+    double  flop_pct        = 0.0;   // ... relative to the base's matmuls
+};
+
+// Background training (train_worker_*): worker states and the progress snapshot
+enum train_state {
+    TRAIN_STATE_IDLE = 0,
+    TRAIN_STATE_RUNNING,
+    TRAIN_STATE_PAUSED,
+    TRAIN_STATE_CANCELLING,
+    TRAIN_STATE_DONE,
+    TRAIN_STATE_CANCELLED,
+    TRAIN_STATE_FAILED,
+};
+
+struct train_progress {
+    int     state        = TRAIN_STATE_IDLE;
+    int     epoch        = 0;     // Epoch index being trained
+    int64_t step         = 0;     // Optimizer steps (windows) done in it
+    int64_t n_steps      = 0;
+    double  loss         = 0.0;   // Running train loss of the epoch
+    double  tokens_per_s = 0.0;
+    double  elapsed_s    = 0.0;   // Training time of the epoch so far, pauses excluded
+    double  eta_s        = 0.0;   // Remaining training time of the job (eval excluded)
+    int     n_threads    = 0;     // Current thread count
+    float   temp_c       = -1.0f; // Hottest thermal zone at the governor's last reading, < 0 = none
+};
+
+bool        train_init_backend(const std::string & native_lib_dir);
+std::string train_load_model(const std::string & path, int n_threads, int n_ctx);
+std::string train_create_lora_adapter(int rank, float alpha, int n_layers_skip);
+std::string train_load_lora_adapter(const std::string & path);
+// Adapter only on the base tensors in target_modules: module names matched against
+// blk.N.<module>.weight ("attn_q", "attn_v", "ffn_down" ...; "output" for output.weight) or
+// globs over the full tensor name ("blk.1?.attn_*"). layer_ranks[N] is the rank of block N
+// (0 = no adapter there); blocks past its end and output use rank. The initial adapter is
+// written to init_path and loaded from there, so it trains, checkpoints and saves like a
+// loaded one. The result and the log report parameters, memory and extra FLOPs per token.
+std::string train_create_targeted_lora_adapter(const std::vector<std::string> & target_modules,
+                                               const std::vector<int> & layer_ranks,
+                                               int rank, float alpha, const std::string & init_path);
+void        train_get_adapter_info(train_adapter_info * info);
+// Data shorter than its n_ctx windows is EOS-padded: over 25% padding in the train windows
+// logs a warning, over 50% is refused with the n_ctx that would fit (set*Data / set*File).
+std::string train_set_training_data(const std::string & text);
+// Training windows per epoch: 0 (default) = every train window once, in order; N = N windows
+// sampled with replacement. Held-out documents (~5%) are evaluated after every epoch.
+void        train_set_steps_per_epoch(int steps);
+// Micro-batch (0 = whole window, the default): each n_ctx window runs as n_ctx / n_tokens
+// forward/backward passes whose gradients are accumulated into one optimizer step, so
+// activation memory scales with n_tokens rather than n_ctx. Rounded down to a divisor of
+// n_ctx. Applies at the next loadModel.
+void        train_set_micro_batch(int n_tokens);
+// QLoRA (off by default): map the base GGUF read-only and keep its weights in their stored
+// types (Q4 / Q8 ...), dequantized inside each matmul in forward and backward. LoRA A/B and
+// the AdamW moments stay F32. f16_kv stores the K/V cache in F16 instead of F32 (needs F16
+// OUT_PROD support in the backend). Applies at the next loadModel.
+void        train_set_qlora(bool quantized_base, bool f16_kv);
+// Thread governor (off by default): every few windows, reads the hottest thermal zone under
+// thermal_root ("" = /sys/class/thermal; a fake tree of thermal_zoneN/{type,temp} works for
+// tests) and the measured tokens/s, and moves the thread count between batches toward the
+// best sustained throughput: one thread fewer at max_temp_c (0 = 75 °C) or above, otherwise
+// occasional one-interval probes of a neighbouring count, kept only when they pay off.
+// Stays within [1, loadModel's thread count]; disabling restores that count.
+void        train_set_thread_governor(bool enabled, const std::string & thermal_root, float max_temp_c);
+// Packing (off by default): whole documents (JSONL lines) first-fit-decreasing packed into
+// non-overlapping n_ctx windows instead of stride n_ctx/2 windows over one stream.
+// Applies to the next setTrainingData / setTrainingFile.
+void        train_set_packing(bool enabled);
+// Directory for setTrainingData's token cache ("" = tokenize every time, the default)
+void        train_set_token_cache_dir(const std::string & dir);
+// Tokenizes a text / JSONL ("text" or "messages" per line) file on worker threads into the token cache
+// token_path (default: path + ".tokens"), or reuses it when source and vocab are unchanged,
+// and builds the dataset from its memory map
+std::string train_set_training_file(const std::string & path, const std::string & token_path);
+// Instruction-tuning data: conversations of role/content messages (roles[i], contents[i]),
+// turns_per_conversation[c] messages each, formatted with the model's chat template. Windows
+// holding prompt tokens alone are dropped; in the rest the loss covers every token, prompts
+// included (a per-token mask needs an ignore label in llama_opt_epoch, which it lacks).
+// A .jsonl training file can carry the same data as {"messages": [{"role", "content"}, ...]}.
+std::string train_set_chat_data(const std::vector<std::string> & roles,
+                                const std::vector<std::string> & contents,
+                                const std::vector<int> & turns_per_conversation);
+// Checkpoints (off by default): every every_n_steps optimizer steps (windows) of trainEpoch —
+// written from the progress callback between batches — and after each epoch, path gets the
+// adapter plus the training position (epoch, step), LR schedule and a data fingerprint, as
+// one GGUF that still loads as an adapter. Atomically replaced, so a killed process leaves
+// the previous checkpoint intact. The first checkpoint is written synchronously; later ones
+// only copy the LoRA tensors into a staging buffer on the training thread and are written
+// by a background thread. train_save_checkpoint waits for those, then writes synchronously.
+// No optimizer state is checkpointed (see train_resume_training).
+void        train_set_checkpoint(const std::string & path, int every_n_steps);
+std::string train_save_checkpoint(const std::string & path);
+// Resume from a checkpoint: call after loadModel and the same training data (instead of
+// create/loadLoraAdapter), then initTraining (the checkpoint's LR schedule wins) and
+// trainEpoch from train_get_resume_epoch(), which skips the windows already trained.
+// The adapter weights, data position and LR schedule are restored. The AdamW moments and step
+// count are not in the checkpoint (ggml-opt doesn't expose them), so they restart from zero
+// and resume is not bit-exact; to keep the restarted optimizer's first, near sign-sized updates
+// from kicking the adapter, the LR ramps up linearly over the first 16 steps after a resume.
+std::string train_resume_training(const std::string & path);
+int         train_get_resume_epoch();   // Epoch index to continue with, -1 = no resume pending
+std::string train_init_training(float learning_rate, int epochs);
+std::string train_epoch(int epoch_index);
+void        train_get_epoch_stats(train_epoch_stats * stats);
+// Background worker: runs trainEpoch(first_epoch .. first_epoch + n_epochs - 1) on its own
+// thread. Pause / resume / cancel are queued and take effect between batches; a cancelled
+// epoch keeps the completed steps (and writes the checkpoint, when one is set). Other train_*
+// calls must wait until the worker is idle again (train_worker_wait).
+std::string train_worker_start(int first_epoch, int n_epochs);
+void        train_worker_pause();
+void        train_worker_resume();
+void        train_worker_cancel();
+std::string train_worker_wait();                       // Blocks; last trainEpoch result
+void        train_get_progress(train_progress * out);  // Lock-free, cheap enough to poll per frame
+int         train_count_tokens(const std::string & text);   // -1 without a model
+std::string train_save_lora_adapter(const std::string & path);
+std::string train_generate(const std::string & prompt, int max_tokens, float temperature);
+void        train_remove_lora_adapter();
+bool        train_has_adapter();
+bool        train_has_model();
+void        train_cleanup();
@@ -0,0 +1,144 @@
+// Window planning on synthetic token ranges (no model or tokens needed): first-fit-decreasing
+// packing, long documents cut into n_ctx pieces, the eval split and sliding windows over a
+// corpus shorter than one window.
+//   ctest --test-dir build -R dataset
+
+#include "lora_dataset.h"
+
+#include <cstdio>
+#include <vector>
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); g_failures++; } \
+    } while (0)
+
+// Document tokens of window i
+static int64_t window_tokens(const dataset_plan & plan, int64_t i) {
+    const int64_t first = plan.window_begin[(size_t) i];
+    const int64_t last  = i + 1 < plan.n_windows() ? plan.window_begin[(size_t) i + 1] : (int64_t) plan.pieces.size();
+    int64_t n = 0;
+    for (int64_t p = first; p < last; p++) n += plan.pieces[(size_t) p].end - plan.pieces[(size_t) p].begin;
+    return n;
+}
+
+static void test_packed_ffd() {
+    // Documents of 6, 4, 3, 5, 2 and 4 tokens into n_ctx = 10. Decreasing order 6 5 4 4 3 2:
+    // [6 4] [5 4] [3 2] -> 3 windows, 1 + 5 tokens of filler
+    const std::vector<uint64_t> starts = { 0, 6, 10, 13, 18, 20 };
+    dataset_plan plan;
+    dataset_pack_stats stats;
+    dataset_plan_packed(starts.data(), starts.size(), 0, 24, 10, nullptr, &plan, &stats);
+
+    CHECK(plan.n_windows() == 3);
+    CHECK(plan.n_tokens() == 24);
+    CHECK(stats.n_docs == 6 && stats.n_split_docs == 0 && stats.n_dropped == 0);
+    CHECK(stats.n_pad == 3 * 10 - 24);
+    if (plan.n_windows() == 3) {
+        CHECK(window_tokens(plan, 0) == 10 && window_tokens(plan, 1) == 9 && window_tokens(plan, 2) == 5);
+        CHECK(plan.pieces[0].begin == 0 && plan.pieces[0].end == 6 && plan.pieces[0].doc_end == 6);
+        CHECK(plan.pieces[1].begin == 6 && plan.pieces[1].end == 10);
+    }
+
+    // Every document exactly once, whole
+    std::vector<int> seen(starts.size(), 0);
+    for (const dataset_piece & piece : plan.pieces) {
+        CHECK(piece.end == piece.doc_end);
+        for (size_t d = 0; d < starts.size(); d++) {
+            if ((uint64_t) piece.begin == starts[d]) seen[d]++;
+        }
+    }
+    for (int n : seen) CHECK(n == 1);
+}
+
+static void test_packed_long_document() {
+    // One 25-token document, n_ctx = 10: two full windows of its own, the 5-token tail packed
+    dataset_plan plan;
+    dataset_pack_stats stats;
+    dataset_plan_packed(nullptr, 0, 0, 25, 10, nullptr, &plan, &stats);
+
+    CHECK(plan.n_windows() == 3);
+    CHECK(stats.n_docs == 1 && stats.n_split_docs == 1 && stats.n_pad == 5);
+    CHECK(plan.pieces.size() == 3);
+    if (plan.pieces.size() == 3) {
+        CHECK(plan.pieces[0].begin == 0  && plan.pieces[0].end == 10 && plan.pieces[0].doc_end == 25);
+        CHECK(plan.pieces[1].begin == 10 && plan.pieces[1].end == 20 && plan.pieces[1].doc_end == 25);
+        CHECK(plan.pieces[2].begin == 20 && plan.pieces[2].end == 25 && plan.pieces[2].doc_end == 25);
+    }
+
+    // Pieces with no marked label are dropped: mark only the tail's tokens
+    std::vector<uint8_t> mask(25, 0);
+    for (int i = 21; i < 25; i++) mask[(size_t) i] = 1;
+    dataset_plan masked;
+    dataset_pack_stats masked_stats;
+    dataset_plan_packed(nullptr, 0, 0, 25, 10, mask.data(), &masked, &masked_stats);
+    CHECK(masked.n_windows() == 1 && masked_stats.n_dropped == 2);
+}
+
+static void test_split_eval() {
+    // 20 documents of 10 tokens: the last one (>= 5% of 200) is held out
+    std::vector<uint64_t> starts;
+    for (uint64_t d = 0; d < 20; d++) starts.push_back(d * 10);
+    const int64_t split = dataset_split_eval(starts.data(), starts.size(), 200, 8);
+    CHECK(split == 190);
+
+    // Train and eval windows on either side of it: no eval document is trained on
+    dataset_plan train, eval;
+    dataset_pack_stats stats;
+    dataset_plan_packed(starts.data(), starts.size(), 0, split, 8, nullptr, &train, &stats);
+    dataset_plan_packed(starts.data(), starts.size(), split, 200, 8, nullptr, &eval, &stats);
+    CHECK(train.n_windows() > 0 && eval.n_windows() > 0);
+    for (const dataset_piece & piece : train.pieces) CHECK(piece.doc_end <= split);
+    for (const dataset_piece & piece : eval.pieces)  CHECK(piece.begin >= split);
+    CHECK(train.n_tokens() + eval.n_tokens() == 200);
+
+    // Two documents: the first always stays in training
+    const std::vector<uint64_t> two = { 0, 100 };
+    CHECK(dataset_split_eval(two.data(), two.size(), 101, 8) == 100);
+
+    // One document: its tail, only when both sides fill a window
+    CHECK(dataset_split_eval(nullptr, 0, 1000, 100) == 1000 - 101);
+    CHECK(dataset_split_eval(nullptr, 0, 150, 100) == 150);
+}
+
+static void test_windows() {
+    // 31 tokens, n_ctx = 10, stride 5: windows start at 0, 5, 10, 15, 20
+    dataset_plan plan;
+    int64_t n_dropped = 0;
+    dataset_plan_windows(0, 31, 10, 5, nullptr, &plan, &n_dropped);
+    CHECK(plan.n_windows() == 5 && n_dropped == 0);
+    if (plan.n_windows() == 5) {
+        CHECK(plan.pieces[4].begin == 20 && plan.pieces[4].end == 30 && plan.pieces[4].doc_end == 31);
+    }
+
+    // Shorter than one window: the corpus once, the rest of the window EOS filler
+    dataset_plan short_plan;
+    dataset_plan_windows(0, 6, 10, 5, nullptr, &short_plan, &n_dropped);
+    CHECK(short_plan.n_windows() == 1 && short_plan.n_tokens() == 6);
+    if (short_plan.n_windows() == 1) {
+        CHECK(short_plan.pieces[0].begin == 0 && short_plan.pieces[0].end == 6 && short_plan.pieces[0].doc_end == 6);
+    }
+
+    // Nothing to predict, or only prompt labels
+    dataset_plan none;
+    dataset_plan_windows(0, 1, 10, 5, nullptr, &none, &n_dropped);
+    CHECK(none.n_windows() == 0);
+    const std::vector<uint8_t> prompt_only(31, 0);
+    dataset_plan_windows(0, 31, 10, 5, prompt_only.data(), &none, &n_dropped);
+    CHECK(none.n_windows() == 0 && n_dropped == 5);
+}
+
+int main() {
+    test_packed_ffd();
+    test_packed_long_document();
+    test_split_eval();
+    test_windows();
+
+    if (g_failures) {
+        fprintf(stderr, "%d check(s) failed\n", g_failures);
+        return 1;
+    }
+    printf("dataset plans: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Thread governor against a fake thermal tree: zone discovery, temperature parsing and the
+// hot / probe decisions. The governor is file-static, so the engine is compiled into this
+// test directly; no model or context is needed (governor_set_threads skips llama then).
+//   ctest --test-dir build -R governor
+
+#include "../lora_train_engine.cpp"
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); g_failures++; } \
+    } while (0)
+
+static void write_file(const std::string & path, const char * text) {
+    FILE * f = fopen(path.c_str(), "w");
+    if (!f) { fprintf(stderr, "can't write %s\n", path.c_str()); exit(1); }
+    fputs(text, f);
+    fclose(f);
+}
+
+static void add_zone(const std::string & root, int n, const char * type, const char * temp) {
+    const std::string zone = root + "/thermal_zone" + std::to_string(n);
+    mkdir(zone.c_str(), 0755);
+    write_file(zone + "/type", type);
+    write_file(zone + "/temp", temp);
+}
+
+static void test_zones(const std::string & root) {
+    // CPU zones (type matched case-insensitively) win over the rest
+    add_zone(root, 0, "battery\n", "30000\n");
+    add_zone(root, 1, "cpu-0-0-usr\n", "45000\n");
+    add_zone(root, 2, "CPU-1-1\n", "81500\n");
+    mkdir((root + "/cooling_device0").c_str(), 0755);
+
+    g_gov_root = root;
+    governor_find_zones();
+    CHECK(g_gov_zones.size() == 2);
+    CHECK(g_gov_zones.size() == 2 && g_gov_zones[0] == root + "/thermal_zone1/temp");
+    CHECK(governor_read_temp() == 81.5f);
+
+    // No CPU zone: every zone; whole degrees are taken as they are
+    write_file(root + "/thermal_zone1/type", "skin\n");
+    write_file(root + "/thermal_zone2/type", "gpu\n");
+    write_file(root + "/thermal_zone2/temp", "42\n");
+    governor_find_zones();
+    CHECK(g_gov_zones.size() == 3);
+    CHECK(governor_read_temp() == 45.0f);
+
+    // Unreadable zones are skipped, a missing tree has none
+    write_file(root + "/thermal_zone1/temp", "n/a\n");
+    CHECK(governor_read_temp() == 42.0f);
+    g_gov_root = root + "/missing";
+    governor_find_zones();
+    CHECK(g_gov_zones.empty());
+    CHECK(governor_read_temp() == -1.0f);
+}
+
+static void start(int threads, float temp_c) {
+    governor_reset(4);
+    g_gov_threads     = threads;
+    g_gov_max_c       = 75.0f;
+    g_gov_temp_c      = temp_c;
+    g_gov_since_probe = 0;
+    g_gov_probe_up    = true;
+}
+
+static void test_decisions() {
+    // Hot: one thread fewer every interval, never below 1
+    start(4, 80.0f);
+    governor_decide(100.0);
+    CHECK(g_gov_threads == 3 && g_gov_probe_from == 0);
+    start(1, 80.0f);
+    governor_decide(100.0);
+    CHECK(g_gov_threads == 1);
+
+    // Cool: a probe every GOV_PROBE_EVERY intervals, alternately up and down
+    start(3, 50.0f);
+    for (int i = 0; i < GOV_PROBE_EVERY - 1; i++) governor_decide(100.0);
+    CHECK(g_gov_threads == 3 && g_gov_probe_from == 0);
+    governor_decide(100.0);
+    CHECK(g_gov_threads == 4 && g_gov_probe_from == 3);
+    governor_decide(104.0);                 // More threads, > 3% faster: kept
+    CHECK(g_gov_threads == 4 && g_gov_probe_from == 0);
+    for (int i = 0; i < GOV_PROBE_EVERY; i++) governor_decide(104.0);
+    CHECK(g_gov_threads == 3 && g_gov_probe_from == 4);
+    governor_decide(100.0);                 // Fewer threads, > 2% slower: reverted
+    CHECK(g_gov_threads == 4 && g_gov_probe_from == 0);
+
+    // More than 3% is needed to keep an extra thread; fewer within 2% is kept
+    start(2, 50.0f);
+    for (int i = 0; i < GOV_PROBE_EVERY; i++) governor_decide(100.0);
+    CHECK(g_gov_threads == 3);
+    governor_decide(102.0);
+    CHECK(g_gov_threads == 2);
+    for (int i = 0; i < GOV_PROBE_EVERY; i++) governor_decide(100.0);
+    CHECK(g_gov_threads == 1);
+    governor_decide(98.5);
+    CHECK(g_gov_threads == 1);
+
+    // At the ceiling a cool probe goes down instead; warm (within the margin) always down
+    start(4, 50.0f);
+    for (int i = 0; i < GOV_PROBE_EVERY; i++) governor_decide(100.0);
+    CHECK(g_gov_threads == 3 && g_gov_probe_from == 4);
+    start(3, 72.0f);
+    g_gov_probe_up = true;
+    for (int i = 0; i < GOV_PROBE_EVERY; i++) governor_decide(100.0);
+    CHECK(g_gov_threads == 2 && g_gov_probe_from == 3);
+
+    // A probe cut short by the end of the phase is undone
+    governor_end_phase();
+    CHECK(g_gov_threads == 3 && g_gov_probe_from == 0);
+}
+
+int main() {
+    const char * tmp = getenv("TMPDIR");
+    std::string tmpl = std::string(tmp ? tmp : "/tmp") + "/lora-governor-XXXXXX";
+    std::vector<char> root(tmpl.begin(), tmpl.end());
+    root.push_back(0);
+    if (!mkdtemp(root.data())) {
+        fprintf(stderr, "mkdtemp %s failed\n", tmpl.c_str());
+        return 1;
+    }
+
+    test_zones(root.data());
+    test_decisions();
+
+    const std::string cmd = "rm -rf '" + std::string(root.data()) + "'";
+    if (system(cmd.c_str()) != 0) fprintf(stderr, "could not remove %s\n", root.data());
+
+    if (g_failures) {
+        fprintf(stderr, "%d check(s) failed\n", g_failures);
+        return 1;
+    }
+    printf("governor: all checks passed\n");
+    return 0;
+}
@@ -39,11 +39,98 @@ class LoraJNI {
 
     /**
      * Load a LoRA adapter and apply it to the current model
+     * The adapter stays resident in the adapter pool, so loading it again is instant.
      * @param loraPath Absolute path to LoRA adapter file (.gguf)
      * @return Success message or error
      */
     external fun loadLoraAdapter(loraPath: String): String
 
+    // ============================================
+    // Adapter pool (resident adapters, hot-swap)
+    // ============================================
+
+    /**
+     * Load a LoRA adapter into the pool without activating it.
+     * Loading the same file again returns the resident copy.
+     * @param loraPath Absolute path to LoRA adapter file (.gguf)
+     * @return Adapter ID, or -1 on failure
+     */
+    external fun loadAdapter(loraPath: String): Int
+
+    /** Free a pooled adapter (removed from the active set first) */
+    external fun unloadAdapter(adapterId: Int)
+
+    /**
+     * Activate any subset of pooled adapters, each with its own scale.
+     * This is the default set for sessions without their own (see setSessionAdapters).
+     * Switching doesn't touch disk or running generations; an empty set reverts to the base model.
+     * @param ids Adapter IDs from loadAdapter()
+     * @param scales Scale per adapter (parallel to ids)
+     * @return Success message or error
+     */
+    external fun setActiveAdapters(ids: IntArray, scales: FloatArray): String
+
+    /**
+     * Memory budget for resident adapters. Least recently used inactive
+     * adapters are freed when it's exceeded.
+     * @param maxBytes Budget in bytes (0 = default 512 MB)
+     */
+    external fun setAdapterBudget(maxBytes: Long)
+
+    /**
+     * Load a small draft model for speculative decoding.
+     * The draft proposes tokens that the main model verifies in one batched
+     * decode; output is identical to plain decoding, only faster when the
+     * draft guesses well. Must share the main model's vocabulary.
+     * @param draftPath Absolute path to the draft .gguf model
+     * @param nDraft Tokens proposed per step (0 = default 4)
+     * @return Success message or error
+     */
+    external fun loadDraftModel(draftPath: String, nDraft: Int = 4): String
+
+    /** Unload the draft model (back to plain decoding) */
+    external fun removeDraftModel()
+
+    /**
+     * Enable prompt lookup decoding — speculation without a draft model.
+     * Continuations of n-grams already present in the prompt or the output are
+     * proposed and verified in one batched decode. Best for copy/edit prompts.
+     * @param enabled Turn lookup decoding on or off
+     * @param nDraft Max tokens proposed per step (0 = default 8)
+     */
+    external fun setLookupDecoding(enabled: Boolean, nDraft: Int = 8)
+
+    /**
+     * Enable the on-disk prompt state cache.
+     * The state of a prompt's system-prompt prefix (the system messages as
+     * formatted by [applyChatTemplate]) is snapshotted once prefilled, written
+     * in the background, and restored on later calls (also after a restart)
+     * that start with it. Snapshots are tied to the model and adapter file.
+     * @param cacheDir Directory for cache files ("" = disable)
+     * @param maxBytes Size cap; least recently used files are deleted (0 = 256 MB)
+     */
+    external fun setPromptCache(cacheDir: String, maxBytes: Long = 0)
+
+    /**
+     * Merge a LoRA adapter into a base model and write a new GGUF.
+     * Each adapted tensor gets W + scale·(alpha/rank)·B·A and is re-quantized to
+     * the base tensor's type. The base is streamed one tensor at a time, so peak
+     * memory is about one tensor plus the adapter. The loaded model is untouched.
+     * @param basePath Base model .gguf
+     * @param adapterPath Adapter .gguf (e.g. from saveLoraAdapter)
+     * @param outputPath Merged model .gguf to write
+     * @param scale Adapter scale (1.0 = as trained)
+     * @param nThreads Worker threads (0 = all cores)
+     * @return Success message or error
+     */
+    external fun mergeLoraAdapter(
+        basePath: String,
+        adapterPath: String,
+        outputPath: String,
+        scale: Float = 1.0f,
+        nThreads: Int = 0
+    ): String
+
     /**
      * Apply the model's built-in chat template to format messages into a prompt.
      * @param roles Array of roles ("system", "user", "assistant")
@@ -58,7 +145,7 @@ class LoraJNI {
      * @param prompt Input text prompt
      * @param maxTokens Maximum tokens to generate
      * @param temperature Sampling temperature (0.0 = greedy, 0.7 = balanced, 1.0+ = creative)
-     * @return Generated text
+     * @return Generated text, or "ERROR: ..." (e.g. when every sequence is held by a session)
      */
     external fun generate(prompt: String, maxTokens: Int, temperature: Float): String
 
@@ -71,7 +158,59 @@ class LoraJNI {
      */
     external fun generateStreaming(prompt: String, maxTokens: Int, temperature: Float)
 
-    /** Remove currently loaded LoRA adapter (reverts to base model) */
+    // ============================================
+    // Sessions (one KV sequence per conversation)
+    // ============================================
+
+    /**
+     * Create an inference session with its own KV-cache sequence.
+     * The session keeps its prompt state between calls; idle sessions are
+     * evicted least-recently-used first when the context runs out of cells.
+     * @return Session handle, or -1 if all sequences are in use
+     */
+    external fun createSession(): Int
+
+    /** Destroy a session and free its KV-cache cells */
+    external fun destroySession(sessionId: Int)
+
+    /**
+     * Streaming generation on a session — only the part of the prompt that
+     * differs from the session's cached tokens is prefilled.
+     * Calls on different sessions may run concurrently from separate threads;
+     * they are decoded together in shared batches. Calls on the same session queue.
+     * @param sessionId Handle returned by createSession()
+     * @param prompt Full chat-templated prompt for this turn
+     * @param maxTokens Maximum tokens to generate
+     * @param temperature Sampling temperature
+     * @param callback Receives tokens for this session only
+     */
+    external fun generateSessionStreaming(
+        sessionId: Int,
+        prompt: String,
+        maxTokens: Int,
+        temperature: Float,
+        callback: StreamCallback
+    )
+
+    /**
+     * Give a session its own adapter set. Requests from sessions with different
+     * sets are grouped by the scheduler to keep adapter switches rare.
+     * @param sessionId Handle returned by createSession()
+     * @param ids Adapter IDs from loadAdapter(), or null to follow the default set
+     * @param scales Scale per adapter (parallel to ids)
+     * @return Success message or error
+     */
+    external fun setSessionAdapters(sessionId: Int, ids: IntArray?, scales: FloatArray?): String
+
+    /**
+     * Scheduler statistics as JSON: requests, steps, adapter_switches,
+     * avg_wait_ms / max_wait_ms (queued + paused for other adapter groups),
+     * queued, running, adapters_resident.
+     * @param reset Zero the counters after reading
+     */
+    external fun getSchedulerStats(reset: Boolean = false): String
+
+    /** Deactivate all LoRA adapters (reverts to base model, adapters stay pooled) */
     external fun removeLoraAdapter()
 
     /** Check if a LoRA adapter is currently loaded */
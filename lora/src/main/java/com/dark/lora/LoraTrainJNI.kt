@@ -0,0 +1,180 @@
+package com.dark.lora
+
+/**
+ * On-device LoRA fine-tuning (liblora_train.so).
+ * Separate from [LoraJNI]: it holds its own model and context, so load one
+ * for training here and run inference through [LoraJNI]. Functions returning
+ * String give a status message, or "ERROR: ...". Drive training from one thread;
+ * the training worker functions and [getTrainingProgress] are the exception.
+ * While a worker job runs, calls that change or use the model, adapter, data
+ * or schedule return "ERROR: Training worker is running" (setters are ignored).
+ */
+class LoraTrainJNI {
+    /** Register a callback to receive real-time log messages from native code */
+    external fun setLogCallback(callback: LoraJNI.LogCallback?)
+
+    /** Initialize llama.cpp backend with CPU support */
+    external fun initLlamaBackend(nativeLibDir: String): Boolean
+
+    // ============================================
+    // Model / adapter
+    // ============================================
+
+    /**
+     * Load a GGUF model for training (applies setMicroBatch / setQLoRA set before)
+     * @param modelPath Absolute path to .gguf model file
+     * @param nThreads Number of threads (0 = auto)
+     * @param nCtx Training window size (0 = 512)
+     */
+    external fun loadModel(modelPath: String, nThreads: Int, nCtx: Int): String
+
+    /**
+     * Create a fresh LoRA adapter on every weight matrix
+     * @param rank LoRA rank
+     * @param alpha LoRA alpha (scale = alpha / rank)
+     * @param nLayersSkip Leading blocks left without an adapter
+     */
+    external fun createLoraAdapter(rank: Int, alpha: Float, nLayersSkip: Int): String
+
+    /**
+     * Create a LoRA adapter on selected modules, with an optional rank per block
+     * @param targets Module names ("attn_q", "ffn_down", "output") or globs over the tensor name ("blk.1?.attn_*")
+     * @param layerRanks Rank per block, 0 = no adapter there (null = rank everywhere)
+     * @param rank Default rank
+     * @param alpha LoRA alpha
+     * @param initPath Where the initial adapter GGUF is written
+     */
+    external fun createTargetedLoraAdapter(
+        targets: Array<String>,
+        layerRanks: IntArray?,
+        rank: Int,
+        alpha: Float,
+        initPath: String
+    ): String
+
+    /**
+     * Size and cost of the current adapter:
+     * [tensors, layers, params, adapter MB, training MB, MFLOP/token, % of base FLOPs]
+     */
+    external fun getAdapterInfo(): DoubleArray
+
+    /** Load an existing LoRA adapter to continue training it */
+    external fun loadLoraAdapter(loraPath: String): String
+
+    /** Save the trained adapter as GGUF */
+    external fun saveLoraAdapter(outputPath: String): String
+
+    /** Detach the adapter (to compare against the base model) */
+    external fun removeLoraAdapter()
+
+    external fun hasAdapter(): Boolean
+
+    external fun hasModel(): Boolean
+
+    // ============================================
+    // Options (before loadModel / setTrainingData)
+    // ============================================
+
+    /** Windows per epoch (0 = every training window once) */
+    external fun setStepsPerEpoch(steps: Int)
+
+    /** Micro-batch tokens for the next loadModel (0 = whole window) */
+    external fun setMicroBatch(nTokens: Int)
+
+    /** Keep the quantized base weights mapped (QLoRA) and/or use an F16 KV cache, next loadModel */
+    external fun setQLoRA(quantizedBase: Boolean, f16Cache: Boolean)
+
+    /**
+     * Adjust the thread count during training from temperature and measured throughput
+     * @param thermalRoot Thermal zone directory ("" = /sys/class/thermal)
+     * @param maxTempC Back off at this temperature (0 = 75 °C)
+     */
+    external fun setThreadGovernor(enabled: Boolean, thermalRoot: String = "", maxTempC: Float = 0f)
+
+    /** Pack whole documents into windows for the next setTrainingData / setTrainingFile */
+    external fun setSequencePacking(enabled: Boolean)
+
+    /** Token cache directory for setTrainingData ("" = off) */
+    external fun setTokenCacheDir(cacheDir: String)
+
+    // ============================================
+    // Training data
+    // ============================================
+
+    /** Plain training text; refused when over half of the train windows would be EOS padding (lower nCtx) */
+    external fun setTrainingData(trainingText: String): String
+
+    /**
+     * Training data from a text or JSONL file, tokenized into a reusable token cache
+     * @param tokenPath Token cache file ("" = dataPath + ".tokens")
+     */
+    external fun setTrainingFile(dataPath: String, tokenPath: String = ""): String
+
+    /**
+     * Instruction-tuning conversations, formatted with the model's chat template.
+     * Windows without an assistant reply are dropped; the loss of the rest still
+     * covers every token, prompts included.
+     * @param roles Role per message
+     * @param contents Content per message (parallel to roles)
+     * @param turns Messages per conversation
+     */
+    external fun setChatTrainingData(roles: Array<String>, contents: Array<String>, turns: IntArray): String
+
+    // ============================================
+    // Checkpoints
+    // ============================================
+
+    /** Checkpoint every N steps and after each epoch ("" = off) */
+    external fun setCheckpoint(path: String, everyNSteps: Int)
+
+    external fun saveCheckpoint(path: String): String
+
+    /**
+     * Resume from a checkpoint, after loadModel and the same training data.
+     * Not bit-exact: the AdamW state restarts from zero, so the LR is ramped
+     * up over the first 16 steps.
+     */
+    external fun resumeTraining(path: String): String
+
+    /** Epoch to continue with after resumeTraining, -1 = no resume pending */
+    external fun getResumeEpoch(): Int
+
+    // ============================================
+    // Training
+    // ============================================
+
+    external fun initTraining(learningRate: Float, epochs: Int): String
+
+    /** Train one epoch on the calling thread */
+    external fun trainEpoch(epochIndex: Int): String
+
+    /** Train epochs on a native background thread */
+    external fun startTrainingWorker(firstEpoch: Int, nEpochs: Int): String
+
+    external fun pauseTrainingWorker()
+
+    external fun resumeTrainingWorker()
+
+    external fun cancelTrainingWorker()
+
+    /** Block until the worker stops; returns the last trainEpoch result */
+    external fun waitTrainingWorker(): String
+
+    /**
+     * Worker progress, cheap enough to poll per frame:
+     * [state, epoch, step, steps, loss, tokens/s, elapsed s, ETA s, threads, temperature °C]
+     */
+    external fun getTrainingProgress(): DoubleArray
+
+    /** Generate with the training model (quick check of the adapter) */
+    external fun generate(prompt: String, maxTokens: Int, temperature: Float): String
+
+    /** Cleanup and free all resources */
+    external fun cleanupLlama()
+
+    companion object {
+        init {
+            System.loadLibrary("lora_train")
+        }
+    }
+}